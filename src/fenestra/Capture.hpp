@@ -0,0 +1,154 @@
+#pragma once
+
+#include "Plugin.hpp"
+#include "Probe.hpp"
+#include "Clock.hpp"
+#include "VideoFrame.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace fenestra {
+
+// Delivers captured frames to capture plugins (SSR, v4l2, gstreamer)
+// off the game thread.  Each sink gets its own worker thread and a
+// bounded queue; if a sink falls behind, its oldest queued frame is
+// dropped, so a slow sink never holds up the game or the other sinks.
+class CapturePipeline {
+public:
+  using Frame_Ptr = FramePool::Frame_Ptr;
+
+  explicit CapturePipeline(unsigned int queue_depth)
+    : queue_depth_(queue_depth)
+  {
+  }
+
+  bool empty() const { return sinks_.empty(); }
+
+  void add_sink(Plugin & plugin, std::string const & name) {
+    sinks_.emplace_back(std::make_unique<Sink>(plugin, name, queue_depth_));
+  }
+
+  void push(Frame_Ptr const & frame) {
+    for (auto & sink : sinks_) {
+      sink->push(frame);
+    }
+  }
+
+  void collect_metrics(Probe & probe, Probe::Dictionary & dictionary) {
+    for (auto & sink : sinks_) {
+      sink->collect_metrics(probe, dictionary);
+    }
+  }
+
+private:
+  class Sink {
+  public:
+    Sink(Plugin & plugin, std::string const & name, unsigned int queue_depth)
+      : plugin_(plugin)
+      , name_(name)
+      , queue_depth_(std::max(queue_depth, 1u))
+      , th_([this] { run(); })
+    {
+    }
+
+    ~Sink() {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        done_ = true;
+      }
+
+      cond_.notify_one();
+      th_.join();
+    }
+
+    void push(Frame_Ptr const & frame) {
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+
+        if (queue_.size() >= queue_depth_) {
+          queue_.pop_front();
+          ++dropped_;
+        }
+
+        queue_.push_back(frame);
+      }
+
+      cond_.notify_one();
+    }
+
+    void collect_metrics(Probe & probe, Probe::Dictionary & dictionary) {
+      if (!latency_key_) latency_key_ = dictionary.define("Capture latency: " + name_, 1000);
+      if (!dropped_key_) dropped_key_ = dictionary["Capture dropped: " + name_];
+
+      probe.meter(*latency_key_, Probe::VALUE, 0, latency_us_.load());
+      probe.meter(*dropped_key_, Probe::VALUE, 0, dropped_.load());
+    }
+
+  private:
+    void run() {
+      std::unique_lock<std::mutex> lock(mutex_);
+
+      for (;;) {
+        cond_.wait(lock, [&] { return done_ || !queue_.empty(); });
+
+        // Frames still queued when stopping are delivered first, so a
+        // recording gets everything up to the end
+        if (queue_.empty()) {
+          break;
+        }
+
+        auto frame = std::move(queue_.front());
+        queue_.pop_front();
+
+        lock.unlock();
+
+        try {
+          plugin_.capture_frame(*frame);
+        } catch(std::exception const & ex) {
+          std::cout << "error during capture (" << name_ << "): " << ex.what() << std::endl;
+        }
+
+        // Time from the core producing the frame until the sink is done
+        // with it
+        auto latency = Clock::gettime(CLOCK_MONOTONIC) - frame->time();
+        latency_us_ = std::chrono::duration_cast<std::chrono::microseconds>(latency).count();
+
+        frame.reset();
+        lock.lock();
+      }
+    }
+
+  private:
+    Plugin & plugin_;
+    std::string name_;
+    std::size_t queue_depth_;
+
+    std::mutex mutex_;
+    std::condition_variable cond_;
+    std::deque<Frame_Ptr> queue_;
+    bool done_ = false;
+
+    std::atomic<std::uint64_t> latency_us_ = 0;
+    std::atomic<std::uint64_t> dropped_ = 0;
+    std::optional<Probe::Key> latency_key_;
+    std::optional<Probe::Key> dropped_key_;
+
+    std::thread th_;
+  };
+
+private:
+  unsigned int queue_depth_;
+  std::vector<std::unique_ptr<Sink>> sinks_;
+};
+
+}
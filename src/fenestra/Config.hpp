@@ -28,7 +28,10 @@ public:
   }
 
   void load(std::string const & filename) {
-    auto v = json::read_file(filename);
+    merge(json::read_file(filename));
+  }
+
+  void merge(Json::Value const & v) {
     json::merge(cfg_, v);
     refresh();
   }
@@ -141,6 +141,9 @@ private:
           *static_cast<char const * *>(data) = current->save_directory_.c_str();
           return true;
 
+        case RETRO_ENVIRONMENT_SET_MEMORY_MAPS: // 36 (experimental)
+          return current->frontend().set_memory_maps(*static_cast<retro_memory_map const *>(data));
+
         case RETRO_ENVIRONMENT_SET_PERFORMANCE_LEVEL: // 8
         case RETRO_ENVIRONMENT_SET_INPUT_DESCRIPTORS: // 11
         case RETRO_ENVIRONMENT_GET_VARIABLE: // 15
@@ -150,7 +153,6 @@ private:
         case RETRO_ENVIRONMENT_SET_CONTROLLER_INFO: // 35
         case RETRO_ENVIRONMENT_SET_GEOMETRY: // 37
         case RETRO_ENVIRONMENT_GET_CORE_OPTIONS_VERSION: // 52
-        case RETRO_ENVIRONMENT_SET_MEMORY_MAPS: // 36 (experimental)
         case RETRO_ENVIRONMENT_SET_SUPPORT_ACHIEVEMENTS: // 42 (experimental)
         case RETRO_ENVIRONMENT_GET_AUDIO_VIDEO_ENABLE: // 47 (experimental)
           // TODO
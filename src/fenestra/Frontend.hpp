@@ -8,6 +8,9 @@
 #include "Plugin.hpp"
 #include "Probe.hpp"
 #include "Clock.hpp"
+#include "VideoFrame.hpp"
+#include "Capture.hpp"
+#include "MemoryMap.hpp"
 
 #include <string>
 #include <vector>
@@ -49,6 +52,7 @@ public:
     , scale_factor_(config.fetch<float>("scale_factor", 6.0f))
     , window_(title, config_)
     , probe_dict_()
+    , capture_(config.fetch<unsigned int>("capture.queue_depth", 2))
   {
   }
 
@@ -92,6 +96,10 @@ public:
     if (!std::is_same_v<decltype(&T::poll_input), decltype(&Plugin::poll_input)>) {
       poll_input_plugins_.emplace_back(probe_dict_, plugin, "Input: " + full_name);
     }
+
+    if (!std::is_same_v<decltype(&T::capture_frame), decltype(&Plugin::capture_frame)> && plugin.wants_capture()) {
+      capture_.add_sink(plugin, full_name);
+    }
   }
 
   bool paused() const { return state_.paused; }
@@ -127,6 +135,8 @@ public:
     for (auto const & plugin : plugins_) {
       plugin->collect_metrics(probe, probe_dict_);
     }
+
+    capture_.collect_metrics(probe, probe_dict_);
   }
 
   void record_probe(Probe const & probe) {
@@ -157,9 +167,26 @@ public:
     for (auto const & plugin : plugins_) {
       plugin->game_unloaded(core_);
     }
+
+    set_memory_map(MemoryMap());
+  }
+
+  bool set_memory_maps(retro_memory_map const & map) {
+    set_memory_map(MemoryMap(map));
+    return true;
+  }
+
+  void set_memory_map(MemoryMap map) {
+    memory_map_ = std::move(map);
+
+    for (auto const & plugin : plugins_) {
+      plugin->set_memory_map(memory_map_);
+    }
   }
 
   bool video_set_pixel_format(retro_pixel_format format) {
+    pixel_format_ = format;
+
     for (auto const & plugin : plugins_) {
       plugin->set_pixel_format(format);
     }
@@ -188,12 +215,29 @@ public:
   }
 
   void video_refresh(const void * data, unsigned int width, unsigned int height, std::size_t pitch) {
-    if (data) {
-      for (auto const & plugin : video_refresh_plugins_) {
-        probe_.mark(plugin.probe_key(), Probe::START, 1, Clock::gettime(CLOCK_MONOTONIC));
-        plugin->video_refresh(data, width, height, pitch);
-        probe_.mark(plugin.probe_key(), Probe::END, 1, Clock::gettime(CLOCK_MONOTONIC));
-      }
+    if (!data) {
+      return;
+    }
+
+    VideoFrame view(data, width, height, pitch, pixel_format_, Clock::gettime(CLOCK_MONOTONIC), frame_number_++);
+
+    // Capture sinks need a copy that outlives this call; everything
+    // else reads that same copy instead of making its own.  Without any
+    // capture sinks, consumers read the core's buffer directly.
+    FramePool::Frame_Ptr snapshot;
+    if (!capture_.empty()) {
+      probe_.mark(capture_key_, Probe::START, 1, Clock::gettime(CLOCK_MONOTONIC));
+      snapshot = frame_pool_.snapshot(view);
+      capture_.push(snapshot);
+      probe_.mark(capture_key_, Probe::END, 1, Clock::gettime(CLOCK_MONOTONIC));
+    }
+
+    auto const & frame = snapshot ? *snapshot : view;
+
+    for (auto const & plugin : video_refresh_plugins_) {
+      probe_.mark(plugin.probe_key(), Probe::START, 1, Clock::gettime(CLOCK_MONOTONIC));
+      plugin->video_refresh(frame);
+      probe_.mark(plugin.probe_key(), Probe::END, 1, Clock::gettime(CLOCK_MONOTONIC));
     }
   }
 
@@ -269,6 +313,12 @@ private:
 
   State state_;
 
+  // libretro's default, for cores that never set a pixel format
+  retro_pixel_format pixel_format_ = RETRO_PIXEL_FORMAT_0RGB1555;
+  std::uint64_t frame_number_ = 0;
+
+  MemoryMap memory_map_;
+
   Window window_;
   Probe probe_;
 
@@ -277,6 +327,12 @@ private:
   std::vector<PluginSlot> video_refresh_plugins_;
   std::vector<PluginSlot> audio_sample_plugins_;
   std::vector<PluginSlot> poll_input_plugins_;
+
+  // Declared after the plugins, so capture threads are stopped before
+  // the plugins they call into are destroyed
+  FramePool frame_pool_;
+  CapturePipeline capture_;
+  Probe::Key capture_key_ = probe_dict_["Video: capture"];
 };
 
 }
@@ -0,0 +1,222 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+namespace fenestra {
+
+// Streaming XXH64.  Output is identical to the reference implementation
+// (and to xxhsum -H1), so hashes can be checked with external tools.
+class Hash64 {
+public:
+  explicit Hash64(std::uint64_t seed = 0) {
+    reset(seed);
+  }
+
+  void reset(std::uint64_t seed = 0) {
+    seed_ = seed;
+    v_[0] = seed + P1 + P2;
+    v_[1] = seed + P2;
+    v_[2] = seed;
+    v_[3] = seed - P1;
+    total_ = 0;
+    buffered_ = 0;
+  }
+
+  void update(void const * data, std::size_t size) {
+    auto const * p = static_cast<std::uint8_t const *>(data);
+    total_ += size;
+
+    if (buffered_ + size < sizeof(buf_)) {
+      std::memcpy(buf_ + buffered_, p, size);
+      buffered_ += size;
+      return;
+    }
+
+    if (buffered_ > 0) {
+      auto n = sizeof(buf_) - buffered_;
+      std::memcpy(buf_ + buffered_, p, n);
+      stripe(buf_);
+      p += n;
+      size -= n;
+      buffered_ = 0;
+    }
+
+    // The four lanes are independent, so this loop keeps several
+    // multiplies in flight at once
+    auto v0 = v_[0], v1 = v_[1], v2 = v_[2], v3 = v_[3];
+    while (size >= sizeof(buf_)) {
+      v0 = round(v0, read64(p));
+      v1 = round(v1, read64(p + 8));
+      v2 = round(v2, read64(p + 16));
+      v3 = round(v3, read64(p + 24));
+      p += sizeof(buf_);
+      size -= sizeof(buf_);
+    }
+    v_[0] = v0; v_[1] = v1; v_[2] = v2; v_[3] = v3;
+
+    std::memcpy(buf_, p, size);
+    buffered_ = size;
+  }
+
+  template <typename T>
+  void update(T const & value) {
+    update(&value, sizeof(value));
+  }
+
+  std::uint64_t digest() const {
+    std::uint64_t h;
+
+    if (total_ >= sizeof(buf_)) {
+      h = rotl(v_[0], 1) + rotl(v_[1], 7) + rotl(v_[2], 12) + rotl(v_[3], 18);
+      for (auto v : v_) {
+        h = merge_round(h, v);
+      }
+    } else {
+      h = seed_ + P5;
+    }
+
+    h += total_;
+
+    auto const * p = buf_;
+    auto size = buffered_;
+
+    for (; size >= 8; p += 8, size -= 8) {
+      h ^= round(0, read64(p));
+      h = rotl(h, 27) * P1 + P4;
+    }
+
+    if (size >= 4) {
+      h ^= std::uint64_t(read32(p)) * P1;
+      h = rotl(h, 23) * P2 + P3;
+      p += 4;
+      size -= 4;
+    }
+
+    for (; size > 0; ++p, --size) {
+      h ^= *p * P5;
+      h = rotl(h, 11) * P1;
+    }
+
+    h ^= h >> 33;
+    h *= P2;
+    h ^= h >> 29;
+    h *= P3;
+    h ^= h >> 32;
+    return h;
+  }
+
+  static std::uint64_t of(void const * data, std::size_t size, std::uint64_t seed = 0) {
+    Hash64 hash(seed);
+    hash.update(data, size);
+    return hash.digest();
+  }
+
+private:
+  static constexpr std::uint64_t P1 = 0x9E3779B185EBCA87ULL;
+  static constexpr std::uint64_t P2 = 0xC2B2AE3D27D4EB4FULL;
+  static constexpr std::uint64_t P3 = 0x165667B19E3779F9ULL;
+  static constexpr std::uint64_t P4 = 0x85EBCA77C2B2AE63ULL;
+  static constexpr std::uint64_t P5 = 0x27D4EB2F165667C5ULL;
+
+  static std::uint64_t rotl(std::uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+  }
+
+  static std::uint64_t read64(std::uint8_t const * p) {
+    std::uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+  }
+
+  static std::uint32_t read32(std::uint8_t const * p) {
+    std::uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+  }
+
+  static std::uint64_t round(std::uint64_t acc, std::uint64_t input) {
+    acc += input * P2;
+    acc = rotl(acc, 31);
+    return acc * P1;
+  }
+
+  static std::uint64_t merge_round(std::uint64_t acc, std::uint64_t v) {
+    acc ^= round(0, v);
+    return acc * P1 + P4;
+  }
+
+  void stripe(std::uint8_t const * p) {
+    for (int i = 0; i < 4; ++i) {
+      v_[i] = round(v_[i], read64(p + 8 * i));
+    }
+  }
+
+private:
+  std::uint64_t seed_;
+  std::uint64_t v_[4];
+  std::uint64_t total_;
+  std::uint8_t buf_[32];
+  std::size_t buffered_;
+};
+
+// Streaming CRC-32 (the zlib/PNG polynomial), as retroarch reports for
+// content.  Slice-by-8: eight table lookups per eight bytes, instead of
+// one lookup per byte with a dependency on the previous one.
+class Crc32 {
+public:
+  void update(void const * data, std::size_t size) {
+    auto const * p = static_cast<std::uint8_t const *>(data);
+    auto crc = ~crc_;
+
+    for (; size >= 8; p += 8, size -= 8) {
+      std::uint32_t lo, hi;
+      std::memcpy(&lo, p, sizeof(lo));
+      std::memcpy(&hi, p + 4, sizeof(hi));
+      lo ^= crc;
+      crc = tables[7][lo & 0xff] ^ tables[6][(lo >> 8) & 0xff] ^
+            tables[5][(lo >> 16) & 0xff] ^ tables[4][lo >> 24] ^
+            tables[3][hi & 0xff] ^ tables[2][(hi >> 8) & 0xff] ^
+            tables[1][(hi >> 16) & 0xff] ^ tables[0][hi >> 24];
+    }
+
+    for (; size > 0; ++p, --size) {
+      crc = tables[0][(crc ^ *p) & 0xff] ^ (crc >> 8);
+    }
+
+    crc_ = ~crc;
+  }
+
+  std::uint32_t digest() const { return crc_; }
+
+  static std::uint32_t of(void const * data, std::size_t size) {
+    Crc32 crc;
+    crc.update(data, size);
+    return crc.digest();
+  }
+
+private:
+  // tables[k][b] is the crc of byte b followed by k zero bytes
+  static constexpr inline auto tables = [] {
+    std::array<std::array<std::uint32_t, 256>, 8> t { };
+    for (std::uint32_t i = 0; i < 256; ++i) {
+      auto c = i;
+      for (int j = 0; j < 8; ++j) {
+        c = (c & 1) ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+      }
+      t[0][i] = c;
+    }
+    for (std::size_t k = 1; k < 8; ++k) {
+      for (std::size_t i = 0; i < 256; ++i) {
+        t[k][i] = t[0][t[k - 1][i] & 0xff] ^ (t[k - 1][i] >> 8);
+      }
+    }
+    return t;
+  }();
+
+  std::uint32_t crc_ = 0;
+};
+
+}
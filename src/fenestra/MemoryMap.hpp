@@ -0,0 +1,289 @@
+#pragma once
+
+#include "libretro.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <vector>
+
+namespace fenestra {
+
+// The emulated address space described by a core's
+// RETRO_ENVIRONMENT_SET_MEMORY_MAPS descriptors.
+//
+// Descriptors are normalized the same way retroarch does it (a zero
+// select or len is inferred, and disconnect bits above the top of the
+// chip are added), then every address range a descriptor claims is
+// compiled into a sorted table of non-overlapping regions.  The first
+// descriptor to claim an address wins, so a lookup is a single binary
+// search, no matter how many mirrors the core describes.
+class MemoryMap {
+public:
+  struct Descriptor {
+    std::uint64_t flags;
+    std::uint8_t * ptr;
+    std::size_t offset;
+    std::size_t start;
+    std::size_t select;
+    std::size_t disconnect;
+    std::size_t len;
+    std::size_t disconnect_mask;
+  };
+
+  // Where an emulated address lives in the core's memory, and how many
+  // bytes from there on are contiguous in both address spaces.  For an
+  // unmapped address, ptr is null and bytes is how far it is to the
+  // next mapped address (or 0 if there is none).
+  struct Translation {
+    std::uint8_t * ptr = nullptr;
+    std::size_t bytes = 0;
+    Descriptor const * descriptor = nullptr;
+  };
+
+  MemoryMap() { }
+
+  explicit MemoryMap(retro_memory_map const & map) {
+    descriptors_.reserve(map.num_descriptors);
+
+    for (unsigned int i = 0; i < map.num_descriptors; ++i) {
+      auto const & d = map.descriptors[i];
+      descriptors_.push_back({ d.flags, static_cast<std::uint8_t *>(d.ptr), d.offset, d.start, d.select, d.disconnect, d.len, 0 });
+    }
+
+    preprocess();
+    compile();
+  }
+
+  bool empty() const { return descriptors_.empty(); }
+
+  auto const & descriptors() const { return descriptors_; }
+
+  std::size_t num_regions() const { return regions_.size(); }
+
+  Translation translate(std::size_t address) const {
+    auto it = std::upper_bound(regions_.begin(), regions_.end(), address, [](std::size_t a, Region const & r) { return a < r.end; });
+    if (it == regions_.end()) {
+      return { };
+    }
+
+    if (address < it->begin) {
+      return { nullptr, it->begin - address, nullptr };
+    }
+
+    auto const & desc = descriptors_[it->descriptor];
+    if (!desc.ptr) {
+      return { nullptr, it->end - address, &desc };
+    }
+
+    auto rel = (address - desc.start) & desc.disconnect_mask;
+
+    // The mapping is linear until a disconnected (or masked off) bit
+    // would change
+    auto nonlinear = desc.disconnect | ~desc.disconnect_mask;
+    auto step = nonlinear & -nonlinear;
+    auto bytes = step ? step - (rel & (step - 1)) : ~std::size_t(0);
+
+    auto off = reduce(rel, desc.disconnect);
+
+    // ...and until the offset would wrap around len
+    auto pow2 = add_bits_down(desc.len - 1) + 1;
+    if (pow2) {
+      bytes = std::min(bytes, pow2 - (off & (pow2 - 1)));
+    }
+    while (off >= desc.len) {
+      off -= highest_bit(off);
+    }
+    bytes = std::min(bytes, desc.len - off);
+
+    bytes = std::min(bytes, it->end - address);
+
+    return { desc.ptr + desc.offset + off, bytes, &desc };
+  }
+
+private:
+  struct Region {
+    std::size_t begin;
+    std::size_t end;
+    std::size_t descriptor;
+  };
+
+  static std::size_t add_bits_down(std::size_t n) {
+    n |= n >> 1;
+    n |= n >> 2;
+    n |= n >> 4;
+    n |= n >> 8;
+    n |= n >> 16;
+    if constexpr (sizeof(n) > 4) {
+      n |= n >> 32;
+    }
+    return n;
+  }
+
+  static std::size_t highest_bit(std::size_t n) {
+    n = add_bits_down(n);
+    return n ^ (n >> 1);
+  }
+
+  // Inserts a zero bit into addr at each bit set in mask
+  static std::size_t inflate(std::size_t addr, std::size_t mask) {
+    while (mask) {
+      std::size_t tmp = (mask - 1) & ~mask;
+      addr = ((addr & ~tmp) << 1) | (addr & tmp);
+      mask = mask & (mask - 1);
+    }
+    return addr;
+  }
+
+  // Removes the bits set in mask from addr
+  static std::size_t reduce(std::size_t addr, std::size_t mask) {
+    while (mask) {
+      std::size_t tmp = (mask - 1) & ~mask;
+      addr = (addr & tmp) | ((addr >> 1) & ~tmp);
+      mask = (mask & (mask - 1)) >> 1;
+    }
+    return addr;
+  }
+
+  // A descriptor that can't be normalized is skipped, as retroarch
+  // does, rather than losing the whole map.  It may have raised the top
+  // address, so the others are normalized again without it.
+  void preprocess() {
+    for (;;) {
+      top_addr_ = 1;
+      for (auto const & desc : descriptors_) {
+        top_addr_ |= desc.select ? desc.select : desc.start + desc.len - 1;
+      }
+      top_addr_ = add_bits_down(top_addr_);
+
+      auto normalized = descriptors_;
+      std::size_t bad = 0;
+      char const * error = nullptr;
+      for (; bad < normalized.size(); ++bad) {
+        if ((error = normalize(normalized[bad], top_addr_))) {
+          break;
+        }
+      }
+
+      if (!error) {
+        descriptors_ = std::move(normalized);
+        return;
+      }
+
+      std::cout << "Skipping memory descriptor at " << std::hex << descriptors_[bad].start << std::dec << ": " << error << std::endl;
+      descriptors_.erase(descriptors_.begin() + bad);
+    }
+  }
+
+  // Returns why the descriptor is invalid, or null if it is not
+  static char const * normalize(Descriptor & desc, std::size_t top_addr) {
+    if (desc.select == 0) {
+      if (desc.len == 0 || (desc.len & (desc.len - 1)) != 0) {
+        return "no select, and len is not a power of two";
+      }
+      desc.select = top_addr & ~inflate(add_bits_down(desc.len - 1), desc.disconnect);
+    }
+
+    if (desc.len == 0) {
+      desc.len = add_bits_down(reduce(top_addr & ~desc.select, desc.disconnect)) + 1;
+    }
+
+    if (desc.start & ~desc.select) {
+      return "start has bits outside of select";
+    }
+
+    auto highest_reachable = inflate(desc.len - 1, desc.disconnect);
+    while (highest_bit(top_addr & ~desc.select & ~desc.disconnect) > highest_bit(highest_reachable)) {
+      desc.disconnect |= highest_bit(top_addr & ~desc.select & ~desc.disconnect);
+    }
+
+    desc.disconnect_mask = add_bits_down(desc.len - 1);
+    desc.disconnect &= desc.disconnect_mask;
+
+    while ((~desc.disconnect_mask >> 1) & desc.disconnect) {
+      desc.disconnect_mask >>= 1;
+      desc.disconnect &= desc.disconnect_mask;
+    }
+
+    return nullptr;
+  }
+
+  // Each descriptor claims every address whose select bits match its
+  // start, which is 2^n blocks of the size given by the lowest select
+  // bit (n being the number of unselected bits above it)
+  void compile() {
+    static constexpr std::size_t max_regions = 1 << 20;
+
+    std::vector<Region> claimed;
+
+    for (std::size_t i = 0; i < descriptors_.size(); ++i) {
+      auto const & desc = descriptors_[i];
+      auto select = desc.select & top_addr_;
+      auto block = select ? select & -select : top_addr_ + 1;
+      auto high = top_addr_ & ~select & ~(block - 1);
+
+      std::vector<Region> mine;
+      std::size_t s = 0;
+      do {
+        auto begin = (desc.start & select) | s;
+        mine.push_back({ begin, begin + block, i });
+        s = (s - high) & high;
+      } while (s != 0 && mine.size() + claimed.size() <= max_regions);
+
+      // Like an invalid descriptor, one with too many mirrors claims
+      // nothing, and the rest of the map still works
+      if (mine.size() + claimed.size() > max_regions) {
+        std::cout << "Skipping memory descriptor at " << std::hex << desc.start << std::dec << ": too many regions" << std::endl;
+        continue;
+      }
+
+      std::sort(mine.begin(), mine.end(), [](auto const & a, auto const & b) { return a.begin < b.begin; });
+
+      // Keep only the parts no earlier descriptor has claimed
+      std::vector<Region> merged;
+      merged.reserve(claimed.size() + mine.size());
+      auto c = claimed.begin();
+      for (auto r : mine) {
+        while (c != claimed.end() && c->end <= r.begin) {
+          merged.push_back(*c++);
+        }
+        while (r.begin < r.end) {
+          if (c == claimed.end() || r.end <= c->begin) {
+            merged.push_back(r);
+            break;
+          }
+          if (r.begin < c->begin) {
+            merged.push_back({ r.begin, c->begin, i });
+          }
+          r.begin = std::max(r.begin, c->end);
+          if (c->end <= r.end) {
+            merged.push_back(*c++);
+          } else {
+            break;
+          }
+        }
+      }
+      merged.insert(merged.end(), c, claimed.end());
+      claimed = std::move(merged);
+    }
+
+    // Coalesce neighbouring blocks of the same descriptor
+    regions_.clear();
+    for (auto const & r : claimed) {
+      if (!regions_.empty() && regions_.back().end == r.begin && regions_.back().descriptor == r.descriptor) {
+        regions_.back().end = r.end;
+      } else {
+        regions_.push_back(r);
+      }
+    }
+  }
+
+private:
+  std::vector<Descriptor> descriptors_;
+  std::size_t top_addr_ = 0;
+  std::vector<Region> regions_;
+};
+
+}
@@ -0,0 +1,239 @@
+#pragma once
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+namespace fenestra {
+
+// A ring of perflog records in a shared memory file (e.g. in /dev/shm),
+// so a viewer can map it and see each record as soon as it is written,
+// without any system calls.
+//
+// The file is a Header, the counter names (the same NUL-separated list
+// as the first line of a perflog file), then capacity slots of
+// record_size bytes, each preceded by a sequence number.  A slot is a
+// seqlock: the writer makes its sequence odd while it writes the
+// record, then sets it to 2 * (n + 1) for the nth record, so a reader
+// can tell both whether a copy was torn and whether it holds the record
+// it wanted.  There is one writer and any number of readers; readers
+// that fall more than capacity records behind just miss records.
+//
+// A writer always creates a new file (replacing any old one), so a
+// reader can notice a restart by the inode changing.
+class PerflogShm {
+public:
+  static constexpr std::uint64_t magic = 0x314d48534c50464eULL; // "NFPLSHM1"
+
+  struct Header {
+    std::atomic<std::uint64_t> magic;
+    std::uint32_t header_size;
+    std::uint32_t names_size;
+    std::uint32_t record_size;
+    std::uint32_t capacity;
+    std::atomic<std::uint64_t> written;
+    std::atomic<std::uint32_t> closed;
+  };
+
+  // Creates the file and maps it for writing
+  PerflogShm(std::string const & filename, std::string_view names, std::size_t record_size, std::size_t capacity)
+    : writer_(true)
+  {
+    if (capacity == 0) {
+      throw std::runtime_error("perflog shm capacity must be at least 1");
+    }
+
+    unlink(filename.c_str());
+
+    if ((fd_ = ::open(filename.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644)) < 0) {
+      throw std::runtime_error("could not create " + filename);
+    }
+
+    names_size_ = names.size();
+    record_size_ = record_size;
+    slot_size_ = align(sizeof(std::uint64_t) + record_size);
+    capacity_ = capacity;
+    size_ = sizeof(Header) + align(names_size_) + slot_size_ * capacity_;
+
+    if (ftruncate(fd_, size_) < 0) {
+      close(fd_);
+      throw std::runtime_error("could not resize " + filename);
+    }
+
+    map(filename, PROT_READ | PROT_WRITE);
+
+    auto * h = header();
+    h->header_size = sizeof(Header);
+    h->names_size = names_size_;
+    h->record_size = record_size_;
+    h->capacity = capacity_;
+    h->written.store(0, std::memory_order_relaxed);
+    h->closed.store(0, std::memory_order_relaxed);
+    std::memcpy(names_ptr(), names.data(), names.size());
+
+    // Readers ignore the file until the magic is there
+    h->magic.store(magic, std::memory_order_release);
+  }
+
+  // Maps an existing file for reading
+  explicit PerflogShm(std::string const & filename)
+    : writer_(false)
+  {
+    if ((fd_ = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC)) < 0) {
+      throw std::runtime_error("could not open " + filename);
+    }
+
+    struct stat statbuf;
+    if (fstat(fd_, &statbuf) < 0 || std::size_t(statbuf.st_size) < sizeof(Header)) {
+      close(fd_);
+      throw std::runtime_error("not a perflog shm file: " + filename);
+    }
+
+    size_ = statbuf.st_size;
+    map(filename, PROT_READ);
+
+    auto const * h = header();
+    if (h->magic.load(std::memory_order_acquire) != magic || h->header_size != sizeof(Header)) {
+      unmap();
+      throw std::runtime_error("not a perflog shm file: " + filename);
+    }
+
+    names_size_ = h->names_size;
+    record_size_ = h->record_size;
+    slot_size_ = align(sizeof(std::uint64_t) + record_size_);
+    capacity_ = h->capacity;
+
+    if (capacity_ == 0 || sizeof(Header) + align(names_size_) + slot_size_ * capacity_ > size_) {
+      unmap();
+      throw std::runtime_error("truncated perflog shm file: " + filename);
+    }
+  }
+
+  ~PerflogShm() {
+    if (writer_) {
+      header()->closed.store(1, std::memory_order_release);
+    }
+    unmap();
+  }
+
+  PerflogShm(PerflogShm const &) = delete;
+  PerflogShm & operator=(PerflogShm const &) = delete;
+
+  // Whether a file starts like a perflog shm file
+  static bool is_shm(std::string const & filename) {
+    std::uint64_t m = 0;
+    return read_magic(filename, m) && m == magic;
+  }
+
+  // Whether a file is a perflog shm file that its writer has created
+  // and sized, but not stored the magic in yet.  (A perflog file never
+  // starts with zeros.)
+  static bool is_pending(std::string const & filename) {
+    std::uint64_t m = ~std::uint64_t(0);
+    return read_magic(filename, m) && m == 0;
+  }
+
+  std::string_view names() const { return std::string_view(names_ptr(), names_size_); }
+
+  std::size_t record_size() const { return record_size_; }
+  std::size_t capacity() const { return capacity_; }
+
+  std::uint64_t written() const { return header()->written.load(std::memory_order_acquire); }
+  bool closed() const { return header()->closed.load(std::memory_order_acquire); }
+
+  // Writer
+  void write(char const * record) {
+    auto n = header()->written.load(std::memory_order_relaxed);
+    auto & seq = slot_seq(n);
+    auto * data = slot_data(n);
+
+    seq.store(2 * n + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    std::memcpy(data, record, record_size_);
+    seq.store(2 * (n + 1), std::memory_order_release);
+
+    header()->written.store(n + 1, std::memory_order_release);
+  }
+
+  // Reader: copies the nth record to out, or returns false if it is
+  // not there (not written yet, or already overwritten)
+  bool read(std::uint64_t n, char * out) const {
+    auto const & seq = slot_seq(n);
+
+    auto before = seq.load(std::memory_order_acquire);
+    if (before != 2 * (n + 1)) {
+      return false;
+    }
+
+    std::memcpy(out, slot_data(n), record_size_);
+    std::atomic_thread_fence(std::memory_order_acquire);
+
+    return seq.load(std::memory_order_relaxed) == before;
+  }
+
+private:
+  static bool read_magic(std::string const & filename, std::uint64_t & m) {
+    int fd = ::open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return false;
+    }
+
+    auto n = pread(fd, &m, sizeof(m), 0);
+    close(fd);
+    return n == sizeof(m);
+  }
+
+  static std::size_t align(std::size_t n) {
+    return (n + 7) & ~std::size_t(7);
+  }
+
+  void map(std::string const & filename, int prot) {
+    ptr_ = mmap(nullptr, size_, prot, MAP_SHARED, fd_, 0);
+    if (ptr_ == MAP_FAILED) {
+      close(fd_);
+      throw std::runtime_error("could not map " + filename);
+    }
+  }
+
+  void unmap() {
+    munmap(ptr_, size_);
+    close(fd_);
+  }
+
+  Header * header() const { return static_cast<Header *>(ptr_); }
+
+  char * names_ptr() const { return static_cast<char *>(ptr_) + sizeof(Header); }
+
+  char * slot(std::uint64_t n) const {
+    return names_ptr() + align(names_size_) + slot_size_ * (n % capacity_);
+  }
+
+  std::atomic<std::uint64_t> & slot_seq(std::uint64_t n) const {
+    return *reinterpret_cast<std::atomic<std::uint64_t> *>(slot(n));
+  }
+
+  char * slot_data(std::uint64_t n) const {
+    return slot(n) + sizeof(std::uint64_t);
+  }
+
+private:
+  bool writer_;
+  int fd_ = -1;
+  void * ptr_ = nullptr;
+  std::size_t size_ = 0;
+  std::size_t names_size_ = 0;
+  std::size_t record_size_ = 0;
+  std::size_t slot_size_ = 0;
+  std::size_t capacity_ = 0;
+};
+
+}
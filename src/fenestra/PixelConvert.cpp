@@ -0,0 +1,288 @@
+#include "PixelConvert.hpp"
+
+#include <stdexcept>
+#include <string>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define FENESTRA_PIXELCONVERT_X86
+#include <immintrin.h>
+#endif
+
+namespace {
+
+// Expand 5- and 6-bit channels to 8 bits by replicating the high bits
+// into the low bits, so 0 maps to 0 and full intensity maps to 255
+
+inline std::uint32_t expand5(std::uint32_t c) { return (c << 3) | (c >> 2); }
+inline std::uint32_t expand6(std::uint32_t c) { return (c << 2) | (c >> 4); }
+
+inline std::uint32_t bgra(std::uint32_t b, std::uint32_t g, std::uint32_t r) {
+  return b | (g << 8) | (r << 16) | 0xff000000u;
+}
+
+inline void store(std::uint8_t * dest, std::uint32_t pixel) {
+  std::memcpy(dest, &pixel, sizeof(pixel));
+}
+
+void rgb565_scalar(void const * src, std::uint8_t * dest, std::size_t pixels) {
+  auto const * s = static_cast<std::uint8_t const *>(src);
+  for (std::size_t i = 0; i < pixels; ++i) {
+    std::uint16_t p;
+    std::memcpy(&p, s + i * 2, sizeof(p));
+    store(dest + i * 4, bgra(expand5(p & 0x1f), expand6((p >> 5) & 0x3f), expand5(p >> 11)));
+  }
+}
+
+void rgb1555_scalar(void const * src, std::uint8_t * dest, std::size_t pixels) {
+  auto const * s = static_cast<std::uint8_t const *>(src);
+  for (std::size_t i = 0; i < pixels; ++i) {
+    std::uint16_t p;
+    std::memcpy(&p, s + i * 2, sizeof(p));
+    store(dest + i * 4, bgra(expand5(p & 0x1f), expand5((p >> 5) & 0x1f), expand5((p >> 10) & 0x1f)));
+  }
+}
+
+void xrgb8888_scalar(void const * src, std::uint8_t * dest, std::size_t pixels) {
+  auto const * s = static_cast<std::uint8_t const *>(src);
+  for (std::size_t i = 0; i < pixels; ++i) {
+    std::uint32_t p;
+    std::memcpy(&p, s + i * 4, sizeof(p));
+    store(dest + i * 4, p | 0xff000000u);
+  }
+}
+
+#ifdef FENESTRA_PIXELCONVERT_X86
+
+// The 16-bit kernels work on 16-bit lanes: each channel is extracted and
+// expanded to 8 bits in its own register, then blue/green and red/alpha
+// are packed into 16-bit pairs and interleaved into 32-bit pixels.
+
+__attribute__((target("sse2")))
+inline void interleave_store_sse2(std::uint8_t * dest, __m128i b, __m128i g, __m128i r) {
+  auto bg = _mm_or_si128(b, _mm_slli_epi16(g, 8));
+  auto ra = _mm_or_si128(r, _mm_set1_epi16(std::int16_t(0xff00)));
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(dest), _mm_unpacklo_epi16(bg, ra));
+  _mm_storeu_si128(reinterpret_cast<__m128i *>(dest + 16), _mm_unpackhi_epi16(bg, ra));
+}
+
+__attribute__((target("sse2")))
+inline __m128i expand5_sse2(__m128i c) {
+  return _mm_or_si128(_mm_slli_epi16(c, 3), _mm_srli_epi16(c, 2));
+}
+
+__attribute__((target("sse2")))
+inline __m128i expand6_sse2(__m128i c) {
+  return _mm_or_si128(_mm_slli_epi16(c, 2), _mm_srli_epi16(c, 4));
+}
+
+__attribute__((target("sse2")))
+void rgb565_sse2(void const * src, std::uint8_t * dest, std::size_t pixels) {
+  auto const * s = static_cast<std::uint8_t const *>(src);
+  auto const mask5 = _mm_set1_epi16(0x1f);
+  auto const mask6 = _mm_set1_epi16(0x3f);
+
+  std::size_t i = 0;
+  for (; i + 8 <= pixels; i += 8) {
+    auto p = _mm_loadu_si128(reinterpret_cast<__m128i const *>(s + i * 2));
+    auto b = expand5_sse2(_mm_and_si128(p, mask5));
+    auto g = expand6_sse2(_mm_and_si128(_mm_srli_epi16(p, 5), mask6));
+    auto r = expand5_sse2(_mm_srli_epi16(p, 11));
+    interleave_store_sse2(dest + i * 4, b, g, r);
+  }
+
+  rgb565_scalar(s + i * 2, dest + i * 4, pixels - i);
+}
+
+__attribute__((target("sse2")))
+void rgb1555_sse2(void const * src, std::uint8_t * dest, std::size_t pixels) {
+  auto const * s = static_cast<std::uint8_t const *>(src);
+  auto const mask5 = _mm_set1_epi16(0x1f);
+
+  std::size_t i = 0;
+  for (; i + 8 <= pixels; i += 8) {
+    auto p = _mm_loadu_si128(reinterpret_cast<__m128i const *>(s + i * 2));
+    auto b = expand5_sse2(_mm_and_si128(p, mask5));
+    auto g = expand5_sse2(_mm_and_si128(_mm_srli_epi16(p, 5), mask5));
+    auto r = expand5_sse2(_mm_and_si128(_mm_srli_epi16(p, 10), mask5));
+    interleave_store_sse2(dest + i * 4, b, g, r);
+  }
+
+  rgb1555_scalar(s + i * 2, dest + i * 4, pixels - i);
+}
+
+__attribute__((target("sse2")))
+void xrgb8888_sse2(void const * src, std::uint8_t * dest, std::size_t pixels) {
+  auto const * s = static_cast<std::uint8_t const *>(src);
+  auto const alpha = _mm_set1_epi32(std::int32_t(0xff000000u));
+
+  std::size_t i = 0;
+  for (; i + 4 <= pixels; i += 4) {
+    auto p = _mm_loadu_si128(reinterpret_cast<__m128i const *>(s + i * 4));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dest + i * 4), _mm_or_si128(p, alpha));
+  }
+
+  xrgb8888_scalar(s + i * 4, dest + i * 4, pixels - i);
+}
+
+// AVX2 unpack works within each 128-bit half, so the two halves are
+// swapped back into pixel order before storing
+
+__attribute__((target("avx2")))
+inline void interleave_store_avx2(std::uint8_t * dest, __m256i b, __m256i g, __m256i r) {
+  auto bg = _mm256_or_si256(b, _mm256_slli_epi16(g, 8));
+  auto ra = _mm256_or_si256(r, _mm256_set1_epi16(std::int16_t(0xff00)));
+  auto lo = _mm256_unpacklo_epi16(bg, ra);
+  auto hi = _mm256_unpackhi_epi16(bg, ra);
+  _mm256_storeu_si256(reinterpret_cast<__m256i *>(dest), _mm256_permute2x128_si256(lo, hi, 0x20));
+  _mm256_storeu_si256(reinterpret_cast<__m256i *>(dest + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+}
+
+__attribute__((target("avx2")))
+inline __m256i expand5_avx2(__m256i c) {
+  return _mm256_or_si256(_mm256_slli_epi16(c, 3), _mm256_srli_epi16(c, 2));
+}
+
+__attribute__((target("avx2")))
+inline __m256i expand6_avx2(__m256i c) {
+  return _mm256_or_si256(_mm256_slli_epi16(c, 2), _mm256_srli_epi16(c, 4));
+}
+
+__attribute__((target("avx2")))
+void rgb565_avx2(void const * src, std::uint8_t * dest, std::size_t pixels) {
+  auto const * s = static_cast<std::uint8_t const *>(src);
+  auto const mask5 = _mm256_set1_epi16(0x1f);
+  auto const mask6 = _mm256_set1_epi16(0x3f);
+
+  std::size_t i = 0;
+  for (; i + 16 <= pixels; i += 16) {
+    auto p = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(s + i * 2));
+    auto b = expand5_avx2(_mm256_and_si256(p, mask5));
+    auto g = expand6_avx2(_mm256_and_si256(_mm256_srli_epi16(p, 5), mask6));
+    auto r = expand5_avx2(_mm256_srli_epi16(p, 11));
+    interleave_store_avx2(dest + i * 4, b, g, r);
+  }
+
+  rgb565_sse2(s + i * 2, dest + i * 4, pixels - i);
+}
+
+__attribute__((target("avx2")))
+void rgb1555_avx2(void const * src, std::uint8_t * dest, std::size_t pixels) {
+  auto const * s = static_cast<std::uint8_t const *>(src);
+  auto const mask5 = _mm256_set1_epi16(0x1f);
+
+  std::size_t i = 0;
+  for (; i + 16 <= pixels; i += 16) {
+    auto p = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(s + i * 2));
+    auto b = expand5_avx2(_mm256_and_si256(p, mask5));
+    auto g = expand5_avx2(_mm256_and_si256(_mm256_srli_epi16(p, 5), mask5));
+    auto r = expand5_avx2(_mm256_and_si256(_mm256_srli_epi16(p, 10), mask5));
+    interleave_store_avx2(dest + i * 4, b, g, r);
+  }
+
+  rgb1555_sse2(s + i * 2, dest + i * 4, pixels - i);
+}
+
+__attribute__((target("avx2")))
+void xrgb8888_avx2(void const * src, std::uint8_t * dest, std::size_t pixels) {
+  auto const * s = static_cast<std::uint8_t const *>(src);
+  auto const alpha = _mm256_set1_epi32(std::int32_t(0xff000000u));
+
+  std::size_t i = 0;
+  for (; i + 8 <= pixels; i += 8) {
+    auto p = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(s + i * 4));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dest + i * 4), _mm256_or_si256(p, alpha));
+  }
+
+  xrgb8888_sse2(s + i * 4, dest + i * 4, pixels - i);
+}
+
+#endif
+
+void unsupported(void const * src, std::uint8_t * dest, std::size_t pixels) {
+}
+
+}
+
+fenestra::PixelConvert::PixelConvert(retro_pixel_format format, ISA isa)
+  : fn_(unsupported)
+{
+  if (!supported(isa)) {
+    throw std::runtime_error(std::string("Pixel conversion not supported on this CPU: ") + name(isa));
+  }
+
+  switch (isa) {
+    case ISA::SCALAR:
+      switch (format) {
+        case RETRO_PIXEL_FORMAT_0RGB1555: fn_ = rgb1555_scalar; break;
+        case RETRO_PIXEL_FORMAT_RGB565: fn_ = rgb565_scalar; break;
+        case RETRO_PIXEL_FORMAT_XRGB8888: fn_ = xrgb8888_scalar; break;
+        default: break;
+      }
+      break;
+
+#ifdef FENESTRA_PIXELCONVERT_X86
+    case ISA::SSE2:
+      switch (format) {
+        case RETRO_PIXEL_FORMAT_0RGB1555: fn_ = rgb1555_sse2; break;
+        case RETRO_PIXEL_FORMAT_RGB565: fn_ = rgb565_sse2; break;
+        case RETRO_PIXEL_FORMAT_XRGB8888: fn_ = xrgb8888_sse2; break;
+        default: break;
+      }
+      break;
+
+    case ISA::AVX2:
+      switch (format) {
+        case RETRO_PIXEL_FORMAT_0RGB1555: fn_ = rgb1555_avx2; break;
+        case RETRO_PIXEL_FORMAT_RGB565: fn_ = rgb565_avx2; break;
+        case RETRO_PIXEL_FORMAT_XRGB8888: fn_ = xrgb8888_avx2; break;
+        default: break;
+      }
+      break;
+#endif
+
+    default:
+      break;
+  }
+}
+
+bool
+fenestra::PixelConvert::supported(ISA isa) {
+  switch (isa) {
+    case ISA::SCALAR:
+      return true;
+
+#ifdef FENESTRA_PIXELCONVERT_X86
+    case ISA::SSE2:
+      return __builtin_cpu_supports("sse2");
+
+    case ISA::AVX2:
+      return __builtin_cpu_supports("avx2");
+#endif
+
+    default:
+      return false;
+  }
+}
+
+fenestra::PixelConvert::ISA
+fenestra::PixelConvert::best_isa() {
+  for (auto isa : { ISA::AVX2, ISA::SSE2 }) {
+    if (supported(isa)) {
+      return isa;
+    }
+  }
+
+  return ISA::SCALAR;
+}
+
+char const *
+fenestra::PixelConvert::name(ISA isa) {
+  switch (isa) {
+    case ISA::SCALAR: return "scalar";
+    case ISA::SSE2: return "sse2";
+    case ISA::AVX2: return "avx2";
+  }
+
+  return "unknown";
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "libretro.h"
+
+#include <cstdint>
+#include <cstddef>
+
+namespace fenestra {
+
+// Converts libretro pixel formats to 32-bit BGRA (the byte order of
+// XRGB8888 on a little-endian machine, with alpha set to 255).
+class PixelConvert {
+public:
+  enum class ISA { SCALAR, SSE2, AVX2 };
+
+  using Fn = void (*)(void const * src, std::uint8_t * dest, std::size_t pixels);
+
+  // Picks the fastest implementation supported by this CPU
+  explicit PixelConvert(retro_pixel_format format)
+    : PixelConvert(format, best_isa())
+  {
+  }
+
+  PixelConvert(retro_pixel_format format, ISA isa);
+
+  static ISA best_isa();
+  static bool supported(ISA isa);
+  static char const * name(ISA isa);
+
+  static std::size_t bytes_per_pixel(retro_pixel_format format) {
+    return format == RETRO_PIXEL_FORMAT_XRGB8888 ? 4 : 2;
+  }
+
+  void operator()(void const * src, std::uint8_t * dest, std::size_t pixels) const {
+    fn_(src, dest, pixels);
+  }
+
+  void operator()(void const * src, std::size_t src_pitch, std::uint8_t * dest, std::size_t dest_pitch, unsigned int width, unsigned int height) const {
+    auto const * s = static_cast<std::uint8_t const *>(src);
+    for (unsigned int y = 0; y < height; ++y) {
+      fn_(s + y * src_pitch, dest + y * dest_pitch, width);
+    }
+  }
+
+private:
+  Fn fn_;
+};
+
+}
@@ -7,6 +7,8 @@
 #include "fenestra/Core.hpp"
 #include "fenestra/Config.hpp"
 #include "fenestra/State.hpp"
+#include "fenestra/VideoFrame.hpp"
+#include "fenestra/MemoryMap.hpp"
 
 #include <cstddef>
 #include <cstdarg>
@@ -28,10 +30,17 @@ public:
 
   virtual void set_pixel_format(retro_pixel_format format) { }
   virtual void set_geometry(Geometry const & geom) { }
-  virtual void video_refresh(void const * data, unsigned int width, unsigned int height, std::size_t pitch) { }
+  virtual void video_refresh(VideoFrame const & frame) { }
   virtual void video_render() { }
   virtual void video_rendered() { }
 
+  // Called on a capture thread (see CapturePipeline)
+  virtual void capture_frame(VideoFrame const & frame) { }
+
+  // Whether capture_frame has anything to do (checked once, after the
+  // plugin is constructed); plugins that don't get no capture thread
+  virtual bool wants_capture() const { return true; }
+
   virtual void window_created() { }
 
   virtual void window_update_delay() { }
@@ -50,6 +59,9 @@ public:
   virtual void unloading_game(Core const & core) { }
   virtual void game_unloaded(Core const & core) { }
 
+  // The map is owned by the frontend and stays valid until the next call
+  virtual void set_memory_map(MemoryMap const & map) { }
+
   virtual void poll_input(State & state) { }
   virtual void handle_key_events(std::vector<KeyEvent> const & key_events, State & state) { }
 };
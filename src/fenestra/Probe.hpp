@@ -90,13 +90,17 @@ public:
     stamps_.clear();
   }
 
+  void reserve(std::size_t n) {
+    stamps_.reserve(n);
+  }
+
   auto begin() const { return stamps_.begin(); }
   auto end() const { return stamps_.end(); }
 
   auto size() const { return stamps_.size(); }
   auto const & back() const { return stamps_.back(); }
 
-  void append(Probe & probe) {
+  void append(Probe const & probe) {
     for (auto const & stamp : probe) {
       stamps_.emplace_back(stamp);
     }
@@ -0,0 +1,232 @@
+#pragma once
+
+#include "libretro.h"
+
+#include <zstd.h>
+
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace fenestra {
+
+// The container written by the recorder plugin.  A recording is a
+// sequence of chunks, each a fixed-size header followed by its payload:
+//
+//   HEAD  Header (sample rate, etc.); always the first chunk
+//   VFMT  Video_Format; precedes the first frame and any size change
+//   VKEY  zstd-compressed frame, rows packed
+//   VDLT  zstd-compressed XOR of the frame with the previous frame
+//   AUDI  Interleaved stereo S16LE samples
+//
+// All integers are little-endian.  Frames are stored in the core's own
+// pixel format, so decoding is bit-exact.
+namespace Recording {
+
+inline constexpr char magic[8] = { 'F', 'E', 'N', 'R', 'E', 'C', '0', '1' };
+
+inline constexpr std::uint32_t fourcc(char const (&s)[5]) {
+  return std::uint32_t(s[0]) | std::uint32_t(s[1]) << 8 | std::uint32_t(s[2]) << 16 | std::uint32_t(s[3]) << 24;
+}
+
+inline constexpr std::uint32_t HEAD = fourcc("HEAD");
+inline constexpr std::uint32_t VFMT = fourcc("VFMT");
+inline constexpr std::uint32_t VKEY = fourcc("VKEY");
+inline constexpr std::uint32_t VDLT = fourcc("VDLT");
+inline constexpr std::uint32_t AUDI = fourcc("AUDI");
+
+struct Chunk_Header {
+  std::uint32_t type;
+  std::uint32_t reserved;
+  std::uint64_t size;     // payload bytes
+  std::int64_t time_ns;   // CLOCK_MONOTONIC
+  std::uint64_t number;   // frame number, or index of the first sample
+};
+
+struct Header {
+  char magic[8];
+  double sample_rate;
+  double fps;
+};
+
+struct Video_Format {
+  std::uint32_t width;
+  std::uint32_t height;
+  std::uint32_t format;   // retro_pixel_format
+  std::uint32_t reserved;
+};
+
+static_assert(sizeof(Chunk_Header) == 32);
+static_assert(sizeof(Header) == 24);
+static_assert(sizeof(Video_Format) == 16);
+
+inline std::size_t bytes_per_pixel(std::uint32_t format) {
+  return format == RETRO_PIXEL_FORMAT_XRGB8888 ? 4 : 2;
+}
+
+inline constexpr std::size_t bytes_per_audio_frame = 4;
+
+// dest ^= src
+inline void xor_into(std::uint8_t * dest, std::uint8_t const * src, std::size_t size) {
+  std::size_t i = 0;
+  for (; i + sizeof(std::uint64_t) <= size; i += sizeof(std::uint64_t)) {
+    std::uint64_t a, b;
+    std::memcpy(&a, dest + i, sizeof(a));
+    std::memcpy(&b, src + i, sizeof(b));
+    a ^= b;
+    std::memcpy(dest + i, &a, sizeof(a));
+  }
+  for (; i < size; ++i) {
+    dest[i] ^= src[i];
+  }
+}
+
+// Reads a recording chunk by chunk, reconstructing frames as it goes.
+class Reader {
+public:
+  explicit Reader(std::string const & filename)
+    : dctx_(ZSTD_createDCtx())
+  {
+    if (!dctx_) {
+      throw std::runtime_error("Failed to create zstd context");
+    }
+
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+      ZSTD_freeDCtx(dctx_);
+      throw std::runtime_error("Could not open " + filename + ": " + std::strerror(errno));
+    }
+
+    struct stat st;
+    if (::fstat(fd, &st) < 0 || st.st_size == 0) {
+      ::close(fd);
+      ZSTD_freeDCtx(dctx_);
+      throw std::runtime_error("Recording is empty: " + filename);
+    }
+
+    size_ = st.st_size;
+    void * p = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+
+    if (p == MAP_FAILED) {
+      ZSTD_freeDCtx(dctx_);
+      throw std::runtime_error("Could not mmap " + filename + ": " + std::strerror(errno));
+    }
+
+    data_ = static_cast<std::uint8_t const *>(p);
+    ::madvise(p, size_, MADV_SEQUENTIAL);
+
+    if (next() && chunk_.type == HEAD && chunk_.size >= sizeof(Header)) {
+      std::memcpy(&header_, payload(), sizeof(header_));
+    }
+
+    if (std::memcmp(header_.magic, magic, sizeof(magic)) != 0) {
+      ::munmap(p, size_);
+      ZSTD_freeDCtx(dctx_);
+      throw std::runtime_error("Not a fenestra recording: " + filename);
+    }
+  }
+
+  ~Reader() {
+    ::munmap(const_cast<std::uint8_t *>(data_), size_);
+    ZSTD_freeDCtx(dctx_);
+  }
+
+  Reader(Reader const &) = delete;
+  Reader & operator=(Reader const &) = delete;
+
+  Header const & header() const { return header_; }
+  Video_Format const & video_format() const { return format_; }
+
+  // Advance to the next chunk.  Returns false at the end of the file.
+  // A truncated final chunk (e.g. after a crash) is treated as the end.
+  bool next() {
+    if (pos_ + sizeof(Chunk_Header) > size_) {
+      return false;
+    }
+
+    std::memcpy(&chunk_, data_ + pos_, sizeof(chunk_));
+
+    if (chunk_.size > size_ - pos_ - sizeof(Chunk_Header)) {
+      return false;
+    }
+
+    payload_ = data_ + pos_ + sizeof(Chunk_Header);
+    pos_ += sizeof(Chunk_Header) + chunk_.size;
+
+    if (chunk_.type == VFMT) {
+      if (chunk_.size < sizeof(Video_Format)) {
+        throw std::runtime_error("Invalid video format chunk");
+      }
+      std::memcpy(&format_, payload_, sizeof(format_));
+      frame_.assign(frame_size(), 0);
+    } else if (chunk_.type == VKEY || chunk_.type == VDLT) {
+      decode_frame();
+    }
+
+    return true;
+  }
+
+  Chunk_Header const & chunk() const { return chunk_; }
+  std::uint8_t const * payload() const { return payload_; }
+
+  // The current frame (packed rows), valid after a VKEY or VDLT chunk
+  std::vector<std::uint8_t> const & frame() const { return frame_; }
+
+  std::size_t frame_size() const {
+    return std::size_t(format_.width) * format_.height * bytes_per_pixel(format_.format);
+  }
+
+  std::size_t audio_frames() const {
+    return chunk_.type == AUDI ? chunk_.size / bytes_per_audio_frame : 0;
+  }
+
+private:
+  void decode_frame() {
+    if (frame_.empty()) {
+      throw std::runtime_error("Frame before video format");
+    }
+
+    auto & out = chunk_.type == VKEY ? frame_ : delta_;
+    out.resize(frame_size());
+
+    auto n = ZSTD_decompressDCtx(dctx_, out.data(), out.size(), payload_, chunk_.size);
+    if (ZSTD_isError(n)) {
+      throw std::runtime_error(std::string("ZSTD_decompressDCtx: ") + ZSTD_getErrorName(n));
+    }
+
+    if (n != out.size()) {
+      throw std::runtime_error("Frame " + std::to_string(chunk_.number) + " has the wrong size");
+    }
+
+    if (chunk_.type == VDLT) {
+      xor_into(frame_.data(), delta_.data(), frame_.size());
+    }
+  }
+
+private:
+  ZSTD_DCtx * dctx_;
+  std::uint8_t const * data_ = nullptr;
+  std::size_t size_ = 0;
+  std::size_t pos_ = 0;
+
+  Header header_ = { };
+  Video_Format format_ = { };
+  Chunk_Header chunk_ = { };
+  std::uint8_t const * payload_ = nullptr;
+
+  std::vector<std::uint8_t> frame_;
+  std::vector<std::uint8_t> delta_;
+};
+
+}
+
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <optional>
+#include <utility>
+#include <vector>
+
+namespace fenestra {
+
+// A bounded, lock-free queue for exactly one producer thread and one
+// consumer thread.  Neither side ever blocks: push() fails when the
+// queue is full and pop() returns nothing when it is empty.
+template<typename T>
+class SpscQueue {
+public:
+  explicit SpscQueue(std::size_t capacity)
+    : slots_(round_up(capacity))
+    , mask_(slots_.size() - 1)
+  {
+  }
+
+  bool push(T && value) {
+    auto tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) == slots_.size()) {
+      return false;
+    }
+
+    slots_[tail & mask_] = std::move(value);
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  std::optional<T> pop() {
+    auto head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire)) {
+      return std::nullopt;
+    }
+
+    std::optional<T> value(std::move(slots_[head & mask_]));
+    slots_[head & mask_] = T();
+    head_.store(head + 1, std::memory_order_release);
+    return value;
+  }
+
+  std::size_t capacity() const { return slots_.size(); }
+
+private:
+  static std::size_t round_up(std::size_t n) {
+    std::size_t size = 1;
+    while (size < n) size <<= 1;
+    return size;
+  }
+
+  std::vector<T> slots_;
+  std::size_t mask_;
+
+  // On separate cache lines, so the producer and consumer don't
+  // invalidate each other's reads
+  alignas(64) std::atomic<std::size_t> head_ = 0;
+  alignas(64) std::atomic<std::size_t> tail_ = 0;
+};
+
+}
@@ -0,0 +1,343 @@
+#pragma once
+
+#include "CoreState.hpp"
+
+#include <zstd.h>
+#include <zdict.h>
+
+#include <string>
+#include <vector>
+#include <stdexcept>
+#include <cerrno>
+#include <cstring>
+#include <algorithm>
+#include <iostream>
+#include <memory>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+namespace fenestra {
+
+// Reads and writes compressed save state files.  The zstd contexts and
+// output buffers are kept between calls, so a codec should be owned by
+// a single thread (see StateIO).
+class StateCodec {
+public:
+  StateCodec(int level, int threads, std::size_t stream_threshold)
+    : level_(level)
+    , threads_(threads)
+    , stream_threshold_(stream_threshold)
+    , cctx_(ZSTD_createCCtx())
+    , dctx_(ZSTD_createDCtx())
+  {
+    if (!cctx_ || !dctx_) {
+      throw std::runtime_error("Failed to create zstd context");
+    }
+
+    check(ZSTD_CCtx_setParameter(cctx_, ZSTD_c_compressionLevel, level_), "ZSTD_c_compressionLevel");
+
+    if (threads_ > 0) {
+      auto ret = ZSTD_CCtx_setParameter(cctx_, ZSTD_c_nbWorkers, threads_);
+      if (ZSTD_isError(ret)) {
+        std::cout << "zstd does not support threads; compressing states on one thread" << std::endl;
+      }
+    }
+  }
+
+  ~StateCodec() {
+    ZSTD_freeCCtx(cctx_);
+    ZSTD_freeDCtx(dctx_);
+  }
+
+  StateCodec(StateCodec const &) = delete;
+  StateCodec & operator=(StateCodec const &) = delete;
+
+  bool has_dictionary() const { return !dictionary_.empty(); }
+
+  // Where the dictionary for the current game is kept.  A state that was
+  // written with it is read using it, even if it is no longer used for
+  // writing (see load_dictionary).  Stops using any dictionary that was
+  // loaded for a previous game.
+  void set_dictionary_filename(std::string const & filename) {
+    dictionary_filename_ = filename;
+    dictionary_.clear();
+    ddict_id_ = 0;
+    check(ZSTD_CCtx_loadDictionary(cctx_, nullptr, 0), "ZSTD_CCtx_loadDictionary");
+    check(ZSTD_DCtx_loadDictionary(dctx_, nullptr, 0), "ZSTD_DCtx_loadDictionary");
+  }
+
+  // Use a dictionary for all states written from now on.  States
+  // written without a dictionary can still be read.
+  void load_dictionary(std::string const & filename) {
+    Mapping m(filename);
+    dictionary_.assign(m.data(), m.data() + m.size());
+    check(ZSTD_CCtx_loadDictionary(cctx_, dictionary_.data(), dictionary_.size()), "ZSTD_CCtx_loadDictionary");
+    check(ZSTD_DCtx_loadDictionary(dctx_, dictionary_.data(), dictionary_.size()), "ZSTD_DCtx_loadDictionary");
+    ddict_id_ = ZSTD_getDictID_fromDict(dictionary_.data(), dictionary_.size());
+  }
+
+  // Train a dictionary from a set of existing state files and write it
+  // to filename.  Returns false if there were not enough samples.
+  bool train_dictionary(std::vector<std::string> const & state_filenames, std::string const & filename, std::size_t max_size = 112640) {
+    std::vector<char> samples;
+    std::vector<std::size_t> sample_sizes;
+
+    for (auto const & state_filename : state_filenames) {
+      try {
+        auto state = load(state_filename);
+        samples.insert(samples.end(), state.data(), state.data() + state.size());
+        sample_sizes.push_back(state.size());
+      } catch(std::exception const & ex) {
+        std::cout << "Not using " << state_filename << " for training: " << ex.what() << std::endl;
+      }
+    }
+
+    if (sample_sizes.size() < min_samples) {
+      return false;
+    }
+
+    std::vector<char> dict(max_size);
+    auto size = ZDICT_trainFromBuffer(dict.data(), dict.size(), samples.data(), sample_sizes.data(), sample_sizes.size());
+    if (ZDICT_isError(size)) {
+      throw std::runtime_error(std::string("Dictionary training failed: ") + ZDICT_getErrorName(size));
+    }
+
+    write_file(filename, dict.data(), size);
+    return true;
+  }
+
+  CoreState load(std::string const & filename) {
+    Mapping m(filename);
+
+    auto size = ZSTD_getFrameContentSize(m.data(), m.size());
+
+    if (size == ZSTD_CONTENTSIZE_ERROR) {
+      throw std::runtime_error("Content is not zstd-compressed");
+    }
+
+    auto dict_id = ZSTD_getDictID_fromFrame(m.data(), m.size());
+    if (dict_id != 0 && dict_id != ddict_id_) {
+      load_decompression_dictionary(dict_id);
+    }
+
+    std::vector<char> data;
+
+    check(ZSTD_DCtx_reset(dctx_, ZSTD_reset_session_only), "ZSTD_DCtx_reset");
+
+    if (size != ZSTD_CONTENTSIZE_UNKNOWN) {
+      data.resize(size);
+      auto n = ZSTD_decompressDCtx(dctx_, data.data(), data.size(), m.data(), m.size());
+      check(n, "ZSTD_decompressDCtx");
+      data.resize(n);
+    } else {
+      // Content size was not recorded, so grow the buffer as we go
+      ZSTD_inBuffer in { m.data(), m.size(), 0 };
+      std::size_t used = 0;
+      std::size_t ret = 1;
+      while (ret != 0) {
+        if (used == data.size()) {
+          data.resize(std::max(data.size() * 2, ZSTD_DStreamOutSize()));
+        }
+
+        ZSTD_outBuffer out { data.data(), data.size(), used };
+        ret = ZSTD_decompressStream(dctx_, &out, &in);
+        check(ret, "ZSTD_decompressStream");
+        used = out.pos;
+
+        if (ret != 0 && in.pos == in.size && out.pos < out.size) {
+          throw std::runtime_error("State file is truncated");
+        }
+      }
+      data.resize(used);
+    }
+
+    return CoreState(std::move(data));
+  }
+
+  void save(CoreState const & state, std::string const & filename) {
+    check(ZSTD_CCtx_reset(cctx_, ZSTD_reset_session_only), "ZSTD_CCtx_reset");
+    check(ZSTD_CCtx_setPledgedSrcSize(cctx_, state.size()), "ZSTD_CCtx_setPledgedSrcSize");
+
+    if (state.size() < stream_threshold_) {
+      auto bound = ZSTD_compressBound(state.size());
+      if (buf_.size() < bound) {
+        buf_.resize(bound);
+      }
+
+      auto csize = ZSTD_compress2(cctx_, buf_.data(), buf_.size(), state.data(), state.size());
+      check(csize, "ZSTD_compress2");
+
+      write_file(filename, buf_.data(), csize);
+    } else {
+      // Large states are compressed in chunks and written as they are
+      // produced, rather than allocating a buffer for the whole thing
+      File file(filename);
+
+      if (buf_.size() < ZSTD_CStreamOutSize()) {
+        buf_.resize(ZSTD_CStreamOutSize());
+      }
+
+      ZSTD_inBuffer in { state.data(), state.size(), 0 };
+      std::size_t remaining;
+      do {
+        ZSTD_outBuffer out { buf_.data(), buf_.size(), 0 };
+        remaining = ZSTD_compressStream2(cctx_, &out, &in, ZSTD_e_end);
+        check(remaining, "ZSTD_compressStream2");
+        file.write(buf_.data(), out.pos);
+      } while (remaining != 0);
+
+      file.commit();
+    }
+  }
+
+  // Write to a temporary file and rename it into place, so a crash
+  // never leaves a partially written file behind.
+  static void write_file(std::string const & filename, char const * data, std::size_t size) {
+    File file(filename);
+    file.write(data, size);
+    file.commit();
+  }
+
+private:
+  static constexpr inline std::size_t min_samples = 4;
+
+  void load_decompression_dictionary(unsigned int dict_id) {
+    auto needed = "State was written with dictionary " + std::to_string(dict_id);
+
+    if (dictionary_filename_ == "") {
+      throw std::runtime_error(needed + ", but no dictionary file is set");
+    }
+
+    std::unique_ptr<Mapping> m;
+    try {
+      m = std::make_unique<Mapping>(dictionary_filename_);
+    } catch(std::exception const & ex) {
+      throw std::runtime_error(needed + ", which could not be read: " + ex.what());
+    }
+
+    if (ZSTD_getDictID_fromDict(m->data(), m->size()) != dict_id) {
+      throw std::runtime_error(needed + ", but " + dictionary_filename_ + " is a different dictionary");
+    }
+
+    check(ZSTD_DCtx_loadDictionary(dctx_, m->data(), m->size()), "ZSTD_DCtx_loadDictionary");
+    ddict_id_ = dict_id;
+  }
+
+  // A temporary file that replaces filename when committed
+  class File {
+  public:
+    File(std::string const & filename)
+      : filename_(filename)
+      , tmp_filename_(filename + ".tmp")
+    {
+      if ((fd_ = ::open(tmp_filename_.c_str(), O_CREAT|O_WRONLY|O_TRUNC, 0664)) < 0) {
+        throw std::runtime_error("open failed for " + tmp_filename_ + ": " + std::strerror(errno));
+      }
+    }
+
+    ~File() {
+      if (fd_ >= 0) {
+        ::close(fd_);
+        ::unlink(tmp_filename_.c_str());
+      }
+    }
+
+    void write(char const * data, std::size_t size) {
+      while (size > 0) {
+        auto n = ::write(fd_, data, size);
+        if (n < 0) {
+          if (errno == EINTR) continue;
+          throw std::runtime_error("write failed for " + tmp_filename_ + ": " + std::strerror(errno));
+        }
+        data += n;
+        size -= n;
+      }
+    }
+
+    void commit() {
+      if (::fsync(fd_) != 0) {
+        throw std::runtime_error("fsync failed for " + tmp_filename_ + ": " + std::strerror(errno));
+      }
+
+      ::close(fd_);
+      fd_ = -1;
+
+      if (::rename(tmp_filename_.c_str(), filename_.c_str()) != 0) {
+        throw std::runtime_error("rename failed for " + filename_ + ": " + std::strerror(errno));
+      }
+    }
+
+  private:
+    std::string filename_;
+    std::string tmp_filename_;
+    int fd_ = -1;
+  };
+
+  // A read-only mapping of an entire file
+  class Mapping {
+  public:
+    Mapping(std::string const & filename) {
+      int fd = ::open(filename.c_str(), O_RDONLY);
+      if (fd < 0) {
+        throw std::runtime_error("open failed for " + filename + ": " + std::strerror(errno));
+      }
+
+      struct stat statbuf;
+      if (::fstat(fd, &statbuf) < 0) {
+        ::close(fd);
+        throw std::runtime_error("fstat failed for " + filename);
+      }
+
+      size_ = statbuf.st_size;
+
+      if (size_ > 0) {
+        p_ = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE|MAP_POPULATE, fd, 0);
+      }
+
+      ::close(fd);
+
+      if (p_ == MAP_FAILED) {
+        p_ = nullptr;
+        throw std::runtime_error("mmap failed for " + filename);
+      }
+    }
+
+    ~Mapping() {
+      if (p_) {
+        ::munmap(p_, size_);
+      }
+    }
+
+    Mapping(Mapping const &) = delete;
+    Mapping & operator=(Mapping const &) = delete;
+
+    char const * data() const { return static_cast<char const *>(p_); }
+    std::size_t size() const { return size_; }
+
+  private:
+    void * p_ = nullptr;
+    std::size_t size_ = 0;
+  };
+
+  static void check(std::size_t ret, char const * what) {
+    if (ZSTD_isError(ret)) {
+      throw std::runtime_error(std::string(what) + " failed: " + ZSTD_getErrorName(ret));
+    }
+  }
+
+private:
+  int level_;
+  int threads_;
+  std::size_t stream_threshold_;
+  ZSTD_CCtx * cctx_;
+  ZSTD_DCtx * dctx_;
+  std::vector<char> buf_;
+  std::vector<char> dictionary_;
+  std::string dictionary_filename_;
+  unsigned int ddict_id_ = 0;
+};
+
+}
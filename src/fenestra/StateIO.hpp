@@ -0,0 +1,213 @@
+#pragma once
+
+#include "CoreState.hpp"
+#include "StateCodec.hpp"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <iostream>
+
+#include <sys/stat.h>
+
+namespace fenestra {
+
+// Moves save state file I/O off the game thread.  Saving only requires
+// an in-memory snapshot from the caller; compression, write, fsync and
+// rename all happen on a background thread.  Loading can be prefetched
+// when a slot is selected, so by the time the state is actually loaded
+// it has already been read and decompressed.
+//
+// All compression goes through a single StateCodec owned by the I/O
+// thread, so its zstd contexts are reused for every state.
+class StateIO {
+public:
+  using State_Ptr = std::shared_ptr<CoreState const>;
+
+  StateIO(int level, int threads, std::size_t stream_threshold)
+    : codec_(level, threads, stream_threshold)
+    , th_([this] { run(); })
+  {
+  }
+
+  ~StateIO() {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      done_ = true;
+    }
+
+    cond_.notify_all();
+    th_.join();
+  }
+
+  StateIO(StateIO const &) = delete;
+  StateIO & operator=(StateIO const &) = delete;
+
+  // Read states that need it with the dictionary in dict_filename and,
+  // if compress is set, compress new states with it too.  If it does not
+  // exist yet, try to train one from the given state files first.
+  void use_dictionary(std::string const & dict_filename, bool compress, std::vector<std::string> const & training_filenames) {
+    submit([this, dict_filename, compress, training_filenames] {
+      try {
+        codec_.set_dictionary_filename(dict_filename);
+        if (!compress) {
+          return;
+        }
+
+        struct stat statbuf;
+        if (::stat(dict_filename.c_str(), &statbuf) < 0) {
+          if (!codec_.train_dictionary(training_filenames, dict_filename)) {
+            return;
+          }
+          std::cout << "Trained state dictionary " << dict_filename << std::endl;
+        }
+
+        codec_.load_dictionary(dict_filename);
+        std::cout << "Using state dictionary " << dict_filename << std::endl;
+      } catch(std::exception const & ex) {
+        std::cout << "Not using state dictionary " << dict_filename << ": " << ex.what() << std::endl;
+      }
+    });
+  }
+
+  void save(std::string const & filename, State_Ptr state) {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    // The state being written is the most up-to-date version of this
+    // slot, so a later load does not need to wait for the file
+    cache_ = Cache { filename, state, true, nullptr, false, { } };
+
+    jobs_.push_back([this, filename, state] {
+      try {
+        codec_.save(*state, filename);
+        std::cout << "Saved state to " << filename << std::endl;
+      } catch(std::exception const & ex) {
+        std::cout << "Failed to save state to " << filename << ": " << ex.what() << std::endl;
+      }
+    });
+
+    cond_.notify_one();
+  }
+
+  void prefetch(std::string const & filename) {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    if (cache_.filename != filename) {
+      fetch(filename);
+    }
+  }
+
+  State_Ptr load(std::string const & filename) {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    if (cache_.filename != filename || (cache_.ready && cache_.from_file && modified_since(filename, cache_.mtime))) {
+      fetch(filename);
+    }
+
+    ready_cond_.wait(lock, [&] { return cache_.ready; });
+
+    if (cache_.error) {
+      auto error = cache_.error;
+      cache_ = Cache { };
+      std::rethrow_exception(error);
+    }
+
+    return cache_.state;
+  }
+
+private:
+  struct Cache {
+    std::string filename;
+    State_Ptr state;
+    bool ready = false;
+    std::exception_ptr error;
+    bool from_file = false;
+    timespec mtime { };
+  };
+
+  // Queue a read of filename into the cache; mutex_ must be held
+  void fetch(std::string const & filename) {
+    cache_ = Cache { filename, nullptr, false, nullptr, true, { } };
+
+    jobs_.push_back([this, filename] {
+      State_Ptr state;
+      std::exception_ptr error;
+      auto mtime = modification_time(filename);
+
+      try {
+        state = std::make_shared<CoreState>(codec_.load(filename));
+      } catch(...) {
+        error = std::current_exception();
+      }
+
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (cache_.filename == filename && !cache_.ready) {
+        cache_.state = state;
+        cache_.error = error;
+        cache_.mtime = mtime;
+        cache_.ready = true;
+        ready_cond_.notify_all();
+      }
+    });
+
+    cond_.notify_one();
+  }
+
+  void submit(std::function<void()> job) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    jobs_.push_back(std::move(job));
+    cond_.notify_one();
+  }
+
+  static timespec modification_time(std::string const & filename) {
+    struct stat statbuf;
+    if (::stat(filename.c_str(), &statbuf) < 0) {
+      return timespec { };
+    }
+    return statbuf.st_mtim;
+  }
+
+  static bool modified_since(std::string const & filename, timespec mtime) {
+    auto t = modification_time(filename);
+    return t.tv_sec != mtime.tv_sec || t.tv_nsec != mtime.tv_nsec;
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    for (;;) {
+      cond_.wait(lock, [&] { return done_ || !jobs_.empty(); });
+
+      // Finish outstanding writes before exiting, so a save requested
+      // just before quitting is not lost
+      if (jobs_.empty() && done_) {
+        break;
+      }
+
+      auto job = std::move(jobs_.front());
+      jobs_.pop_front();
+
+      lock.unlock();
+      job();
+      lock.lock();
+    }
+  }
+
+private:
+  StateCodec codec_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::condition_variable ready_cond_;
+  std::deque<std::function<void()>> jobs_;
+  Cache cache_;
+  bool done_ = false;
+  std::thread th_;
+};
+
+}
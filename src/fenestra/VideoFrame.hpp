@@ -0,0 +1,167 @@
+#pragma once
+
+#include "libretro.h"
+
+#include "Clock.hpp"
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace fenestra {
+
+// A frame produced by the core, along with everything needed to
+// interpret it.  A frame is either a view of the core's own buffer
+// (only valid during video_refresh) or a snapshot from a FramePool,
+// which can be shared between threads.  Either way it is immutable;
+// consumers that need a different layout ask for one, and it is
+// computed at most once per frame no matter how many consumers ask.
+class VideoFrame {
+public:
+  VideoFrame(void const * data, unsigned int width, unsigned int height, std::size_t pitch, retro_pixel_format format, Timestamp time, std::uint64_t number)
+    : data_(static_cast<std::uint8_t const *>(data))
+    , width_(width)
+    , height_(height)
+    , pitch_(pitch)
+    , format_(format)
+    , time_(time)
+    , number_(number)
+  {
+  }
+
+  VideoFrame(VideoFrame const &) = delete;
+  VideoFrame & operator=(VideoFrame const &) = delete;
+
+  std::uint8_t const * data() const { return data_; }
+
+  // Bytes from the start of the first row to the end of the last
+  std::size_t size() const { return height_ > 0 ? (height_ - 1) * pitch_ + row_size() : 0; }
+
+  unsigned int width() const { return width_; }
+  unsigned int height() const { return height_; }
+  std::size_t pitch() const { return pitch_; }
+  retro_pixel_format format() const { return format_; }
+
+  Timestamp time() const { return time_; }
+  std::uint64_t number() const { return number_; }
+
+  static std::size_t bytes_per_pixel(retro_pixel_format format) {
+    return format == RETRO_PIXEL_FORMAT_XRGB8888 ? 4 : 2;
+  }
+
+  std::size_t bytes_per_pixel() const { return bytes_per_pixel(format_); }
+
+  // Bytes per row, excluding any padding
+  std::size_t row_size() const { return width_ * bytes_per_pixel(); }
+
+  std::uint8_t const * row(unsigned int y) const { return data() + y * pitch_; }
+
+  // The frame with padding removed from each row (pitch == row_size())
+  std::uint8_t const * packed() const {
+    if (pitch_ == row_size()) {
+      return data_;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    if (!has_packed_) {
+      packed_.resize(row_size() * height_);
+      for (unsigned int y = 0; y < height_; ++y) {
+        std::memcpy(packed_.data() + y * row_size(), row(y), row_size());
+      }
+      has_packed_ = true;
+    }
+
+    return packed_.data();
+  }
+
+private:
+  friend class FramePool;
+
+  VideoFrame() = default;
+
+  std::uint8_t const * data_ = nullptr;
+  unsigned int width_ = 0;
+  unsigned int height_ = 0;
+  std::size_t pitch_ = 0;
+  retro_pixel_format format_ = RETRO_PIXEL_FORMAT_0RGB1555;
+  Timestamp time_;
+  std::uint64_t number_ = 0;
+
+  std::vector<std::uint8_t> buf_;
+
+  mutable std::mutex mutex_;
+  mutable std::vector<std::uint8_t> packed_;
+  mutable bool has_packed_ = false;
+};
+
+// Hands out reference-counted snapshots of frames.  When the last
+// reference to a snapshot is dropped, it goes back to the pool, so its
+// buffers can be reused without allocating.
+class FramePool {
+public:
+  using Frame_Ptr = std::shared_ptr<VideoFrame const>;
+
+  FramePool()
+    : free_(std::make_shared<Free_List>())
+  {
+  }
+
+  // Copy a frame.  The rows are copied along with their padding, so
+  // this is a single memcpy.
+  Frame_Ptr snapshot(VideoFrame const & view) {
+    auto frame = acquire();
+
+    frame->width_ = view.width();
+    frame->height_ = view.height();
+    frame->pitch_ = view.pitch();
+    frame->format_ = view.format();
+    frame->time_ = view.time();
+    frame->number_ = view.number();
+    frame->has_packed_ = false;
+
+    frame->buf_.resize(view.size());
+    std::memcpy(frame->buf_.data(), view.data(), view.size());
+    frame->data_ = frame->buf_.data();
+
+    return release(std::move(frame));
+  }
+
+private:
+  struct Free_List {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<VideoFrame>> frames;
+  };
+
+  std::unique_ptr<VideoFrame> acquire() {
+    std::unique_lock<std::mutex> lock(free_->mutex);
+
+    if (free_->frames.empty()) {
+      return std::unique_ptr<VideoFrame>(new VideoFrame());
+    }
+
+    auto frame = std::move(free_->frames.back());
+    free_->frames.pop_back();
+    return frame;
+  }
+
+  Frame_Ptr release(std::unique_ptr<VideoFrame> frame) {
+    // The free list is shared with the deleter, so frames that outlive
+    // the pool are simply freed
+    return Frame_Ptr(frame.release(), [free = std::weak_ptr<Free_List>(free_)](VideoFrame const * p) {
+      std::unique_ptr<VideoFrame> frame(const_cast<VideoFrame *>(p));
+      if (auto list = free.lock()) {
+        std::unique_lock<std::mutex> lock(list->mutex);
+        list->frames.push_back(std::move(frame));
+      }
+    });
+  }
+
+private:
+  std::shared_ptr<Free_List> free_;
+};
+
+}
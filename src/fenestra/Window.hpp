@@ -24,17 +24,32 @@ class Window {
 public:
   Window(std::string const & title, Config const & config)
     : title_(title)
+    , headless_(config.fetch<bool>("headless", false))
   {
+    if (headless_) {
+      return;
+    }
+
     if (!glfwInit()) {
       throw std::runtime_error("glfwInit failed");
     }
   }
 
   ~Window() {
-    glfwTerminate();
+    if (!headless_) {
+      glfwTerminate();
+    }
   }
 
+  bool headless() const { return headless_; }
+
   void init(Geometry const & geom) {
+    // Headless windows are used by tools that only need to run the
+    // core; there is no GL context, so no video plugins can be used
+    if (headless_) {
+      return;
+    }
+
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 2);
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
     glfwWindowHint(GLFW_RESIZABLE, GL_FALSE);
@@ -58,6 +73,10 @@ public:
   }
 
   void poll_events(State & state) {
+    if (headless_) {
+      return;
+    }
+
     current_ = this;
 
     glfwPollEvents();
@@ -68,7 +87,7 @@ public:
   }
 
   bool done() const {
-    return glfwWindowShouldClose(win_);
+    return win_ && glfwWindowShouldClose(win_);
   }
 
 private:
@@ -111,6 +130,7 @@ private:
   static inline Window * current_ = nullptr;
 
   std::string title_;
+  bool const & headless_;
 
   GLFWwindow * win_ = nullptr;
 
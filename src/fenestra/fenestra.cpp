@@ -14,10 +14,15 @@
 #include "plugins/Sync.hpp"
 #include "plugins/Framedelay.hpp"
 #include "plugins/V4l2Stream.hpp"
+#include "plugins/Recorder.hpp"
+#include "plugins/Framehash.hpp"
+#include "plugins/InputMovie.hpp"
 #include "plugins/SSR.hpp"
 #include "plugins/Netcmds.hpp"
 #include "plugins/Rusage.hpp"
 #include "plugins/Screensaver.hpp"
+#include "plugins/Rewind.hpp"
+#include "plugins/Metrics.hpp"
 
 #ifdef HAVE_PORTAUDIO
 #include "plugins/Portaudio.hpp"
@@ -31,7 +36,7 @@
 #include "plugins/Pulseaudio.hpp"
 #endif
 
-#ifdef HAVE_GSTREAMER
+#ifdef HAVE_GSTREAMERMM
 #include "plugins/Gstreamer.hpp"
 #include <gstreamermm/init.h>
 #endif
@@ -43,7 +48,7 @@
 int main(int argc, char *argv[]) {
   using namespace fenestra;
 
-#ifdef HAVE_GSTREAMER
+#ifdef HAVE_GSTREAMERMM
   Gst::init(argc, argv);
 #endif
 
@@ -93,9 +98,14 @@ int main(int argc, char *argv[]) {
   frontend.add_plugin<Framedelay>("framedelay");
   frontend.add_plugin<V4l2Stream>("v4l2stream");
   frontend.add_plugin<SSR>("ssr");
+  frontend.add_plugin<Recorder>("recorder");
+  frontend.add_plugin<Framehash>("framehash");
   frontend.add_plugin<Netcmds>("netcmds");
   frontend.add_plugin<Rusage>("rusage");
   frontend.add_plugin<Screensaver>("screensaver");
+  frontend.add_plugin<Rewind>("rewind");
+  frontend.add_plugin<InputMovie>("inputmovie");
+  frontend.add_plugin<Metrics>("metrics");
 
 #ifdef HAVE_PORTAUDIO
   frontend.add_plugin<Portaudio>("portaudio");
@@ -109,7 +119,7 @@ int main(int argc, char *argv[]) {
   frontend.add_plugin<Pulseaudio>("pulseaudio");
 #endif
 
-#ifdef HAVE_GSTREAMER
+#ifdef HAVE_GSTREAMERMM
   frontend.add_plugin<Gstreamer>("gstreamer");
 #endif
 
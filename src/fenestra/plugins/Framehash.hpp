@@ -0,0 +1,197 @@
+#pragma once
+
+#include "fenestra/Plugin.hpp"
+#include "fenestra/Hash.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+namespace fenestra {
+
+// A framehash log: a magic followed by one record per frame.
+namespace Framehash_Log {
+
+inline constexpr char magic[8] = { 'F', 'E', 'N', 'H', 'A', 'S', 'H', '1' };
+
+struct Record {
+  std::uint64_t frame;
+  std::uint64_t video_hash;   // XXH64 of the geometry, format and visible pixels
+  std::uint64_t audio_hash;   // XXH64 of the samples since the previous frame
+  std::uint64_t audio_frames;
+};
+
+static_assert(sizeof(Record) == 32);
+
+inline std::vector<Record> load(std::string const & filename) {
+  std::ifstream file(filename, std::ios::binary);
+  char m[sizeof(magic)];
+
+  if (!file.read(m, sizeof(m)) || std::memcmp(m, magic, sizeof(magic)) != 0) {
+    throw std::runtime_error("Not a framehash log: " + filename);
+  }
+
+  std::vector<Record> records;
+  Record record;
+  while (file.read(reinterpret_cast<char *>(&record), sizeof(record))) {
+    records.push_back(record);
+  }
+
+  return records;
+}
+
+inline std::string describe(Record const & actual, Record const & expected) {
+  std::stringstream strm;
+  strm << "frame " << actual.frame << ":";
+  if (actual.frame != expected.frame) {
+    strm << " expected frame " << expected.frame;
+  }
+  if (actual.video_hash != expected.video_hash) {
+    strm << std::hex << std::setfill('0') << " video " << std::setw(16) << actual.video_hash << " != " << std::setw(16) << expected.video_hash << std::dec;
+  }
+  if (actual.audio_hash != expected.audio_hash || actual.audio_frames != expected.audio_frames) {
+    strm << " audio (" << actual.audio_frames << " samples) != expected (" << expected.audio_frames << " samples)";
+  }
+  return strm.str();
+}
+
+}
+
+// Hashes every frame the core produces, along with the audio produced
+// with it, and writes the hashes to a log and/or compares them to a
+// golden log.  Combined with a fixed input sequence, this shows
+// whether a core (or fenestra) still produces exactly the same output,
+// and if not, the first frame where it differs.
+class Framehash
+  : public Plugin
+{
+public:
+  using Record = Framehash_Log::Record;
+
+  Framehash(Config::Subtree const & config, std::string const & instance)
+    : filename_(config.fetch<std::string>("filename", ""))
+    , golden_filename_(config.fetch<std::string>("golden", ""))
+    , stop_on_divergence_(config.fetch<bool>("stop_on_divergence", false))
+    , stop_at_end_(config.fetch<bool>("stop_at_end", false))
+  {
+    if (filename_ != "") {
+      file_.open(filename_, std::ios::binary);
+      if (!file_) {
+        throw std::runtime_error("Could not open " + filename_);
+      }
+      file_.write(Framehash_Log::magic, sizeof(Framehash_Log::magic));
+    }
+
+    if (golden_filename_ != "") {
+      golden_ = Framehash_Log::load(golden_filename_);
+      std::cout << "Comparing against " << golden_.size() << " frames from " << golden_filename_ << std::endl;
+    }
+  }
+
+  ~Framehash() {
+    if (golden_filename_ == "") {
+      return;
+    }
+
+    if (divergence_) {
+      std::cout << "Framehash: DIVERGED at " << *divergence_ << std::endl;
+    } else if (compared_ < golden_.size()) {
+      std::cout << "Framehash: matched " << compared_ << " of " << golden_.size() << " frames (incomplete)" << std::endl;
+    } else {
+      std::cout << "Framehash: matched all " << compared_ << " frames" << std::endl;
+    }
+  }
+
+  virtual void write_audio_sample(void const * data, std::size_t frames) override {
+    audio_.update(data, frames * 2 * sizeof(std::int16_t));
+    audio_frames_ += frames;
+  }
+
+  virtual void video_refresh(VideoFrame const & frame) override {
+    video_.reset();
+    video_.update(std::uint32_t(frame.width()));
+    video_.update(std::uint32_t(frame.height()));
+    video_.update(std::uint32_t(frame.format()));
+
+    // Padding at the end of each row is not part of the image, and
+    // differs between cores and builds
+    if (frame.pitch() == frame.row_size()) {
+      video_.update(frame.data(), frame.size());
+    } else {
+      for (unsigned int y = 0; y < frame.height(); ++y) {
+        video_.update(frame.row(y), frame.row_size());
+      }
+    }
+
+    frame_ = frame.number();
+    pending_ = true;
+  }
+
+  // Audio is usually written after the frame within retro_run, so the
+  // record is completed once the core has finished running
+  virtual void video_render() override {
+    if (!pending_) {
+      return;
+    }
+
+    pending_ = false;
+
+    Record record = { frame_, video_.digest(), audio_.digest(), audio_frames_ };
+    audio_.reset();
+    audio_frames_ = 0;
+
+    if (file_.is_open()) {
+      file_.write(reinterpret_cast<char const *>(&record), sizeof(record));
+    }
+
+    if (golden_filename_ != "" && !divergence_ && compared_ < golden_.size()) {
+      auto const & expected = golden_[compared_];
+      if (std::memcmp(&record, &expected, sizeof(record)) != 0) {
+        divergence_ = Framehash_Log::describe(record, expected);
+        std::cout << "Framehash: first divergence at " << *divergence_ << std::endl;
+      } else {
+        ++compared_;
+      }
+    }
+  }
+
+  virtual void window_sync(State & state) override {
+    if ((divergence_ && stop_on_divergence_) || (stop_at_end_ && !golden_.empty() && compared_ == golden_.size())) {
+      state.done = true;
+    }
+  }
+
+  virtual void collect_metrics(Probe & probe, Probe::Dictionary & dictionary) override {
+    if (golden_filename_ == "") return;
+
+    if (!matched_key_) matched_key_ = dictionary["Framehash matched"];
+    probe.meter(*matched_key_, Probe::VALUE, 0, compared_);
+  }
+
+private:
+  std::string const & filename_;
+  std::string const & golden_filename_;
+  bool const & stop_on_divergence_;
+  bool const & stop_at_end_;
+
+  std::ofstream file_;
+  std::vector<Record> golden_;
+  std::size_t compared_ = 0;
+  std::optional<std::string> divergence_;
+
+  Hash64 video_;
+  Hash64 audio_;
+  std::uint64_t audio_frames_ = 0;
+  std::uint64_t frame_ = 0;
+  bool pending_ = false;
+
+  std::optional<Probe::Key> matched_key_;
+};
+
+}
@@ -183,7 +183,7 @@ public:
     sync_timers_.resize(16);
   }
 
-  virtual void video_refresh(const void * data, unsigned int width, unsigned int height, std::size_t pitch) override {
+  virtual void video_refresh(VideoFrame const & frame) override {
     next_render_query_idx_ = (render_query_idx_ + 1) % render_timers_.size();
     if (next_render_query_idx_ != render_result_idx_ && !render_timers_[render_query_idx_].running()) {
       flush_errors();
@@ -192,12 +192,12 @@ public:
     }
 
     glBindTexture(GL_TEXTURE_2D, tex_id_);
-    glPixelStorei(GL_UNPACK_ROW_LENGTH, pitch / (pixel_format_.bpp / CHAR_BIT));
-    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, pixel_format_.format, pixel_format_.type, data);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, frame.pitch() / frame.bytes_per_pixel());
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, frame.width(), frame.height(), pixel_format_.format, pixel_format_.type, frame.data());
     glBindTexture(GL_TEXTURE_2D, 0);
 
-    render_w_ = width;
-    render_h_ = height;
+    render_w_ = frame.width();
+    render_h_ = frame.height();
   }
 
   virtual void video_render() override {
@@ -3,133 +3,396 @@
 #include "fenestra/Plugin.hpp"
 
 #include <gst/gst.h>
+#include <gst/app/gstappsrc.h>
 #include <gst/video/video.h>
 #include <gstreamermm/pipeline.h>
 #include <gstreamermm/elementfactory.h>
 #include <gstreamermm/parse.h>
-#include <gstreamermm/appsrc.h>
 #include <gstreamermm/element.h>
-#include <gstreamermm/buffer.h>
 
 #include <stdexcept>
+#include <algorithm>
 #include <map>
+#include <atomic>
+#include <optional>
 #include <cstdint>
+#include <cstring>
 
 namespace fenestra {
 
+// Sends video (and optionally audio) to a gstreamer pipeline.
+//
+// Either set sink_pipeline, which receives raw video after a videorate
+// and videoconvert, or set pipeline to a complete pipeline containing
+// an appsrc named "video" and optionally one named "audio", e.g.:
+//
+//   appsrc name=video ! videoconvert ! x264enc ! mux.
+//   appsrc name=audio ! audioconvert ! opusenc ! mux.
+//   matroskamux name=mux ! filesink location=session.mkv
+//
+// Buffers come from fixed-size pools and are timestamped from
+// fenestra's own frame and audio clocks.  When the pipeline signals it
+// has enough data, frames are dropped rather than queued.
 class Gstreamer
   : public Plugin
 {
 public:
-  struct Pixel_Format {
-    std::string caps_format;
-    int bpp;
+  static inline std::map<unsigned int, char const *> const pixel_formats = {
+    { RETRO_PIXEL_FORMAT_0RGB1555, "RGB15" },
+    { RETRO_PIXEL_FORMAT_RGB565,   "RGB16" },
+    { RETRO_PIXEL_FORMAT_XRGB8888, "BGRx" },
   };
 
-  static inline std::map<unsigned int, Pixel_Format> const pixel_formats = {
-    { RETRO_PIXEL_FORMAT_RGB565,   { "RGB16", 16 } },
-  };
-
-  Gstreamer(Config const & config, std::string const & instance)
+  Gstreamer(Config::Subtree const & config, std::string const & instance)
     : sink_pipeline_(config.fetch<std::string>("sink_pipeline", ""))
+    , pipeline_description_(config.fetch<std::string>("pipeline", ""))
+    , pool_buffers_(config.fetch<unsigned int>("buffers", 8))
   {
-    if (sink_pipeline_ != "") {
+    if (pipeline_description_ != "") {
+      open_pipeline(pipeline_description_);
+    } else if (sink_pipeline_ != "") {
       open(sink_pipeline_);
     }
   }
 
   ~Gstreamer() {
+    if (playing_) {
+      finish();
+    }
+
+    for (auto * stream : { &video_, &audio_ }) {
+      if (stream->pool) {
+        gst_buffer_pool_set_active(stream->pool, FALSE);
+        gst_object_unref(stream->pool);
+      }
+      if (stream->src) {
+        gst_object_unref(stream->src);
+      }
+    }
   }
 
+  // A source, videorate and videoconvert feeding the given sink
   void open(std::string const & sink_pipeline) {
-    pipeline_ = Gst::Pipeline::create("fenestra-stream-pipeline");
+    auto pipeline = Gst::Pipeline::create("fenestra-stream-pipeline");
+    pipeline_ = pipeline;
 
-    source_ = Gst::ElementFactory::create_element("appsrc", "libretro-source");
-    appsrc_ = decltype(appsrc_)::cast_dynamic(source_);
-    pipeline_->add(source_);
+    source_ = Gst::ElementFactory::create_element("appsrc", "video");
+    pipeline->add(source_);
 
     rate_ = Gst::ElementFactory::create_element("videorate", "videorate");
-    pipeline_->add(rate_);
+    pipeline->add(rate_);
 
     conv_ = Gst::ElementFactory::create_element("videoconvert", "videoconvert");
-    pipeline_->add(conv_);
+    pipeline->add(conv_);
 
     sink_ = Gst::Parse::create_bin(sink_pipeline, true);
     sink_->set_property("name", std::string("capture-sink"));
-    pipeline_->add(sink_);
+    pipeline->add(sink_);
+
+    source_->link(rate_)->link(conv_)->link(sink_);
+
+    video_.src = GST_APP_SRC(gst_object_ref(source_->gobj()));
+    setup_source(video_);
   }
 
-  virtual void set_pixel_format(retro_pixel_format format) override {
-    pixel_format_ = pixel_formats.at(format);
+  // A complete pipeline with appsrcs named "video" and "audio"
+  void open_pipeline(std::string const & description) {
+    pipeline_ = Gst::Parse::launch(description);
+
+    auto * bin = GST_BIN(pipeline_->gobj());
+
+    if (auto * video = gst_bin_get_by_name(bin, "video")) {
+      video_.src = GST_APP_SRC(video);
+      setup_source(video_);
+    }
+
+    if (auto * audio = gst_bin_get_by_name(bin, "audio")) {
+      audio_.src = GST_APP_SRC(audio);
+      setup_source(audio_);
+    }
+
+    if (!video_.src && !audio_.src) {
+      throw std::runtime_error("gstreamer pipeline has no appsrc named video or audio");
+    }
   }
 
-  virtual void set_geometry(Geometry const & geom) override {
-    if (!source_ || !pipeline_) {
+  virtual void set_sample_rate(double sample_rate, double adjusted_rate) override {
+    if (!pipeline_) {
       return;
     }
 
-    auto caps = Gst::Caps::create_simple(
-        "video/x-raw",
-        "format", pixel_format_.caps_format,
-        "colorimetry", std::string("sRGB"),
-        "width", int(geom.base_width()),
-        "height", int(geom.base_height()),
-        "framerate", Gst::Fraction(0, 1)); // variable framerate
-
-    source_->set_property("caps", caps);
+    if (audio_.src) {
+      sample_rate_ = sample_rate;
 
-    source_->link(rate_)->link(conv_)->link(sink_);
+      auto * caps = gst_caps_new_simple("audio/x-raw",
+          "format", G_TYPE_STRING, "S16LE",
+          "layout", G_TYPE_STRING, "interleaved",
+          "channels", G_TYPE_INT, 2,
+          "rate", G_TYPE_INT, int(sample_rate),
+          nullptr);
 
-    source_->set_property("format", Gst::FORMAT_TIME);
-    source_->set_property("stream_type", Gst::APP_STREAM_TYPE_STREAM);
-    source_->set_property("is-live", true);
-    source_->set_property("min-latency", 0);
-    source_->set_property("do-timestamp", true);
+      // Pool buffers hold up to a frame and a half of samples
+      audio_buffer_size_ = std::size_t(sample_rate / 40) * bytes_per_audio_frame;
+      configure(audio_, caps, audio_buffer_size_);
+      gst_caps_unref(caps);
+    }
 
+    // This is the last thing Frontend::init sets up, so everything the
+    // pipeline needs to negotiate is known (video caps are set when the
+    // first frame arrives)
     pipeline_->set_state(Gst::STATE_PLAYING);
+    playing_ = true;
   }
 
-  virtual void video_refresh(const void * data, unsigned int width, unsigned int height, std::size_t pitch) override {
-    if (!appsrc_) {
+  virtual bool wants_capture() const override { return video_.src != nullptr; }
+
+  virtual void capture_frame(VideoFrame const & frame) override {
+    if (!video_.src) {
       return;
     }
 
-    auto Bpp = pixel_format_.bpp / CHAR_BIT;
-    auto size = width * height * Bpp;
-    buf_ = Gst::Buffer::create(size);
+    if (frame.width() != width_ || frame.height() != height_ || frame.format() != format_) {
+      configure_video(frame);
+    }
 
-    for (std::size_t i = 0; i < height; ++i) {
-      auto start_idx = i * pitch;
-      auto end_idx = start_idx + width * Bpp;
-      auto start = static_cast<char const *>(data) + start_idx;
-      auto end = static_cast<char const *>(data) + end_idx;
+    if (video_.enough_data) {
+      ++video_.dropped;
+      return;
+    }
 
-      buf_->fill(i * width * Bpp, start, end - start);
+    auto * buf = acquire(video_);
+    if (!buf) {
+      return;
+    }
+
+    GstVideoFrame vframe;
+    if (!gst_video_frame_map(&vframe, &video_info_, buf, GST_MAP_WRITE)) {
+      gst_buffer_unref(buf);
+      throw std::runtime_error("gst_video_frame_map failed");
     }
+
+    auto * dest = static_cast<std::uint8_t *>(GST_VIDEO_FRAME_PLANE_DATA(&vframe, 0));
+    auto stride = GST_VIDEO_FRAME_PLANE_STRIDE(&vframe, 0);
+    for (unsigned int y = 0; y < frame.height(); ++y) {
+      std::memcpy(dest + y * stride, frame.row(y), frame.row_size());
+    }
+
+    gst_video_frame_unmap(&vframe);
+
+    GST_BUFFER_PTS(buf) = running_time(frame.time());
+    push(video_, buf);
   }
 
-  virtual void pre_frame_delay(State const & state) override {
-    if (buf_ && appsrc_) {
-      Glib::RefPtr<Gst::Buffer> buf(buf_.release());
-      auto ret = appsrc_->push_buffer(buf);
-      if (ret != Gst::FLOW_OK) {
-        throw std::runtime_error("push_buffer failed");
+  virtual void write_audio_sample(void const * data, std::size_t frames) override {
+    if (!audio_.src || sample_rate_ == 0) {
+      return;
+    }
+
+    auto const * src = static_cast<std::uint8_t const *>(data);
+
+    while (frames > 0) {
+      auto n = std::min(frames, audio_buffer_size_ / bytes_per_audio_frame);
+
+      if (!audio_start_) {
+        audio_start_ = running_time(Clock::gettime(CLOCK_MONOTONIC));
       }
+
+      // Audio is timestamped by sample count, so it doesn't pick up
+      // jitter from when the core happens to produce it
+      auto pts = *audio_start_ + gst_util_uint64_scale(audio_frames_, GST_SECOND, std::uint64_t(sample_rate_));
+      audio_frames_ += n;
+
+      if (audio_.enough_data) {
+        ++audio_.dropped;
+      } else if (auto * buf = acquire(audio_)) {
+        gst_buffer_fill(buf, 0, src, n * bytes_per_audio_frame);
+        gst_buffer_set_size(buf, n * bytes_per_audio_frame);
+        GST_BUFFER_PTS(buf) = pts;
+        GST_BUFFER_DURATION(buf) = gst_util_uint64_scale(n, GST_SECOND, std::uint64_t(sample_rate_));
+        push(audio_, buf);
+      }
+
+      src += n * bytes_per_audio_frame;
+      frames -= n;
+    }
+  }
+
+  virtual void collect_metrics(Probe & probe, Probe::Dictionary & dictionary) override {
+    for (auto * stream : { &video_, &audio_ }) {
+      if (!stream->src) continue;
+
+      auto name = std::string("Gstreamer ") + (stream == &video_ ? "video" : "audio");
+      if (!stream->need_data_key) stream->need_data_key = dictionary[name + " need-data"];
+      if (!stream->enough_data_key) stream->enough_data_key = dictionary[name + " enough-data"];
+      if (!stream->queued_key) stream->queued_key = dictionary.define(name + " queued", 1000);
+      if (!stream->dropped_key) stream->dropped_key = dictionary[name + " dropped"];
+
+      probe.meter(*stream->need_data_key, Probe::VALUE, 0, stream->need_data_count.load());
+      probe.meter(*stream->enough_data_key, Probe::VALUE, 0, stream->enough_data_count.load());
+      probe.meter(*stream->queued_key, Probe::VALUE, 0, gst_app_src_get_current_level_bytes(stream->src) / 1024);
+      probe.meter(*stream->dropped_key, Probe::VALUE, 0, stream->dropped.load());
     }
   }
 
 private:
-  std::string const & sink_pipeline_;
+  static constexpr inline std::size_t bytes_per_audio_frame = 2 * sizeof(std::int16_t);
+
+  struct Stream {
+    GstAppSrc * src = nullptr;
+    GstBufferPool * pool = nullptr;
 
-  Pixel_Format pixel_format_;
+    std::atomic<bool> enough_data = false;
+    std::atomic<std::uint64_t> need_data_count = 0;
+    std::atomic<std::uint64_t> enough_data_count = 0;
+    std::atomic<std::uint64_t> dropped = 0;
 
-  Glib::RefPtr<Gst::Pipeline> pipeline_;
-  Glib::RefPtr<Gst::AppSrc> appsrc_;
+    std::optional<Probe::Key> need_data_key;
+    std::optional<Probe::Key> enough_data_key;
+    std::optional<Probe::Key> queued_key;
+    std::optional<Probe::Key> dropped_key;
+  };
+
+  void setup_source(Stream & stream) {
+    g_object_set(stream.src,
+        "format", GST_FORMAT_TIME,
+        "stream-type", GST_APP_STREAM_TYPE_STREAM,
+        "is-live", TRUE,
+        "min-latency", gint64(0),
+        "do-timestamp", FALSE,
+        nullptr);
+
+    g_signal_connect(stream.src, "need-data", G_CALLBACK(need_data), &stream);
+    g_signal_connect(stream.src, "enough-data", G_CALLBACK(enough_data), &stream);
+  }
+
+  static void need_data(GstAppSrc * src, guint length, gpointer user_data) {
+    auto & stream = *static_cast<Stream *>(user_data);
+    stream.enough_data = false;
+    ++stream.need_data_count;
+  }
+
+  static void enough_data(GstAppSrc * src, gpointer user_data) {
+    auto & stream = *static_cast<Stream *>(user_data);
+    stream.enough_data = true;
+    ++stream.enough_data_count;
+  }
+
+  void configure_video(VideoFrame const & frame) {
+    auto * caps = gst_caps_new_simple("video/x-raw",
+        "format", G_TYPE_STRING, pixel_formats.at(frame.format()),
+        "colorimetry", G_TYPE_STRING, "sRGB",
+        "width", G_TYPE_INT, int(frame.width()),
+        "height", G_TYPE_INT, int(frame.height()),
+        "framerate", GST_TYPE_FRACTION, 0, 1, // variable framerate
+        nullptr);
+
+    if (!gst_video_info_from_caps(&video_info_, caps)) {
+      gst_caps_unref(caps);
+      throw std::runtime_error("gst_video_info_from_caps failed");
+    }
+
+    configure(video_, caps, GST_VIDEO_INFO_SIZE(&video_info_));
+    gst_caps_unref(caps);
+
+    width_ = frame.width();
+    height_ = frame.height();
+    format_ = frame.format();
+  }
+
+  void configure(Stream & stream, GstCaps * caps, std::size_t size) {
+    gst_app_src_set_caps(stream.src, caps);
+
+    if (stream.pool) {
+      gst_buffer_pool_set_active(stream.pool, FALSE);
+      gst_object_unref(stream.pool);
+    }
+
+    stream.pool = gst_buffer_pool_new();
+
+    auto * config = gst_buffer_pool_get_config(stream.pool);
+    gst_buffer_pool_config_set_params(config, caps, size, pool_buffers_, pool_buffers_);
+
+    if (!gst_buffer_pool_set_config(stream.pool, config) || !gst_buffer_pool_set_active(stream.pool, TRUE)) {
+      throw std::runtime_error("Failed to configure gstreamer buffer pool");
+    }
+  }
+
+  // Returns nullptr (and counts a drop) if every buffer is still in use
+  // downstream, rather than waiting for one to be freed
+  GstBuffer * acquire(Stream & stream) {
+    GstBuffer * buf = nullptr;
+    GstBufferPoolAcquireParams params = { };
+    params.flags = GST_BUFFER_POOL_ACQUIRE_FLAG_DONTWAIT;
+
+    if (gst_buffer_pool_acquire_buffer(stream.pool, &buf, &params) != GST_FLOW_OK) {
+      ++stream.dropped;
+      return nullptr;
+    }
+
+    return buf;
+  }
+
+  void push(Stream & stream, GstBuffer * buf) {
+    // The appsrc takes ownership of the buffer
+    auto ret = gst_app_src_push_buffer(stream.src, buf);
+    if (ret != GST_FLOW_OK) {
+      throw std::runtime_error("push_buffer failed");
+    }
+  }
+
+  // Buffer timestamps are relative to the first frame or sample
+  GstClockTime running_time(Timestamp time) {
+    auto ns = nanoseconds_since_epoch(time).count();
+    std::int64_t expected = 0;
+    start_time_.compare_exchange_strong(expected, ns);
+    return std::max<std::int64_t>(ns - start_time_.load(), 0);
+  }
+
+  // Send end-of-stream and wait briefly for it to reach the sinks, so
+  // that muxers can finish writing their files
+  void finish() {
+    for (auto * stream : { &video_, &audio_ }) {
+      if (stream->src) {
+        gst_app_src_end_of_stream(stream->src);
+      }
+    }
+
+    auto * bus = gst_element_get_bus(pipeline_->gobj());
+    auto * msg = gst_bus_timed_pop_filtered(bus, 5 * GST_SECOND, GstMessageType(GST_MESSAGE_EOS | GST_MESSAGE_ERROR));
+    if (msg) {
+      gst_message_unref(msg);
+    }
+    gst_object_unref(bus);
+
+    pipeline_->set_state(Gst::STATE_NULL);
+  }
+
+private:
+  std::string const & sink_pipeline_;
+  std::string const & pipeline_description_;
+  unsigned int const & pool_buffers_;
+
+  Glib::RefPtr<Gst::Element> pipeline_;
   Glib::RefPtr<Gst::Element> source_;
   Glib::RefPtr<Gst::Element> rate_;
   Glib::RefPtr<Gst::Element> conv_;
   Glib::RefPtr<Gst::Element> sink_;
-  Glib::RefPtr<Gst::Buffer> buf_;
+
+  Stream video_;
+  Stream audio_;
+  bool playing_ = false;
+
+  std::atomic<std::int64_t> start_time_ = 0;
+
+  GstVideoInfo video_info_;
+  unsigned int width_ = 0;
+  unsigned int height_ = 0;
+  retro_pixel_format format_ = RETRO_PIXEL_FORMAT_UNKNOWN;
+
+  double sample_rate_ = 0;
+  std::size_t audio_buffer_size_ = 0;
+  std::optional<GstClockTime> audio_start_;
+  std::uint64_t audio_frames_ = 0;
 };
 
 }
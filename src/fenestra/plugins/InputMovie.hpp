@@ -0,0 +1,263 @@
+#pragma once
+
+#include "fenestra/Plugin.hpp"
+#include "fenestra/CoreState.hpp"
+#include "fenestra/StateCodec.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace fenestra {
+
+// Records the joypad state of every port each time the core polls
+// input, and plays it back.  A movie starts either at power-on or from
+// a save state (which is stored in the movie), so replaying it
+// reproduces the same run exactly (for a deterministic core).
+//
+// This plugin must come after the gamepad plugins, so it sees their
+// input when recording and overrides it when playing.  For an uncapped
+// replay, run with "headless": true and only this plugin (plus any
+// measuring plugins, e.g. framehash or perflog) enabled.
+class InputMovie
+  : public Plugin
+{
+public:
+  static constexpr inline char magic[8] = { 'F', 'E', 'N', 'M', 'O', 'V', '0', '1' };
+  static constexpr inline unsigned int buttons = RETRO_DEVICE_ID_JOYPAD_R3 + 1;
+  static_assert(buttons <= 16);
+
+  InputMovie(Config::Subtree const & config, std::string const & instance)
+    : record_filename_(config.fetch<std::string>("record", ""))
+    , play_filename_(config.fetch<std::string>("play", ""))
+    , state_filename_(config.fetch<std::string>("state", ""))
+    , ports_(config.fetch<unsigned int>("ports", 2))
+    , fast_forward_(config.fetch<bool>("fast_forward", false))
+    , stop_at_end_(config.fetch<bool>("stop_at_end", false))
+  {
+    if (record_filename_ != "" && play_filename_ != "") {
+      throw std::runtime_error("inputmovie: cannot record and play at the same time");
+    }
+
+    if (play_filename_ != "") {
+      load(play_filename_);
+    }
+
+    // Everything that can fail is checked here, rather than in the game
+    // loop; recording itself starts in pre_frame_delay
+    if (record_filename_ != "") {
+      if (state_filename_ != "") {
+        StateCodec codec(1, 0, 0);
+        record_state_ = codec.load(state_filename_);
+      }
+
+      file_.open(record_filename_, std::ios::binary);
+      if (!file_) {
+        throw std::runtime_error("Could not open " + record_filename_);
+      }
+    }
+  }
+
+  ~InputMovie() {
+    if (recording_) {
+      std::cout << "Recorded " << polls_ << " input polls to " << record_filename_ << std::endl;
+    }
+  }
+
+  virtual void game_loaded(Core const & core, std::string const & filename) override {
+    core_ = &core;
+
+    retro_system_info info;
+    core.get_system_info(&info);
+    library_ = info.library_name ? info.library_name : "";
+    game_ = std::filesystem::path(filename).filename().native();
+
+    if (playing() && (library_ != movie_library_ || game_ != movie_game_)) {
+      std::cout << "Warning: movie was recorded with " << movie_library_ << " / " << movie_game_
+                << ", not " << library_ << " / " << game_ << std::endl;
+    }
+  }
+
+  virtual void unloading_game(Core const & core) override {
+    core_ = nullptr;
+  }
+
+  // Runs outside of retro_run, so this is where a movie's starting
+  // state is saved or restored
+  virtual void pre_frame_delay(State const & state) override {
+    if (started_ || !core_) {
+      return;
+    }
+
+    started_ = true;
+
+    auto const & start_state = file_.is_open() ? record_state_ : start_state_;
+
+    if (start_state.valid()) {
+      try {
+        start_state.unserialize(*core_);
+      } catch (std::exception const & ex) {
+        std::cout << "ERROR: " << ex.what() << std::endl;
+
+        if (file_.is_open()) {
+          std::cout << "Not recording input to " << record_filename_ << std::endl;
+          file_.close();
+        } else {
+          std::cout << "Playing the movie from the current state; it will probably not match" << std::endl;
+        }
+      }
+    }
+
+    if (file_.is_open()) {
+      start_recording();
+    }
+  }
+
+  virtual void poll_input(State & state) override {
+    if (state.input_state.size() < ports_) {
+      state.input_state.resize(ports_);
+    }
+
+    if (recording_) {
+      for (unsigned int port = 0; port < ports_; ++port) {
+        std::uint16_t mask = 0;
+        for (unsigned int id = 0; id < buttons; ++id) {
+          mask |= (state.input_state[port].pressed[id] ? 1u : 0u) << id;
+        }
+        file_.write(reinterpret_cast<char const *>(&mask), sizeof(mask));
+      }
+      ++polls_;
+    } else if (playing()) {
+      state.fast_forward = fast_forward_ && !ended_;
+
+      auto const * masks = polls_ < movie_polls_ ? &movie_[polls_ * movie_ports_] : nullptr;
+
+      if (!masks && !ended_) {
+        std::cout << "Movie finished after " << polls_ << " input polls" << std::endl;
+        ended_ = true;
+      }
+
+      for (unsigned int port = 0; port < ports_; ++port) {
+        auto mask = masks && port < movie_ports_ ? masks[port] : 0;
+        for (unsigned int id = 0; id < buttons; ++id) {
+          state.input_state[port].pressed[id] = (mask >> id) & 1;
+        }
+      }
+
+      ++polls_;
+    }
+  }
+
+  virtual void window_sync(State & state) override {
+    if (ended_ && stop_at_end_) {
+      state.done = true;
+    }
+  }
+
+private:
+  bool playing() const { return play_filename_ != ""; }
+
+  void start_recording() {
+    file_.write(magic, sizeof(magic));
+    write(std::uint32_t(ports_));
+    write(library_);
+    write(game_);
+    write(std::uint64_t(record_state_.size()));
+    file_.write(record_state_.data(), record_state_.size());
+
+    recording_ = true;
+
+    std::cout << "Recording input to " << record_filename_ << (record_state_.valid() ? " from " + state_filename_ : std::string(" from power-on")) << std::endl;
+  }
+
+  void load(std::string const & filename) {
+    std::ifstream file(filename, std::ios::binary);
+    char m[sizeof(magic)];
+
+    if (!file.read(m, sizeof(m)) || std::memcmp(m, magic, sizeof(magic)) != 0) {
+      throw std::runtime_error("Not an input movie: " + filename);
+    }
+
+    movie_ports_ = read<std::uint32_t>(file);
+    movie_library_ = read_string(file);
+    movie_game_ = read_string(file);
+
+    std::vector<char> state(read<std::uint64_t>(file));
+    if (!file.read(state.data(), state.size())) {
+      throw std::runtime_error("Input movie is truncated: " + filename);
+    }
+    if (!state.empty()) {
+      start_state_ = CoreState(std::move(state));
+    }
+
+    std::uint16_t mask;
+    while (file.read(reinterpret_cast<char *>(&mask), sizeof(mask))) {
+      movie_.push_back(mask);
+    }
+
+    movie_polls_ = movie_ports_ ? movie_.size() / movie_ports_ : 0;
+
+    std::cout << "Playing " << movie_polls_ << " input polls for " << movie_ports_ << " ports from " << filename
+              << (start_state_.valid() ? " (from a saved state)" : " (from power-on)") << std::endl;
+  }
+
+  template <typename T>
+  void write(T value) {
+    file_.write(reinterpret_cast<char const *>(&value), sizeof(value));
+  }
+
+  void write(std::string const & str) {
+    write(std::uint32_t(str.size()));
+    file_.write(str.data(), str.size());
+  }
+
+  template <typename T>
+  static T read(std::istream & in) {
+    T value;
+    if (!in.read(reinterpret_cast<char *>(&value), sizeof(value))) {
+      throw std::runtime_error("Input movie is truncated");
+    }
+    return value;
+  }
+
+  static std::string read_string(std::istream & in) {
+    std::string str(read<std::uint32_t>(in), '\0');
+    if (!in.read(str.data(), str.size())) {
+      throw std::runtime_error("Input movie is truncated");
+    }
+    return str;
+  }
+
+private:
+  std::string const & record_filename_;
+  std::string const & play_filename_;
+  std::string const & state_filename_;
+  unsigned int const & ports_;
+  bool const & fast_forward_;
+  bool const & stop_at_end_;
+
+  Core const * core_ = nullptr;
+  std::string library_;
+  std::string game_;
+  bool started_ = false;
+  std::uint64_t polls_ = 0;
+
+  std::ofstream file_;
+  CoreState record_state_;
+  bool recording_ = false;
+
+  std::uint32_t movie_ports_ = 0;
+  std::string movie_library_;
+  std::string movie_game_;
+  CoreState start_state_;
+  std::vector<std::uint16_t> movie_;
+  std::size_t movie_polls_ = 0;
+  bool ended_ = false;
+};
+
+}
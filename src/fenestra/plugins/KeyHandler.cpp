@@ -12,6 +12,27 @@ fenestra::KeyHandler::game_loaded(Core const & core, std::string const & filenam
 
   state_basename_ = state_basename.native();
   core_ = &core;
+
+  // One dictionary per game, trained from whatever slots already exist
+  // for it.  It is needed to read states that were written with it, so
+  // it is set even when savestate.dictionary is off.
+  auto dict_filename = state_basename;
+  dict_filename.replace_extension(".dict");
+
+  std::vector<std::string> state_filenames;
+  if (use_dictionary_) {
+    auto prefix = state_basename.filename().native();
+    for (auto const & entry : std::filesystem::directory_iterator(state_directory_)) {
+      auto name = entry.path().filename().native();
+      if (entry.is_regular_file() && name.size() > prefix.size() &&
+          name.compare(0, prefix.size(), prefix) == 0 &&
+          name.find_first_not_of("0123456789", prefix.size()) == std::string::npos) {
+        state_filenames.push_back(entry.path().native());
+      }
+    }
+  }
+
+  state_io_.use_dictionary(dict_filename.native(), use_dictionary_, state_filenames);
 }
 
 void
@@ -5,6 +5,7 @@
 #include "fenestra/Config.hpp"
 #include "fenestra/State.hpp"
 #include "fenestra/CoreState.hpp"
+#include "fenestra/StateIO.hpp"
 #include "fenestra/Clock.hpp"
 
 #include <string>
@@ -19,6 +20,11 @@ class KeyHandler
 public:
   KeyHandler(Config::Subtree const & config, std::string const & instance)
     : state_directory_(config.root().fetch<std::string>("paths.state_directory", "."))
+    , use_dictionary_(config.root().fetch<bool>("savestate.dictionary", false))
+    , state_io_(
+        config.root().fetch<int>("savestate.compression_level", 1),
+        config.root().fetch<int>("savestate.threads", 0),
+        config.root().fetch<unsigned int>("savestate.stream_threshold", 16 << 20))
   {
   }
 
@@ -40,6 +46,13 @@ private:
       state.paused = true;
       pause_next_frame_ = false;
     }
+
+    // Prefetch a selected state once no more digits have been typed for
+    // a moment, rather than every slot on the way to a multi-digit one
+    if (prefetch_pending_ && Clock::gettime(CLOCK_REALTIME) - last_digit_time_ >= prefetch_delay) {
+      state_io_.prefetch(state_filename());
+      prefetch_pending_ = false;
+    }
   }
 
   void handle_key_pressed(Key key, State & state) {
@@ -94,10 +107,11 @@ private:
 
       case 'S':
         {
+          // Only take the snapshot here; compressing and writing the
+          // file happens on the I/O thread
           std::string filename = state_filename();
-          auto state = CoreState::serialize(*core_);
-          state.save(filename);
-          std::cout << "Saved state to " << filename << std::endl;
+          auto state = std::make_shared<CoreState>(CoreState::serialize(*core_));
+          state_io_.save(filename, state);
         }
         break;
 
@@ -106,8 +120,8 @@ private:
           last_state_ = CoreState::serialize(*core_);
 
           std::string filename = state_filename();
-          auto state = CoreState::load(filename);
-          state.unserialize(*core_);
+          auto state = state_io_.load(filename);
+          state->unserialize(*core_);
           std::cout << "Loaded state from " << filename << std::endl;
         }
         break;
@@ -142,6 +156,7 @@ private:
           std::cout << "Selected state " << state_number_ << std::endl;
 
           last_digit_time_ = now;
+          prefetch_pending_ = true;
         }
         break;
 
@@ -152,6 +167,7 @@ private:
           std::cout << "Selected state " << state_number_ << std::endl;
 
           last_digit_time_ = now;
+          prefetch_pending_ = true;
         }
     }
   }
@@ -167,6 +183,7 @@ private:
   Core const * core_ = nullptr;
 
   std::string const & state_directory_;
+  bool const & use_dictionary_;
 
   bool close_requested_ = false;
   Timestamp close_requested_time_;
@@ -175,6 +192,8 @@ private:
   Timestamp reset_requested_time_;
 
   Timestamp last_digit_time_;
+  bool prefetch_pending_ = false;
+  static constexpr Milliseconds prefetch_delay = Milliseconds(250);
 
   std::string state_basename_;
 
@@ -182,6 +201,8 @@ private:
 
   CoreState last_state_;
 
+  StateIO state_io_;
+
   bool pause_next_frame_ = false;
 };
 
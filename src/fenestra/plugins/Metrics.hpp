@@ -0,0 +1,34 @@
+#pragma once
+
+#include "fenestra/Plugin.hpp"
+#include "fenestra/plugins/metrics/Exporter.hpp"
+
+#include <memory>
+#include <string>
+
+namespace fenestra {
+
+// Exports the probe metrics over HTTP for Prometheus or a similar
+// scraper (see metrics::Exporter)
+class Metrics
+  : public Plugin
+{
+public:
+  Metrics(Config::Subtree const & config, std::string const & instance)
+    : address_(config.fetch<std::string>("address", "127.0.0.1"))
+    , port_(config.fetch<int>("port", 9464))
+    , exporter_(std::make_unique<metrics::Exporter>(address_, port_))
+  {
+  }
+
+  virtual void record_probe(Probe const & probe, Probe::Dictionary const & dictionary) override {
+    exporter_->record(probe, dictionary);
+  }
+
+private:
+  std::string & address_;
+  int & port_;
+  std::unique_ptr<metrics::Exporter> exporter_;
+};
+
+}
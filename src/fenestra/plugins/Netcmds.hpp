@@ -1,239 +1,346 @@
 #pragma once
 
 #include "fenestra/Plugin.hpp"
-
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <unistd.h>
-#include <fcntl.h>
-
-#include <stdexcept>
+#include "fenestra/plugins/netcmds/Server.hpp"
+#include "fenestra/Hash.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <string>
 #include <vector>
-#include <string_view>
-#include <cctype>
-#include <cstring>
-#include <charconv>
 
 namespace fenestra {
 
+// Retroarch-compatible network commands (see netcmds::Server, which
+// handles the network side on its own thread).
+//
+// On the game thread, this plugin only applies queued writes and takes
+// a snapshot of the memory clients are reading, both in
+// pre_frame_delay, i.e. between frames.  Commands like SAVE_STATE are
+// passed on as key events, for the KeyHandler to handle.
 class Netcmds
   : public Plugin
 {
 public:
   Netcmds(Config::Subtree const & config, std::string const & instance)
     : port_(config.fetch<int>("port", 55355))
+    , tcp_port_(config.fetch<int>("tcp_port", 0))
+    , unix_socket_(config.fetch<std::string>("unix_socket", ""))
+    , watch_timeout_(config.fetch<double>("watch_timeout", 10.0))
+    , max_watched_bytes_(config.fetch<unsigned int>("max_watched_bytes", 4 * 1024 * 1024))
+    , subscription_timeout_(config.fetch<double>("subscription_timeout", 30.0))
+    , max_output_(config.fetch<unsigned int>("max_output", 4 * 1024 * 1024))
+    , system_id_(config.fetch<std::string>("system_id", ""))
+    , system_directory_(config.root().fetch<std::string>("paths.system_directory", "."))
+    , save_directory_(config.root().fetch<std::string>("paths.save_directory", "."))
+    , state_directory_(config.root().fetch<std::string>("paths.state_directory", "."))
   {
   }
 
   virtual void game_loaded(Core const & core, std::string const & filename) override {
     core_ = &core;
+    filename_ = filename;
+    content_crc32_ = crc32_of(filename);
     this->start();
   }
 
-  void start() {
-    if (port_ > 0) {
-      if ((sock_ = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
-        throw std::runtime_error("socket failed");
-      }
-
-      sockaddr_in addr;
-      std::memset(&addr, 0, sizeof(addr));
+  virtual void unloading_game(Core const & core) override {
+    server_.reset();
+    core_ = nullptr;
+  }
 
-      addr.sin_family = AF_INET;
-      addr.sin_addr.s_addr = INADDR_ANY;
-      addr.sin_port = htons(port_);
+  virtual void set_memory_map(MemoryMap const & map) override {
+    memory_map_ = &map;
 
-      if (bind(sock_, (sockaddr const *)&addr, sizeof(addr)) < 0) {
-        throw std::runtime_error("bind failed");
-      }
+    if (server_) {
+      server_->set_have_memory_map(have_memory_map());
+    }
+  }
 
-      if (fcntl(sock_, F_SETFL, O_NONBLOCK) < 0) {
-        throw std::runtime_error("fcntl failed");
-      }
+  void start() {
+    if (port_ > 0 || tcp_port_ > 0 || !unix_socket_.empty()) {
+      netcmds::Server::Settings settings;
+      settings.udp_port = port_;
+      settings.tcp_port = tcp_port_;
+      settings.unix_socket = unix_socket_;
+      settings.watch_timeout = Seconds(watch_timeout_);
+      settings.max_watched_bytes = max_watched_bytes_;
+      settings.subscription_timeout = Seconds(subscription_timeout_);
+      settings.max_output = max_output_;
+
+      retro_system_info info;
+      core_->get_system_info(&info);
+
+      // Retroarch gets the system id from the core's info file, which
+      // we don't have
+      settings.system_id = system_id_.empty() ? info.library_name : system_id_;
+      settings.content_name = std::filesystem::path(filename_).stem().native();
+      settings.content_crc32 = content_crc32_;
+      settings.config_params = {
+        { "system_directory", system_directory_ },
+        { "savefile_directory", save_directory_ },
+        { "savestate_directory", state_directory_ },
+      };
+
+      server_ = std::make_unique<netcmds::Server>(settings);
+      server_->set_have_memory_map(have_memory_map());
     }
   }
 
   virtual void pre_frame_delay(State const & state) override {
-    poll(state);
+    if (!server_ || !core_) {
+      return;
+    }
+
+    server_->set_paused(state.paused);
+
+    while (auto command = server_->pop_command()) {
+      apply(*command);
+    }
+
+    publish_snapshot();
+
+    server_->wake();
   }
 
-  void poll(State const & state) {
-    if (sock_ > 0) {
-      char buf[1500];
-      sockaddr_in reply_addr;
-      socklen_t reply_addr_len = sizeof(reply_addr);
+  virtual void window_sync(State & state) override {
+    for (auto key : keys_) {
+      state.key_events.push_back({ KeyAction::PRESS, key });
+      state.key_events.push_back({ KeyAction::RELEASE, key });
+    }
 
-      for (;;) {
-        int n = recvfrom(sock_, buf, sizeof(buf), 0, (sockaddr *)&reply_addr, &reply_addr_len);
-        if (n <= 0) {
-          break;
-        }
+    keys_.clear();
+  }
 
-        std::string_view str(buf, n);
-        handle_packet(str, reply_addr, reply_addr_len, state);
-      }
+  virtual void collect_metrics(Probe & probe, Probe::Dictionary & dictionary) override {
+    if (!server_) {
+      return;
     }
+
+    if (!commands_key_) commands_key_ = dictionary["Netcmds commands"];
+    if (!dropped_key_) dropped_key_ = dictionary["Netcmds dropped"];
+    if (!writes_key_) writes_key_ = dictionary["Netcmds writes"];
+    if (!watched_key_) watched_key_ = dictionary["Netcmds watched bytes"];
+
+    probe.meter(*commands_key_, Probe::VALUE, 0, server_->commands_handled());
+    probe.meter(*dropped_key_, Probe::VALUE, 0, server_->commands_dropped());
+    probe.meter(*writes_key_, Probe::VALUE, 0, writes_);
+    probe.meter(*watched_key_, Probe::VALUE, 0, watched_bytes_);
   }
 
 private:
-  template<typename F>
-  static void split(std::string_view const & str, std::vector<std::string_view> & res, F issep) {
-    res.clear();
+  bool have_memory_map() const {
+    return memory_map_ && !memory_map_->empty();
+  }
 
-    auto const * p = str.data();
-    auto const * e = p + str.size();
-    auto const * s = p;
+  void apply(netcmds::Command & command) {
+    using Type = netcmds::Command::Type;
 
-    // Ignore trailing separators
-    while (e > p && issep(*(e-1))) --e;
+    switch (command.type) {
+      case Type::WRITE_CORE_RAM:
+        write_core_ram(command.addr, command.bytes);
+        break;
 
-    for(; p < e; ++p) {
-      // Each time we find a separator, add the current token to the list
-      if (issep(*p)) {
-        res.push_back(std::string_view(s, p - s));
-        s = p + 1;
-      }
+      case Type::WRITE_CORE_MEMORY:
+        write_core_memory(command.addr, command.bytes, command.peer);
+        break;
 
-      // Find the next separator
-      while (p != e && issep(*p)) ++p;
-    }
+      case Type::KEYS:
+        keys_ += command.keys;
+        break;
 
-    // Add the final token to the list
-    res.push_back(std::string_view(s, p - s));
-  }
+      case Type::WATCH:
+        watches_ = std::move(command.watches);
+        break;
 
-  std::vector<std::string_view> const & parse(std::string_view str) {
-    split(str, args_, [](auto c) { return std::isspace(c); });
-    return args_;
-  }
+      case Type::RECYCLE:
+        free_snapshots_.push_back(std::move(command.snapshot));
+        break;
 
-  void handle_packet(std::string_view str, sockaddr_in reply_addr, socklen_t reply_addr_len, State const & state) {
-    split(str, cmds_, [](auto c) { return c == '\n'; });
-    for (auto const & cmd : cmds_ ) {
-      auto const & args = parse(cmd);
-      handle_command(args, reply_addr, reply_addr_len, state);
+      case Type::NONE:
+        break;
     }
   }
 
-  void handle_command(std::vector<std::string_view> const & args, sockaddr_in reply_addr, socklen_t reply_addr_len, State const & state) {
-    if (args.empty()) {
-      return;
-    }
+  void write_core_ram(std::size_t addr, std::vector<std::uint8_t> const & bytes) {
+    auto size = core_->get_memory_size(RETRO_MEMORY_SYSTEM_RAM);
+    auto * data = static_cast<uint8_t *>(core_->get_memory_data(RETRO_MEMORY_SYSTEM_RAM));
 
-    auto cmd = args[0];
-    if (cmd == "READ_CORE_RAM" && args.size() >= 3) {
-      handle_read_core_ram(args[1], args[2], reply_addr, reply_addr_len, state);
-    } else if (cmd == "WRITE_CORE_RAM" && args.size() >= 1) {
-      handle_write_core_ram(args[1], std::next(std::begin(args)), std::end(args));
-    } else if (cmd == "GET_STATUS") {
-      handle_get_status(reply_addr, reply_addr_len, state);
-    } else if (cmd == "VERSION") {
-      handle_get_version(reply_addr, reply_addr_len);
-    } else {
-      std::cerr << "Unknown network command: " << cmd << std::endl;
+    for (std::size_t i = 0; i < bytes.size() && addr + i < size; ++i) {
+      data[addr + i] = bytes[i];
     }
+
+    ++writes_;
   }
 
-  void handle_read_core_ram(std::string_view s_addr, std::string_view s_bytes, sockaddr_in reply_addr, socklen_t reply_addr_len, State const & state) {
-    unsigned int addr = 0;
-    std::from_chars(s_addr.data(), s_addr.data() + s_addr.size(), addr, 16);
+  void write_core_memory(std::size_t addr, std::vector<std::uint8_t> const & bytes, netcmds::Peer const & peer) {
+    char const * error = nullptr;
+    auto t = have_memory_map() ? memory_map_->translate(addr) : MemoryMap::Translation();
 
-    unsigned int bytes = 0;
-    std::from_chars(s_bytes.data(), s_bytes.data() + s_bytes.size(), bytes, 10);
+    if (!have_memory_map()) {
+      error = "no memory map defined";
+    } else if (!t.ptr) {
+      error = "no descriptor for address";
+    } else if (t.descriptor->flags & RETRO_MEMDESC_CONST) {
+      error = "descriptor data is readonly";
+    }
 
-    auto size = core_->get_memory_size(RETRO_MEMORY_SYSTEM_RAM);
-    auto const * data = static_cast<uint8_t *>(core_->get_memory_data(RETRO_MEMORY_SYSTEM_RAM));
-    auto sram_size = core_->get_memory_size(RETRO_MEMORY_SAVE_RAM);
-    auto const * sram_data = static_cast<uint8_t *>(core_->get_memory_data(RETRO_MEMORY_SAVE_RAM));
+    std::size_t written = 0;
 
-    auto const max_bytes = 2000;
+    if (!error) {
+      for (auto value : bytes) {
+        if (t.bytes == 0) {
+          t = memory_map_->translate(addr + written);
+          if (!t.ptr || (t.descriptor->flags & RETRO_MEMDESC_CONST)) {
+            break;
+          }
+        }
 
-    if (bytes > max_bytes) {
-      bytes = max_bytes;
+        *t.ptr++ = value;
+        --t.bytes;
+        ++written;
+      }
     }
 
-    reply_.resize(40 + bytes * 3);
-    char * r = reply_.data();
-    r += std::snprintf(reply_.data(), reply_.size(), "READ_CORE_RAM %x", addr);
-
-    if (addr < size) {
-      for (auto i = 0u; i < bytes; ++i) {
-        r += std::snprintf(r, reply_.size() - (r - reply_.data()), " %.2X", data[addr + i]);
-      }
-    } else if (addr < size + sram_size) {
-      // Hack: return sram for addresses beyond system ram (this
-      // probably only works for SNES)
-      addr -= size;
-      for (auto i = 0u; i < bytes; ++i) {
-        r += std::snprintf(r, reply_.size() - (r - reply_.data()), " %.2X", sram_data[addr + i]);
-      }
+    char buf[128];
+    int n;
+    if (error) {
+      n = std::snprintf(buf, sizeof(buf), "WRITE_CORE_MEMORY %zx -1 %s\n", addr, error);
     } else {
-      // TODO: This might be a request for a ROM read, but we don't
-      // support it.
-      r += std::snprintf(r, reply_.size() - (r - reply_.data()), " -1");
+      n = std::snprintf(buf, sizeof(buf), "WRITE_CORE_MEMORY %zx %zu\n", addr, written);
     }
 
-    r += std::snprintf(r, reply_.size() - (r - reply_.data()), "\n");
+    netcmds::Event event;
+    event.type = netcmds::Event::Type::REPLY;
+    event.peer = peer;
+    event.reply.assign(buf, n);
+    server_->push_event(std::move(event));
 
-    send_reply(std::string_view(reply_.data(), r - reply_.data()), reply_addr);
+    ++writes_;
   }
 
-  template<typename It>
-  void handle_write_core_ram(std::string_view s_addr, It begin, It end) {
-    unsigned int addr = 0;
-    std::from_chars(s_addr.data(), s_addr.data() + s_addr.size(), addr, 16);
+  static std::uint32_t crc32_of(std::string const & filename) {
+    std::ifstream file(filename, std::ios::binary);
+    std::vector<char> buf(1024 * 1024);
+    Crc32 crc;
 
-    auto size = core_->get_memory_size(RETRO_MEMORY_SYSTEM_RAM);
-    auto * data = static_cast<uint8_t *>(core_->get_memory_data(RETRO_MEMORY_SYSTEM_RAM));
+    while (file.read(buf.data(), buf.size()) || file.gcount() > 0) {
+      crc.update(buf.data(), file.gcount());
+    }
 
-    for (auto it = begin, i = 0u; it != end; ++it, ++i) {
-      unsigned int value = 0;
-      std::from_chars(it->data(), it->data() + it->size(), value, 10);
+    return crc.digest();
+  }
 
-      if (addr + i < size) {
-        data[addr + i] = value;
-      }
+  void publish_snapshot() {
+    if (watches_.empty()) {
+      watched_bytes_ = 0;
+      return;
     }
-  }
 
-  void handle_get_status(sockaddr_in reply_addr, socklen_t reply_addr_len, State const & state) {
-    reply_.clear();
-    append(reply_, "GET_STATUS ");
-    append(reply_, state.paused ? "PAUSED " : "PLAYING ");
-    append(reply_, "TODO_system_id");
-    append(reply_, ",");
-    append(reply_, "TODO_content_name");
-    append(reply_, ",crc32=");
-    append(reply_, "TODO_content_crc32");
-
-    send_reply(std::string_view(reply_.data(), reply_.size()), reply_addr);
-  }
+    std::unique_ptr<netcmds::Snapshot> snapshot;
+    if (free_snapshots_.empty()) {
+      snapshot = std::make_unique<netcmds::Snapshot>();
+    } else {
+      snapshot = std::move(free_snapshots_.back());
+      free_snapshots_.pop_back();
+    }
 
-  void handle_get_version(sockaddr_in reply_addr, socklen_t reply_addr_len) {
-    reply_.clear();
+    snapshot->clear(frame_++);
 
-    // 1.7.2 tells clients that we don't support READ_CORE_MEMORY.
-    append(reply_, "1.7.2");
+    for (auto const & range : watches_) {
+      snapshot->add(range, [&](auto space, auto addr, auto bytes, auto fn) { read_core(space, addr, bytes, fn); });
+    }
 
-    send_reply(std::string_view(reply_.data(), reply_.size()), reply_addr);
-  }
+    watched_bytes_ = snapshot->bytes();
 
-  static void append(std::vector<char> & dest, std::string_view s) {
-    dest.insert(dest.end(), s.begin(), s.end());
+    netcmds::Event event;
+    event.type = netcmds::Event::Type::SNAPSHOT;
+    event.snapshot = std::move(snapshot);
+
+    if (!server_->push_event(std::move(event))) {
+      free_snapshots_.push_back(std::move(event.snapshot));
+    }
   }
 
-  void send_reply(std::string_view reply, sockaddr_in addr) {
-    sendto(sock_, reply.data(), reply.size(), 0, (sockaddr *)&addr, sizeof(addr));
+  // Calls fn(addr, ptr, n) for each mapped piece of [addr, addr + bytes)
+  template<typename F>
+  void read_core(netcmds::Space space, std::size_t addr, std::size_t bytes, F && fn) {
+    auto end = addr + bytes;
+
+    if (space == netcmds::Space::MEMORY) {
+      if (!have_memory_map()) {
+        return;
+      }
+
+      while (addr < end) {
+        auto t = memory_map_->translate(addr);
+        if (t.bytes == 0) {
+          break;
+        }
+
+        auto n = std::min(t.bytes, end - addr);
+        if (t.ptr) {
+          fn(addr, t.ptr, n);
+        }
+        addr += n;
+      }
+    } else {
+      // Hack: sram follows system ram (this probably only works for
+      // SNES)
+      auto size = core_->get_memory_size(RETRO_MEMORY_SYSTEM_RAM);
+      auto const * data = static_cast<uint8_t const *>(core_->get_memory_data(RETRO_MEMORY_SYSTEM_RAM));
+      auto sram_size = core_->get_memory_size(RETRO_MEMORY_SAVE_RAM);
+      auto const * sram_data = static_cast<uint8_t const *>(core_->get_memory_data(RETRO_MEMORY_SAVE_RAM));
+
+      auto piece = [&](std::size_t begin, std::size_t size, std::uint8_t const * p) {
+        auto b = std::max(addr, begin);
+        auto e = std::min(end, begin + size);
+        if (p && b < e) {
+          fn(b, p + (b - begin), e - b);
+        }
+      };
+
+      piece(0, size, data);
+      piece(size, sram_size, sram_data);
+    }
   }
 
 private:
-  Core const * core_;
+  Core const * core_ = nullptr;
+  MemoryMap const * memory_map_ = nullptr;
   int & port_;
-  int sock_ = -1;
-  std::vector<std::string_view> cmds_;
-  std::vector<std::string_view> args_;
-  std::vector<char> reply_;
+  int & tcp_port_;
+  std::string & unix_socket_;
+  double & watch_timeout_;
+  unsigned int & max_watched_bytes_;
+  double & subscription_timeout_;
+  unsigned int & max_output_;
+  std::string & system_id_;
+  std::string const & system_directory_;
+  std::string const & save_directory_;
+  std::string const & state_directory_;
+
+  std::string filename_;
+  std::uint32_t content_crc32_ = 0;
+  std::u32string keys_;
+
+  std::vector<netcmds::Range> watches_;
+  std::vector<std::unique_ptr<netcmds::Snapshot>> free_snapshots_;
+  std::uint64_t frame_ = 0;
+  std::uint64_t writes_ = 0;
+  std::size_t watched_bytes_ = 0;
+
+  std::optional<Probe::Key> commands_key_;
+  std::optional<Probe::Key> dropped_key_;
+  std::optional<Probe::Key> writes_key_;
+  std::optional<Probe::Key> watched_key_;
+
+  // Declared last, so the network thread is stopped first
+  std::unique_ptr<netcmds::Server> server_;
 };
 
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "fenestra/Plugin.hpp"
+#include "fenestra/PerflogShm.hpp"
 
 #include <sstream>
 #include <fstream>
@@ -53,6 +54,9 @@ private:
 
 private:
   std::string const & filename_;
+  std::string const & shm_filename_;
+  unsigned int const & shm_records_;
+  std::unique_ptr<PerflogShm> shm_;
   Probe::Dictionary probe_dict_;
   Probe last_;
   std::ofstream file_;
@@ -177,7 +181,13 @@ inline
 Perflog::
 Perflog(Config::Subtree const & config, std::string const & instance)
   : filename_(config.fetch<std::string>("filename", ""))
+  , shm_filename_(config.fetch<std::string>("shm", ""))
+  , shm_records_(config.fetch<unsigned int>("shm_records", 4096))
 {
+  if (shm_filename_ != "" && shm_records_ == 0) {
+    throw std::runtime_error("perflog.shm_records must be at least 1");
+  }
+
   if (filename_ != "") {
     open(filename_);
   }
@@ -219,7 +229,7 @@ inline
 void
 Perflog::
 record_probe(Probe const & probe, Probe::Dictionary const & dictionary) {
-  if (!file_open_) {
+  if (!file_open_ && shm_filename_ == "") {
     return;
   }
 
@@ -264,7 +274,13 @@ record_probe(Probe const & probe, Probe::Dictionary const & dictionary) {
     buf_.insert(buf_.end(), reinterpret_cast<char const *>(&total), reinterpret_cast<char const *>(&total) + sizeof(total));
   }
 
-  queue_->write(buf_.data(), buf_.data() + buf_.size());
+  if (shm_) {
+    shm_->write(buf_.data());
+  }
+
+  if (file_open_) {
+    queue_->write(buf_.data(), buf_.data() + buf_.size());
+  }
 
   for (auto & pc : perf_counters_) {
     pc.reset();
@@ -285,9 +301,16 @@ write_header() {
     buf_.insert(buf_.end(), name.c_str(), name.c_str() + name.length() + 1);
   }
 
+  if (shm_filename_ != "") {
+    auto record_size = sizeof(std::uint64_t) + perf_counters_.size() * sizeof(std::uint32_t);
+    shm_ = std::make_unique<PerflogShm>(shm_filename_, std::string_view(buf_.data(), buf_.size()), record_size, shm_records_);
+  }
+
   buf_.push_back('\n');
 
-  queue_->write(buf_.data(), buf_.data() + buf_.size());
+  if (file_open_) {
+    queue_->write(buf_.data(), buf_.data() + buf_.size());
+  }
 
   header_version_ = version_;
   header_written_ = true;
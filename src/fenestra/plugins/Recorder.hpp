@@ -0,0 +1,432 @@
+#pragma once
+
+#include "fenestra/Plugin.hpp"
+#include "fenestra/Recording.hpp"
+
+#include <zstd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace fenestra {
+
+// Writes a lossless recording of the game's video and audio (see
+// Recording.hpp; decode with tools/recording-decode).
+//
+// Frames are encoded on the capture thread, either as a keyframe or as
+// an XOR against the previous frame, then zstd-compressed.  Encoded
+// chunks are appended to large aligned blocks, which a separate writer
+// thread writes with O_DIRECT, so neither encoding nor disk stalls
+// reach the game thread.  If the writer falls behind, the capture
+// thread waits for a free block, and the capture pipeline drops frames
+// (shown as "Capture dropped: recorder"); the frame numbers in the
+// recording show where.
+class Recorder
+  : public Plugin
+{
+public:
+  Recorder(Config::Subtree const & config, std::string const & instance)
+    : filename_(config.fetch<std::string>("filename", ""))
+    , compression_level_(config.fetch<int>("compression_level", 1))
+    , threads_(config.fetch<int>("threads", 0))
+    , keyframe_interval_(config.fetch<unsigned int>("keyframe_interval", 600))
+    , block_size_mb_(config.fetch<unsigned int>("block_size", 8))
+    , num_blocks_(config.fetch<unsigned int>("blocks", 4))
+  {
+    if (filename_ != "") {
+      open(filename_);
+    }
+  }
+
+  ~Recorder() {
+    if (fd_ >= 0) {
+      close();
+    }
+  }
+
+  void open(std::string const & filename) {
+    cctx_ = ZSTD_createCCtx();
+    if (!cctx_) {
+      throw std::runtime_error("Failed to create zstd context");
+    }
+
+    ZSTD_CCtx_setParameter(cctx_, ZSTD_c_compressionLevel, compression_level_);
+
+    if (threads_ > 0) {
+      auto ret = ZSTD_CCtx_setParameter(cctx_, ZSTD_c_nbWorkers, threads_);
+      if (ZSTD_isError(ret)) {
+        std::cout << "zstd does not support threads; compressing frames on one thread" << std::endl;
+      }
+    }
+
+    fd_ = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    direct_ = fd_ >= 0;
+
+    // Some filesystems (e.g. tmpfs) don't support O_DIRECT
+    if (fd_ < 0 && errno == EINVAL) {
+      fd_ = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+
+    if (fd_ < 0) {
+      throw std::runtime_error("Could not open " + filename + ": " + std::strerror(errno));
+    }
+
+    block_size_ = std::size_t(std::max(block_size_mb_, 1u)) * 1024 * 1024;
+
+    for (unsigned int i = 0; i < std::max(num_blocks_, 2u); ++i) {
+      auto * p = static_cast<std::uint8_t *>(std::aligned_alloc(alignment, block_size_));
+      if (!p) {
+        throw std::bad_alloc();
+      }
+      blocks_.emplace_back(p);
+      free_.push_back(p);
+    }
+
+    block_ = take_block();
+
+    writer_ = std::thread([this] { write_blocks(); });
+  }
+
+  virtual void set_sample_rate(double sample_rate, double adjusted_rate) override {
+    // Keep the previous rates (or the nominal ones) rather than write an
+    // infinite or NaN fps into the header
+    if (!(sample_rate > 0) || !(adjusted_rate > 0)) {
+      std::cout << "Recorder: ignoring sample rate " << sample_rate << " (adjusted " << adjusted_rate << ")" << std::endl;
+      return;
+    }
+
+    sample_rate_ = sample_rate;
+    fps_ = 60.0 * sample_rate / adjusted_rate;
+  }
+
+  virtual void write_audio_sample(void const * data, std::size_t frames) override {
+    if (fd_ < 0) return;
+
+    // Only copy here; the capture thread writes the samples out
+    auto const * p = static_cast<std::uint8_t const *>(data);
+    std::unique_lock<std::mutex> lock(audio_mutex_);
+    if (audio_pending_.empty()) {
+      audio_pending_time_ = Clock::gettime(CLOCK_MONOTONIC);
+    }
+
+    // If video has stalled, nothing is writing the audio out; drop it
+    // rather than let it pile up
+    auto max_pending = std::size_t(max_audio_seconds * std::max(sample_rate_, 48000.0)) * Recording::bytes_per_audio_frame;
+    if (audio_pending_.size() + frames * Recording::bytes_per_audio_frame > max_pending) {
+      audio_dropped_ += frames;
+      return;
+    }
+
+    audio_pending_.insert(audio_pending_.end(), p, p + frames * Recording::bytes_per_audio_frame);
+  }
+
+  virtual bool wants_capture() const override { return fd_ >= 0; }
+
+  virtual void capture_frame(VideoFrame const & frame) override {
+    if (fd_ < 0) return;
+
+    auto start = Clock::gettime(CLOCK_MONOTONIC);
+
+    if (!header_written_) {
+      Recording::Header header = { };
+      std::memcpy(header.magic, Recording::magic, sizeof(header.magic));
+      header.sample_rate = sample_rate_;
+      header.fps = fps_;
+      write_chunk(Recording::HEAD, start, 0, &header, sizeof(header));
+      header_written_ = true;
+    }
+
+    write_audio();
+
+    if (frame.width() != format_.width || frame.height() != format_.height || frame.format() != format_.format) {
+      format_.width = frame.width();
+      format_.height = frame.height();
+      format_.format = frame.format();
+      write_chunk(Recording::VFMT, frame.time(), frame.number(), &format_, sizeof(format_));
+      last_.clear();
+    }
+
+    auto size = frame.row_size() * frame.height();
+    auto const * packed = frame.packed();
+
+    bool keyframe = last_.empty() || frame.number() - keyframe_number_ >= keyframe_interval_;
+    std::uint8_t const * src = packed;
+
+    if (!keyframe) {
+      delta_.assign(packed, packed + size);
+      Recording::xor_into(delta_.data(), last_.data(), size);
+      src = delta_.data();
+    } else {
+      keyframe_number_ = frame.number();
+    }
+
+    last_.assign(packed, packed + size);
+
+    compressed_.resize(ZSTD_compressBound(size));
+    auto n = ZSTD_compress2(cctx_, compressed_.data(), compressed_.size(), src, size);
+    if (ZSTD_isError(n)) {
+      throw std::runtime_error(std::string("ZSTD_compress2: ") + ZSTD_getErrorName(n));
+    }
+
+    write_chunk(keyframe ? Recording::VKEY : Recording::VDLT, frame.time(), frame.number(), compressed_.data(), n);
+
+    auto end = Clock::gettime(CLOCK_MONOTONIC);
+    encode_us_ = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+    raw_bytes_ += size;
+    encoded_bytes_ += n;
+  }
+
+  virtual void collect_metrics(Probe & probe, Probe::Dictionary & dictionary) override {
+    if (fd_ < 0) return;
+
+    if (!encode_key_) encode_key_ = dictionary.define("Recorder encode", 1000);
+    if (!ratio_key_) ratio_key_ = dictionary.define("Recorder ratio", 100);
+    if (!written_key_) written_key_ = dictionary["Recorder MB written"];
+    if (!stalls_key_) stalls_key_ = dictionary["Recorder stalls"];
+    if (!audio_dropped_key_) audio_dropped_key_ = dictionary["Recorder audio dropped"];
+
+    auto encoded = encoded_bytes_.load();
+    probe.meter(*encode_key_, Probe::VALUE, 0, encode_us_.load());
+    probe.meter(*ratio_key_, Probe::VALUE, 0, encoded ? raw_bytes_.load() * 100 / encoded : 0);
+    probe.meter(*written_key_, Probe::VALUE, 0, written_.load() / (1024 * 1024));
+    probe.meter(*stalls_key_, Probe::VALUE, 0, stalls_.load());
+    probe.meter(*audio_dropped_key_, Probe::VALUE, 0, audio_dropped_.load());
+  }
+
+private:
+  static constexpr inline std::size_t alignment = 4096;
+  static constexpr inline double max_audio_seconds = 4;
+
+  struct Free {
+    void operator()(std::uint8_t * p) const { std::free(p); }
+  };
+
+  struct Block {
+    std::uint8_t * data;
+    std::size_t used;
+  };
+
+  void write_audio() {
+    Timestamp time;
+
+    {
+      std::unique_lock<std::mutex> lock(audio_mutex_);
+      std::swap(audio_pending_, audio_);
+      time = audio_pending_time_;
+    }
+
+    if (!audio_.empty()) {
+      write_chunk(Recording::AUDI, time, audio_frames_, audio_.data(), audio_.size());
+      audio_frames_ += audio_.size() / Recording::bytes_per_audio_frame;
+      audio_.clear();
+    }
+  }
+
+  void write_chunk(std::uint32_t type, Timestamp time, std::uint64_t number, void const * data, std::size_t size) {
+    Recording::Chunk_Header header = { };
+    header.type = type;
+    header.size = size;
+    header.time_ns = nanoseconds_since_epoch(time).count();
+    header.number = number;
+
+    append(&header, sizeof(header));
+    append(data, size);
+  }
+
+  // Chunks may span blocks; blocks are only the unit of I/O
+  void append(void const * data, std::size_t size) {
+    auto const * p = static_cast<std::uint8_t const *>(data);
+
+    while (size > 0) {
+      auto n = std::min(size, block_size_ - block_.used);
+      std::memcpy(block_.data + block_.used, p, n);
+      block_.used += n;
+      p += n;
+      size -= n;
+
+      if (block_.used == block_size_) {
+        submit(block_);
+        block_ = take_block();
+      }
+    }
+  }
+
+  Block take_block() {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    if (free_.empty()) {
+      ++stalls_;
+      cond_.wait(lock, [&] { return !free_.empty(); });
+    }
+
+    auto * p = free_.back();
+    free_.pop_back();
+    return { p, 0 };
+  }
+
+  void submit(Block block) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      full_.push_back(block);
+    }
+    cond_.notify_all();
+  }
+
+  void write_blocks() {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    for (;;) {
+      cond_.wait(lock, [&] { return done_ || !full_.empty(); });
+
+      if (full_.empty() && done_) {
+        break;
+      }
+
+      auto block = full_.front();
+      full_.pop_front();
+
+      lock.unlock();
+      write_block(block);
+      lock.lock();
+
+      free_.push_back(block.data);
+      cond_.notify_all();
+    }
+  }
+
+  void write_block(Block const & block) {
+    if (failed_) return;
+
+    // O_DIRECT writes must be a multiple of the alignment; the padding
+    // is truncated away when the file is closed
+    auto size = (block.used + alignment - 1) / alignment * alignment;
+    std::memset(block.data + block.used, 0, size - block.used);
+
+    std::size_t pos = 0;
+    while (pos < size) {
+      auto n = ::pwrite(fd_, block.data + pos, size - pos, offset_ + pos);
+      if (n < 0 && errno == EINTR) continue;
+      if (n <= 0) {
+        std::cout << "Recording failed: " << std::strerror(errno) << std::endl;
+        failed_ = true;
+        return;
+      }
+
+      // The rest of a short write can only be retried if it still
+      // starts on an O_DIRECT boundary
+      if (direct_ && pos + n < size && n % alignment != 0) {
+        std::cout << "Recording failed: short write of " << n << " bytes" << std::endl;
+        failed_ = true;
+        return;
+      }
+
+      pos += n;
+    }
+
+    offset_ += block.used;
+    written_ += block.used;
+  }
+
+  void close() {
+    if (header_written_) {
+      write_audio();
+    }
+
+    if (block_.used > 0) {
+      submit(block_);
+    } else {
+      std::unique_lock<std::mutex> lock(mutex_);
+      free_.push_back(block_.data);
+    }
+
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      done_ = true;
+    }
+    cond_.notify_all();
+    writer_.join();
+
+    if (::ftruncate(fd_, offset_) < 0 || ::fsync(fd_) < 0) {
+      std::cout << "Failed to finish recording: " << std::strerror(errno) << std::endl;
+    }
+
+    ::close(fd_);
+    fd_ = -1;
+
+    ZSTD_freeCCtx(cctx_);
+  }
+
+private:
+  std::string const & filename_;
+  int const & compression_level_;
+  int const & threads_;
+  unsigned int const & keyframe_interval_;
+  unsigned int const & block_size_mb_;
+  unsigned int const & num_blocks_;
+
+  int fd_ = -1;
+  bool direct_ = false;
+  ZSTD_CCtx * cctx_ = nullptr;
+
+  double sample_rate_ = 0;
+  double fps_ = 60;
+  bool header_written_ = false;
+
+  // Capture thread
+  Recording::Video_Format format_ = { };
+  std::vector<std::uint8_t> last_;
+  std::vector<std::uint8_t> delta_;
+  std::vector<std::uint8_t> compressed_;
+  std::uint64_t keyframe_number_ = 0;
+  std::vector<std::uint8_t> audio_;
+  std::uint64_t audio_frames_ = 0;
+  Block block_ = { nullptr, 0 };
+
+  // Shared with the game thread
+  std::mutex audio_mutex_;
+  std::vector<std::uint8_t> audio_pending_;
+  Timestamp audio_pending_time_;
+
+  // Shared with the writer thread
+  std::size_t block_size_ = 0;
+  std::vector<std::unique_ptr<std::uint8_t, Free>> blocks_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::vector<std::uint8_t *> free_;
+  std::deque<Block> full_;
+  bool done_ = false;
+  std::thread writer_;
+
+  // Writer thread
+  off_t offset_ = 0;
+  bool failed_ = false;
+
+  std::atomic<std::uint64_t> encode_us_ = 0;
+  std::atomic<std::uint64_t> raw_bytes_ = 0;
+  std::atomic<std::uint64_t> encoded_bytes_ = 0;
+  std::atomic<std::uint64_t> written_ = 0;
+  std::atomic<std::uint64_t> stalls_ = 0;
+  std::atomic<std::uint64_t> audio_dropped_ = 0;
+  std::optional<Probe::Key> encode_key_;
+  std::optional<Probe::Key> ratio_key_;
+  std::optional<Probe::Key> written_key_;
+  std::optional<Probe::Key> stalls_key_;
+  std::optional<Probe::Key> audio_dropped_key_;
+};
+
+}
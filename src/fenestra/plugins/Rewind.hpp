@@ -0,0 +1,477 @@
+#pragma once
+
+#include "fenestra/Plugin.hpp"
+#include "fenestra/Clock.hpp"
+
+#include <zstd.h>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <deque>
+#include <vector>
+#include <optional>
+#include <stdexcept>
+#include <cstring>
+#include <iostream>
+
+namespace fenestra {
+
+// Rewind keeps a bounded history of save states in memory.  Each state
+// is serialized into a preallocated buffer on the game thread, then
+// handed to a worker thread which XORs it against the previous state
+// and compresses the delta into a ring buffer.  Stepping backwards only
+// requires decompressing the newest delta and XORing it into the
+// current state, so it is cheap enough to do every frame.
+class Rewind
+  : public Plugin
+{
+private:
+  // A ring of variable-sized compressed entries in a single preallocated
+  // block of memory.  New entries are written at the head; the oldest
+  // entries are evicted when the head runs into them.
+  class Ring {
+  public:
+    struct Entry {
+      char const * data;
+      std::size_t size;
+    };
+
+    Ring(std::size_t capacity)
+      : capacity_(capacity)
+      , buf_(new char[capacity])
+    {
+    }
+
+    void clear() {
+      entries_.clear();
+      head_ = 0;
+      used_ = 0;
+    }
+
+    std::size_t size() const { return entries_.size(); }
+    std::size_t used() const { return used_; }
+
+    // Reserve space for an entry of at most n bytes at the head
+    char * reserve(std::size_t n) {
+      if (n > capacity_) {
+        return nullptr;
+      }
+
+      if (head_ + n > capacity_) {
+        // Wrap around; anything left past the old head is from the
+        // previous lap, so it is the oldest and must go first
+        while (!entries_.empty() && entries_.front().offset >= head_) {
+          evict();
+        }
+        head_ = 0;
+      }
+
+      while (!entries_.empty() && overlaps(entries_.front(), head_, n)) {
+        evict();
+      }
+
+      return buf_.get() + head_;
+    }
+
+    // Add the entry most recently reserved, now that its size is known
+    void commit(std::size_t n) {
+      entries_.push_back({ head_, n });
+      head_ += n;
+      used_ += n;
+    }
+
+    std::optional<Entry> back() const {
+      if (entries_.empty()) {
+        return std::nullopt;
+      }
+
+      auto const & e = entries_.back();
+      return Entry { buf_.get() + e.offset, e.size };
+    }
+
+    void pop_back() {
+      auto const & e = entries_.back();
+      head_ = e.offset;
+      used_ -= e.size;
+      entries_.pop_back();
+    }
+
+  private:
+    struct Slot {
+      std::size_t offset;
+      std::size_t size;
+    };
+
+    static bool overlaps(Slot const & slot, std::size_t offset, std::size_t n) {
+      return slot.offset < offset + n && offset < slot.offset + slot.size;
+    }
+
+    void evict() {
+      used_ -= entries_.front().size;
+      entries_.pop_front();
+    }
+
+  private:
+    std::size_t capacity_;
+    std::unique_ptr<char[]> buf_;
+    std::deque<Slot> entries_;
+    std::size_t head_ = 0;
+    std::size_t used_ = 0;
+  };
+
+public:
+  Rewind(Config::Subtree const & config, std::string const & instance)
+    : interval_(config.fetch<unsigned int>("interval", 1))
+    , memory_budget_(config.fetch<unsigned int>("memory_budget", 256))
+    , compression_level_(config.fetch<int>("compression_level", 1))
+    , ring_(std::make_unique<Ring>(std::size_t(memory_budget_) * 1024 * 1024))
+  {
+  }
+
+  virtual ~Rewind() override {
+    stop();
+  }
+
+  virtual void game_loaded(Core const & core, std::string const & filename) override {
+    core_ = &core;
+    start();
+  }
+
+  virtual void unloading_game(Core const & core) override {
+    stop();
+    core_ = nullptr;
+  }
+
+  virtual void handle_key_events(std::vector<KeyEvent> const & key_events, State & state) override {
+    for (auto const & event : key_events) {
+      if (event.key == key::LEFT) {
+        if (event.action == KeyAction::PRESS) {
+          rewinding_ = true;
+        } else if (event.action == KeyAction::RELEASE) {
+          rewinding_ = false;
+        }
+      }
+    }
+  }
+
+  virtual void pre_frame_delay(State const & state) override {
+    if (!core_ || state.paused) {
+      return;
+    }
+
+    if (rewinding_) {
+      step_back();
+      frames_ = 0;
+    } else if (++frames_ >= interval_) {
+      capture();
+      frames_ = 0;
+    }
+  }
+
+  virtual void collect_metrics(Probe & probe, Probe::Dictionary & dictionary) override {
+    if (!memory_key_) { memory_key_ = dictionary.define("Rewind memory", 1000); }
+    if (!states_key_) { states_key_ = dictionary["Rewind states"]; }
+    if (!throughput_key_) { throughput_key_ = dictionary["Rewind throughput"]; }
+    if (!skipped_key_) { skipped_key_ = dictionary["Rewind skipped"]; }
+
+    // Throughput is in MB/s, averaged over every state compressed since
+    // the last report
+    auto bytes = compressed_bytes_.exchange(0);
+    auto nanos = compress_nanos_.exchange(0);
+    if (nanos > 0) {
+      throughput_ = bytes * 1000 / nanos;
+    }
+
+    probe.meter(*memory_key_, Probe::VALUE, 0, ring_used_.load() / 1024);
+    probe.meter(*states_key_, Probe::VALUE, 0, ring_states_.load());
+    probe.meter(*throughput_key_, Probe::VALUE, 0, throughput_);
+    probe.meter(*skipped_key_, Probe::VALUE, 0, skipped_);
+
+    skipped_ = 0;
+  }
+
+private:
+  static constexpr inline std::size_t num_buffers = 3;
+
+  void start() {
+    if (th_.joinable()) {
+      return;
+    }
+
+    cctx_ = ZSTD_createCCtx();
+    dctx_ = ZSTD_createDCtx();
+
+    if (!cctx_ || !dctx_) {
+      throw std::runtime_error("Failed to create zstd context");
+    }
+
+    done_ = false;
+    th_ = std::thread([this] { run(); });
+  }
+
+  void stop() {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      done_ = true;
+    }
+
+    cond_.notify_all();
+
+    if (th_.joinable()) {
+      th_.join();
+    }
+
+    if (cctx_) { ZSTD_freeCCtx(cctx_); cctx_ = nullptr; }
+    if (dctx_) { ZSTD_freeDCtx(dctx_); dctx_ = nullptr; }
+  }
+
+  // Wait for the worker to finish any outstanding states.  Must be
+  // called on the game thread, which is the only producer.
+  void wait_idle(std::unique_lock<std::mutex> & lock) {
+    idle_cond_.wait(lock, [&] { return pending_.empty() && !busy_; });
+  }
+
+  void reset(std::size_t state_size) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    wait_idle(lock);
+
+    state_size_ = state_size;
+
+    buffers_.clear();
+    buffers_.resize(num_buffers);
+    free_.clear();
+    for (std::size_t i = 0; i < num_buffers; ++i) {
+      buffers_[i].resize(state_size);
+      free_.push_back(i);
+    }
+
+    current_.clear();
+    current_.resize(state_size);
+    have_current_ = false;
+
+    ring_->clear();
+    ring_used_ = 0;
+    ring_states_ = 0;
+  }
+
+  void capture() {
+    auto size = core_->serialize_size();
+
+    if (size == 0) {
+      return;
+    }
+
+    if (size != state_size_) {
+      reset(size);
+    }
+
+    std::size_t idx;
+
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (free_.empty()) {
+        // The worker is falling behind; skip this state rather than
+        // stalling the game thread
+        ++skipped_;
+        return;
+      }
+      idx = free_.back();
+      free_.pop_back();
+    }
+
+    auto & buf = buffers_[idx];
+    if (!core_->serialize(buf.data(), buf.size())) {
+      std::unique_lock<std::mutex> lock(mutex_);
+      free_.push_back(idx);
+      std::cout << "ERROR: Core failed to serialize; skipping rewind state" << std::endl;
+      return;
+    }
+
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      pending_.push_back(idx);
+    }
+
+    cond_.notify_one();
+  }
+
+  void step_back() {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    // States the worker hasn't started on are newer than any we could go
+    // back to, so they are dropped rather than waited for; a state it is
+    // still compressing is waited for by trying again next frame
+    for (auto idx : pending_) {
+      free_.push_back(idx);
+    }
+    pending_.clear();
+
+    if (busy_ || !have_current_) {
+      return;
+    }
+
+    // The worker is idle and we are the only producer, so it is safe to
+    // touch the ring and the current state from here on.
+    auto entry = ring_->back();
+    if (entry) {
+      delta_.resize(state_size_);
+      auto n = ZSTD_decompressDCtx(dctx_, delta_.data(), delta_.size(), entry->data, entry->size);
+      if (ZSTD_isError(n) || n != state_size_) {
+        // Every older delta leads back from this one, so none of them
+        // are any use now
+        std::cout << "ERROR: Failed to decompress rewind state; discarding rewind history" << std::endl;
+        drop_history();
+        return;
+      }
+      xor_into(current_.data(), delta_.data(), state_size_);
+      ring_->pop_back();
+      ring_used_ = ring_->used();
+      ring_states_ = ring_->size();
+    }
+
+    if (!core_->unserialize(current_.data(), current_.size())) {
+      std::cout << "ERROR: Core failed to unserialize rewind state" << std::endl;
+    }
+  }
+
+  void drop_history() {
+    ring_->clear();
+    ring_used_ = 0;
+    ring_states_ = 0;
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    for (;;) {
+      cond_.wait(lock, [&] { return done_ || !pending_.empty(); });
+
+      if (done_) {
+        break;
+      }
+
+      auto idx = pending_.front();
+      pending_.pop_front();
+      busy_ = true;
+
+      lock.unlock();
+      compress(buffers_[idx]);
+      lock.lock();
+
+      free_.push_back(idx);
+      busy_ = false;
+      idle_cond_.notify_all();
+    }
+  }
+
+  void compress(std::vector<char> & buf) {
+    if (!have_current_) {
+      std::copy(buf.begin(), buf.end(), current_.begin());
+      have_current_ = true;
+      return;
+    }
+
+    auto start = Clock::gettime(CLOCK_MONOTONIC);
+
+    // Turn buf into the delta from the new state back to the previous
+    // one; the new state only becomes current after that
+    xor_into(buf.data(), current_.data(), buf.size());
+
+    auto bound = ZSTD_compressBound(buf.size());
+    auto * dest = ring_->reserve(bound);
+    std::size_t csize = 0;
+
+    if (!dest) {
+      if (!warned_budget_) {
+        std::cout << "Rewind state does not fit in memory budget" << std::endl;
+        warned_budget_ = true;
+      }
+    } else {
+      csize = ZSTD_compressCCtx(cctx_, dest, bound, buf.data(), buf.size(), compression_level_);
+      if (ZSTD_isError(csize)) {
+        std::cout << "Rewind compression failed: " << ZSTD_getErrorName(csize) << std::endl;
+        dest = nullptr;
+      }
+    }
+
+    xor_into(current_.data(), buf.data(), buf.size());
+
+    if (!dest) {
+      // Without this delta, the older ones would be applied to the wrong
+      // state
+      drop_history();
+      return;
+    }
+
+    ring_->commit(csize);
+    ring_used_ = ring_->used();
+    ring_states_ = ring_->size();
+
+    auto stop = Clock::gettime(CLOCK_MONOTONIC);
+    compressed_bytes_ += buf.size();
+    compress_nanos_ += (stop - start).count();
+  }
+
+  static void xor_into(char * dest, char const * src, std::size_t size) {
+    std::size_t i = 0;
+    for (; i + sizeof(std::uint64_t) <= size; i += sizeof(std::uint64_t)) {
+      std::uint64_t d, s;
+      std::memcpy(&d, dest + i, sizeof(d));
+      std::memcpy(&s, src + i, sizeof(s));
+      d ^= s;
+      std::memcpy(dest + i, &d, sizeof(d));
+    }
+    for (; i < size; ++i) {
+      dest[i] ^= src[i];
+    }
+  }
+
+private:
+  unsigned int const & interval_;
+  unsigned int const & memory_budget_;
+  int const & compression_level_;
+
+  Core const * core_ = nullptr;
+
+  bool rewinding_ = false;
+  unsigned int frames_ = 0;
+
+  std::size_t state_size_ = 0;
+  std::vector<std::vector<char>> buffers_;
+  std::vector<std::size_t> free_;
+  std::deque<std::size_t> pending_;
+  std::vector<char> current_;
+  std::vector<char> delta_;
+  bool have_current_ = false;
+  bool warned_budget_ = false;
+
+  std::unique_ptr<Ring> ring_;
+  ZSTD_CCtx * cctx_ = nullptr;
+  ZSTD_DCtx * dctx_ = nullptr;
+
+  std::thread th_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::condition_variable idle_cond_;
+  bool done_ = false;
+  bool busy_ = false;
+
+  std::atomic<std::size_t> ring_used_ = 0;
+  std::atomic<std::size_t> ring_states_ = 0;
+  std::atomic<std::uint64_t> compressed_bytes_ = 0;
+  std::atomic<std::uint64_t> compress_nanos_ = 0;
+  Probe::Value throughput_ = 0;
+  // States not captured because the worker was behind (unlike capture
+  // sinks, which count frames they evicted)
+  Probe::Value skipped_ = 0;
+
+  std::optional<Probe::Key> memory_key_;
+  std::optional<Probe::Key> states_key_;
+  std::optional<Probe::Key> throughput_key_;
+  std::optional<Probe::Key> skipped_key_;
+};
+
+}
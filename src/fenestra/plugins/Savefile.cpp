@@ -2,6 +2,40 @@
 
 #include <filesystem>
 
+namespace {
+
+// A journal holds one flush: a header, then an (offset, length, data)
+// record for each changed range, then a checksum of everything before
+// it.  A journal with a bad checksum was never completely written, in
+// which case the save file itself was not touched yet.
+constexpr char journal_magic[8] = { 'F', 'S', 'R', 'M', 'J', 'N', 'L', '1' };
+
+std::uint64_t fnv1a(std::uint8_t const * data, std::size_t size, std::uint64_t hash = 14695981039346656037ull) {
+  for (std::size_t i = 0; i < size; ++i) {
+    hash ^= data[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+template <typename T>
+void append(std::vector<std::uint8_t> & buf, T const & value) {
+  auto const * p = reinterpret_cast<std::uint8_t const *>(&value);
+  buf.insert(buf.end(), p, p + sizeof(value));
+}
+
+template <typename T>
+bool extract(std::vector<std::uint8_t> const & buf, std::size_t & pos, T & value) {
+  if (buf.size() - pos < sizeof(value)) {
+    return false;
+  }
+  std::memcpy(&value, buf.data() + pos, sizeof(value));
+  pos += sizeof(value);
+  return true;
+}
+
+}
+
 void
 fenestra::Savefile::open_or_create(Core const & core, std::string const & filename) {
   std::filesystem::create_directories(save_directory_);
@@ -13,7 +47,87 @@ fenestra::Savefile::open_or_create(Core const & core, std::string const & filena
                        std::filesystem::path(filename).filename();
   save_filename.replace_extension(".srm");
 
+  journal_filename_ = save_filename.native() + ".journal";
+
   this->open(save_filename.native(), saveram_->size());
 
   std::cout << "Using savefile " << save_filename.native() << std::endl;
 }
+
+void
+fenestra::Savefile::replay_journal() {
+  if ((journal_fd_ = ::open(journal_filename_.c_str(), O_CREAT|O_RDWR, 0664)) < 0) {
+    throw std::runtime_error("open failed for " + journal_filename_);
+  }
+
+  auto size = ::lseek(journal_fd_, 0, SEEK_END);
+  if (size <= 0) {
+    return;
+  }
+
+  std::vector<std::uint8_t> buf(size);
+  if (::pread(journal_fd_, buf.data(), buf.size(), 0) != size) {
+    throw std::runtime_error("read failed for " + journal_filename_);
+  }
+
+  std::size_t pos = sizeof(journal_magic);
+  std::uint64_t checksum;
+
+  bool valid = buf.size() >= sizeof(journal_magic) + sizeof(checksum) &&
+               std::memcmp(buf.data(), journal_magic, sizeof(journal_magic)) == 0;
+
+  if (valid) {
+    std::size_t end = buf.size() - sizeof(checksum);
+    std::memcpy(&checksum, buf.data() + end, sizeof(checksum));
+    valid = fnv1a(buf.data(), end) == checksum;
+    buf.resize(end);
+  }
+
+  if (!valid) {
+    std::cout << "Discarding incomplete SRAM journal " << journal_filename_ << std::endl;
+  } else {
+    std::uint64_t offset, length;
+    while (extract(buf, pos, offset) && extract(buf, pos, length)) {
+      if (length > buf.size() - pos || offset + length > size_) {
+        throw std::runtime_error("Corrupt SRAM journal " + journal_filename_);
+      }
+      if (::pwrite(fd_, buf.data() + pos, length, offset) != ssize_t(length)) {
+        throw std::runtime_error("write failed while replaying " + journal_filename_);
+      }
+      pos += length;
+    }
+
+    if (::fsync(fd_) != 0) {
+      throw std::runtime_error("fsync failed while replaying " + journal_filename_);
+    }
+
+    std::cout << "Replayed SRAM journal " << journal_filename_ << std::endl;
+  }
+
+  if (::ftruncate(journal_fd_, 0) != 0 || ::fsync(journal_fd_) != 0) {
+    throw std::runtime_error("truncating " + journal_filename_ + " failed");
+  }
+}
+
+void
+fenestra::Savefile::write_journal(std::vector<std::pair<std::size_t, std::size_t>> const & ranges, std::vector<std::uint8_t> const & staging) {
+  std::vector<std::uint8_t> buf(journal_magic, journal_magic + sizeof(journal_magic));
+
+  auto const * src = staging.data();
+  for (auto [ offset, n ] : ranges) {
+    append(buf, std::uint64_t(offset));
+    append(buf, std::uint64_t(n));
+    buf.insert(buf.end(), src, src + n);
+    src += n;
+  }
+
+  append(buf, fnv1a(buf.data(), buf.size()));
+
+  if (::pwrite(journal_fd_, buf.data(), buf.size(), 0) != ssize_t(buf.size())) {
+    throw std::runtime_error("write failed for " + journal_filename_);
+  }
+
+  if (::fdatasync(journal_fd_) != 0) {
+    throw std::runtime_error("fdatasync failed for " + journal_filename_);
+  }
+}
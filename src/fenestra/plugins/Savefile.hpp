@@ -2,10 +2,17 @@
 
 #include "fenestra/Plugin.hpp"
 #include "fenestra/Saveram.hpp"
+#include "fenestra/Clock.hpp"
 
 #include <string>
 #include <algorithm>
 #include <string_view>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <optional>
+#include <cstring>
 
 #include <fcntl.h>
 #include <unistd.h>
@@ -16,24 +23,29 @@
 
 namespace fenestra {
 
+// Keeps the save file in sync with the core's save RAM.
+//
+// The game thread only compares save RAM against a shadow copy and
+// records which blocks changed.  Changed blocks are written to the file
+// by a background thread, at most once every flush_delay.  With
+// journaling enabled, each flush is first written to a journal, so a
+// crash in the middle of a flush never leaves a mix of old and new
+// blocks in the save file; an incomplete flush is replayed from the
+// journal the next time the game is loaded.
 class Savefile
   : public Plugin
 {
 public:
   Savefile(Config::Subtree const & config, std::string const & instance)
     : save_directory_(config.root().fetch<std::string>("paths.save_directory", "."))
+    , flush_delay_(config.fetch<Milliseconds>("flush_delay", Milliseconds(500)))
+    , journal_(config.fetch<bool>("journal", true))
   {
   }
 
   virtual ~Savefile() override {
-    if (p_) {
-      ::msync(p_, size_, MS_SYNC);
-      ::munmap(p_, size_);
-    }
-
-    if (fd_ >= 0) {
-      ::close(fd_);
-    }
+    stop();
+    close();
   }
 
   std::uint8_t * data() { return static_cast<std::uint8_t *>(p_); }
@@ -45,19 +57,38 @@ public:
   virtual void game_loaded(Core const & core, std::string const & filename) override {
     open_or_create(core, filename);
     load();
+    start();
   }
 
   virtual void unloading_game(Core const & core) override {
-    sync(saveram_->data(), saveram_->size());
+    if (saveram_) {
+      sync_if_changed(saveram_->data(), saveram_->size());
+    }
+
+    stop();
+    close();
   }
 
   virtual void pre_frame_delay(State const & state) override {
-    sync_if_changed(saveram_->data(), saveram_->size());
+    if (saveram_) {
+      changed_blocks_ = sync_if_changed(saveram_->data(), saveram_->size());
+    }
+  }
+
+  virtual void collect_metrics(Probe & probe, Probe::Dictionary & dictionary) override {
+    if (!changed_blocks_key_) changed_blocks_key_ = dictionary["SRAM changed blocks"];
+    probe.meter(*changed_blocks_key_, Probe::VALUE, 0, changed_blocks_);
   }
 
 private:
+  static constexpr inline std::size_t block_size = 64;
+
   void open_or_create(Core const & core, std::string const & filename);
 
+  void replay_journal();
+
+  void write_journal(std::vector<std::pair<std::size_t, std::size_t>> const & ranges, std::vector<std::uint8_t> const & staging);
+
   void open(std::string const & filename, std::size_t size) {
     if (size == 0) {
       return;
@@ -71,43 +102,226 @@ private:
       throw std::runtime_error("ftruncate failed");
     }
 
+    size_ = size;
+
+    if (journal_) {
+      replay_journal();
+    }
+
     if ((p_ = ::mmap(nullptr, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_NORESERVE|MAP_POPULATE, fd_, 0)) == MAP_FAILED) {
+      p_ = nullptr;
       throw std::runtime_error("mmap failed");
     }
-
-    size_ = size;
   }
 
-  void sync_if_changed(std::uint8_t const * data, std::size_t size) {
-    last_sync_bytes_.reserve(size);
-    if (!std::equal(data, data + size, last_sync_bytes_.begin())) {
-      sync(data, size);
+  void close() {
+    if (p_) {
+      ::msync(p_, size_, MS_SYNC);
+      ::munmap(p_, size_);
+      p_ = nullptr;
+    }
+
+    if (fd_ >= 0) {
+      ::close(fd_);
+      fd_ = -1;
+    }
+
+    if (journal_fd_ >= 0) {
+      ::close(journal_fd_);
+      journal_fd_ = -1;
     }
+
+    size_ = 0;
+    saveram_.reset();
   }
 
-  void sync(std::uint8_t const * data, std::size_t size) {
-    std::cout << "Sync SRAM" << std::endl;
-    std::copy(data, data + std::min(size, this->size()), this->data());
+  // Returns the number of blocks that changed since the last call
+  std::size_t sync_if_changed(std::uint8_t const * data, std::size_t size) {
+    size = std::min(size, shadow_.size());
+
+    // Most frames do not touch save RAM at all, so check the whole
+    // thing with a single (vectorized) memcmp before looking at blocks
+    if (std::memcmp(data, shadow_.data(), size) == 0) {
+      return 0;
+    }
+
+    std::size_t changed = 0;
+
+    std::unique_lock<std::mutex> lock(mutex_);
 
-    last_sync_bytes_.reserve(size);
-    std::copy(data, data + size, last_sync_bytes_.begin());
+    for (std::size_t offset = 0; offset < size; offset += block_size) {
+      auto n = std::min(block_size, size - offset);
+      if (std::memcmp(data + offset, shadow_.data() + offset, n) != 0) {
+        std::memcpy(shadow_.data() + offset, data + offset, n);
+        dirty_[offset / block_size] = true;
+        ++changed;
+      }
+    }
+
+    if (!dirty_since_) {
+      dirty_since_ = Clock::gettime(CLOCK_MONOTONIC);
+      cond_.notify_one();
+    }
+
+    return changed;
   }
 
   void load() {
     std::copy(begin(), end(), saveram_->begin());
 
-    last_sync_bytes_.reserve(size_);
-    std::copy(begin(), end(), last_sync_bytes_.begin());
+    shadow_.assign(begin(), end());
+    dirty_.assign((size_ + block_size - 1) / block_size, false);
+  }
+
+  void start() {
+    if (size_ > 0) {
+      done_ = false;
+      th_ = std::thread([this] { run(); });
+    }
+  }
+
+  // Flushes any outstanding changes and stops the writer thread
+  void stop() {
+    if (!th_.joinable()) {
+      return;
+    }
+
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      done_ = true;
+    }
+
+    cond_.notify_one();
+    th_.join();
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+
+    while (!done_) {
+      if (!dirty_since_) {
+        cond_.wait(lock);
+        continue;
+      }
+
+      // Coalesce changes made within flush_delay of the first one into
+      // a single write
+      auto flush_time = *dirty_since_ + flush_delay_;
+      auto now = Clock::gettime(CLOCK_MONOTONIC);
+      if (now < flush_time) {
+        cond_.wait_for(lock, flush_time - now);
+        continue;
+      }
+
+      flush(lock);
+    }
+
+    if (dirty_since_) {
+      flush(lock);
+    }
+  }
+
+  // Called with mutex_ held; releases it while doing I/O
+  void flush(std::unique_lock<std::mutex> & lock) {
+    std::vector<std::pair<std::size_t, std::size_t>> ranges;
+    std::vector<std::uint8_t> staging;
+
+    // Copy the dirty blocks out of the shadow buffer, merging adjacent
+    // blocks into a single range
+    for (std::size_t block = 0; block < dirty_.size(); ++block) {
+      if (!dirty_[block]) continue;
+      dirty_[block] = false;
+
+      auto offset = block * block_size;
+      auto n = std::min(block_size, size_ - offset);
+
+      if (!ranges.empty() && ranges.back().first + ranges.back().second == offset) {
+        ranges.back().second += n;
+      } else {
+        ranges.emplace_back(offset, n);
+      }
+
+      staging.insert(staging.end(), shadow_.begin() + offset, shadow_.begin() + offset + n);
+    }
+
+    dirty_since_.reset();
+
+    lock.unlock();
+
+    try {
+      if (journal_) {
+        write_journal(ranges, staging);
+      }
+
+      auto page_size = std::size_t(::sysconf(_SC_PAGESIZE));
+      auto const * src = staging.data();
+
+      for (auto [ offset, n ] : ranges) {
+        std::memcpy(data() + offset, src, n);
+        src += n;
+      }
+
+      // One msync over the span of all ranges.  The journal can only be
+      // discarded once the blocks are on disk; without it, let the
+      // kernel write them back when it can
+      if (!ranges.empty()) {
+        auto begin = ranges.front().first - ranges.front().first % page_size;
+        auto end = ranges.back().first + ranges.back().second;
+        if (::msync(data() + begin, end - begin, journal_ ? MS_SYNC : MS_ASYNC) != 0) {
+          throw std::runtime_error("msync failed");
+        }
+      }
+
+      if (journal_) {
+        if (::ftruncate(journal_fd_, 0) != 0 || ::fsync(journal_fd_) != 0) {
+          throw std::runtime_error("truncating " + journal_filename_ + " failed");
+        }
+      }
+
+      std::cout << "Sync SRAM (" << staging.size() << " bytes)" << std::endl;
+    } catch(std::exception const & ex) {
+      std::cout << "Failed to sync SRAM: " << ex.what() << std::endl;
+
+      // Try again on the next flush
+      lock.lock();
+      for (auto [ offset, n ] : ranges) {
+        for (auto block = offset / block_size; block * block_size < offset + n; ++block) {
+          dirty_[block] = true;
+        }
+      }
+      if (!dirty_since_) {
+        dirty_since_ = Clock::gettime(CLOCK_MONOTONIC);
+      }
+      return;
+    }
+
+    lock.lock();
   }
 
 private:
   std::string const & save_directory_;
+  Milliseconds const & flush_delay_;
+  bool const & journal_;
 
   std::unique_ptr<Saveram> saveram_;
   std::size_t size_ = 0;
   int fd_ = -1;
   void * p_ = nullptr;
-  std::vector<std::uint8_t> last_sync_bytes_;
+
+  std::string journal_filename_;
+  int journal_fd_ = -1;
+
+  std::vector<std::uint8_t> shadow_;
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::vector<bool> dirty_;
+  std::optional<Timestamp> dirty_since_;
+  bool done_ = false;
+  std::thread th_;
+
+  std::size_t changed_blocks_ = 0;
+  std::optional<Probe::Key> changed_blocks_key_;
 };
 
 }
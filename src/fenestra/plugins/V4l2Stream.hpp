@@ -1,10 +1,12 @@
 #pragma once
 
 #include "fenestra/Plugin.hpp"
+#include "fenestra/PixelConvert.hpp"
 
 #include <unistd.h>
 #include <sys/fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <linux/videodev2.h>
 
 #include <stdexcept>
@@ -13,11 +15,17 @@
 #include <cstdint>
 #include <vector>
 #include <algorithm>
+#include <atomic>
+#include <optional>
 #include <cerrno>
 #include <cstring>
 
 namespace fenestra {
 
+// Streams frames to a v4l2 output device (e.g. v4l2loopback) using
+// mmap'd streaming buffers.  All device access happens on the capture
+// thread; the device is (re)configured whenever the frame size or
+// pixel format changes.
 class V4l2Stream
   : public Plugin
 {
@@ -25,14 +33,20 @@ public:
   struct Pixel_Format {
     std::uint32_t v4l2_pix_fmt;
     int bpp;
+    bool convert;
   };
 
+  // Formats v4l2 consumers are unlikely to understand are converted to
+  // 32-bit BGRA
   static inline std::map<unsigned int, Pixel_Format> const pixel_formats = {
-    { RETRO_PIXEL_FORMAT_RGB565,   { V4L2_PIX_FMT_RGB565, 16 } },
+    { RETRO_PIXEL_FORMAT_RGB565,   { V4L2_PIX_FMT_RGB565, 16, false } },
+    { RETRO_PIXEL_FORMAT_0RGB1555, { V4L2_PIX_FMT_ABGR32, 32, true } },
+    { RETRO_PIXEL_FORMAT_XRGB8888, { V4L2_PIX_FMT_ABGR32, 32, true } },
   };
 
   V4l2Stream(Config::Subtree const & config, std::string const & instance)
     : device_(config.fetch<std::string>("device", ""))
+    , num_buffers_(config.fetch<unsigned int>("buffers", 4))
   {
     if (device_ != "") {
       open(device_);
@@ -49,62 +63,232 @@ public:
       throw std::runtime_error("ioctl failed (VIDIOC_QUERYCAP)");
     }
 
-    if (!(cap_.capabilities & V4L2_CAP_STREAMING)) {
+    auto caps = (cap_.capabilities & V4L2_CAP_DEVICE_CAPS) ? cap_.device_caps : cap_.capabilities;
+
+    if (!(caps & V4L2_CAP_STREAMING)) {
       throw std::runtime_error("v4l2 device does not allow streaming");
     }
 
-    if (!(cap_.capabilities & V4L2_CAP_STREAMING)) {
-      throw std::runtime_error("v4l2 device is not writable");
+    if (!(caps & V4L2_CAP_VIDEO_OUTPUT)) {
+      throw std::runtime_error("v4l2 device is not an output device");
     }
+
+    active_ = true;
   }
 
   virtual ~V4l2Stream() override {
     if (fd_ >= 0) {
+      release_buffers();
       ::close(fd_);
     }
   }
 
-  virtual void set_pixel_format(retro_pixel_format format) override {
-    pixel_format_ = pixel_formats.at(format);
+  virtual void collect_metrics(Probe & probe, Probe::Dictionary & dictionary) override {
+    if (!active_.load()) return;
+
+    if (!queued_key_) queued_key_ = dictionary["V4L2 queued"];
+    if (!dropped_key_) dropped_key_ = dictionary["V4L2 dropped"];
+
+    probe.meter(*queued_key_, Probe::VALUE, 0, queued_.load());
+    probe.meter(*dropped_key_, Probe::VALUE, 0, dropped_.load());
   }
 
-  virtual void set_geometry(Geometry const & geom) override {
+  virtual bool wants_capture() const override { return active_.load(); }
+
+  virtual void capture_frame(VideoFrame const & frame) override {
     if (fd_ < 0) {
       return;
     }
 
+    if (frame.width() != width_ || frame.height() != height_ || frame.format() != retro_format_) {
+      try {
+        configure(frame.width(), frame.height(), frame.format());
+      } catch(...) {
+        // Don't retry (and fail) on every frame
+        std::cout << "Disabling v4l2 output" << std::endl;
+        active_ = false;
+        release_buffers();
+        ::close(fd_);
+        fd_ = -1;
+        throw;
+      }
+    }
+
+    reclaim_buffers();
+
+    if (free_.empty()) {
+      // The consumer is not keeping up; every buffer is still queued
+      ++dropped_;
+      return;
+    }
+
+    auto index = free_.back();
+    free_.pop_back();
+
+    auto & buffer = buffers_[index];
+    auto bytesperline = format_.fmt.pix.bytesperline;
+    auto * dest = static_cast<std::uint8_t *>(buffer.p);
+
+    if (pixel_format_.convert) {
+      convert_(frame.data(), frame.pitch(), dest, bytesperline, frame.width(), frame.height());
+    } else {
+      for (unsigned int y = 0; y < frame.height(); ++y) {
+        std::memcpy(dest + y * bytesperline, frame.row(y), frame.row_size());
+      }
+    }
+
+    v4l2_buffer buf = { };
+    buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = index;
+    buf.bytesused = format_.fmt.pix.sizeimage;
+    buf.field = V4L2_FIELD_NONE;
+    buf.timestamp.tv_sec = nanoseconds_since_epoch(frame.time()).count() / 1'000'000'000;
+    buf.timestamp.tv_usec = (nanoseconds_since_epoch(frame.time()).count() % 1'000'000'000) / 1000;
+    buf.flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+
+    if (ioctl(fd_, VIDIOC_QBUF, &buf) < 0) {
+      free_.push_back(index);
+      throw std::runtime_error(std::string("ioctl failed (VIDIOC_QBUF): ") + std::strerror(errno));
+    }
+
+    ++queued_;
+
+    // Output devices need at least one buffer queued before streaming
+    // can start
+    if (!streaming_) {
+      int type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+      if (ioctl(fd_, VIDIOC_STREAMON, &type) < 0) {
+        throw std::runtime_error(std::string("ioctl failed (VIDIOC_STREAMON): ") + std::strerror(errno));
+      }
+      streaming_ = true;
+    }
+  }
+
+private:
+  struct Buffer {
+    void * p = MAP_FAILED;
+    std::size_t length = 0;
+  };
+
+  void configure(unsigned int width, unsigned int height, retro_pixel_format format) {
+    release_buffers();
+
+    pixel_format_ = pixel_formats.at(format);
+    convert_ = PixelConvert(format);
+
     prime_format(format_);
-    format_.fmt.pix.width = geom.base_width();
-    format_.fmt.pix.height = geom.base_height();
+    format_.fmt.pix.width = width;
+    format_.fmt.pix.height = height;
     format_.fmt.pix.pixelformat = pixel_format_.v4l2_pix_fmt;
-    format_.fmt.pix.bytesperline = 0;
-    format_.fmt.pix.sizeimage = format_.fmt.pix.bytesperline * geom.base_height();
+    format_.fmt.pix.field = V4L2_FIELD_NONE;
+    format_.fmt.pix.bytesperline = width * pixel_format_.bpp / CHAR_BIT;
+    format_.fmt.pix.sizeimage = format_.fmt.pix.bytesperline * height;
 
     set_format(format_);
+
+    // The driver may have adjusted the format
+    if (format_.fmt.pix.width != width || format_.fmt.pix.height != height || format_.fmt.pix.pixelformat != pixel_format_.v4l2_pix_fmt) {
+      throw std::runtime_error("v4l2 device does not support format " + to_string(format_.fmt.pix));
+    }
+
+    request_buffers();
+
+    width_ = width;
+    height_ = height;
+    retro_format_ = format;
   }
 
-  virtual void video_refresh(const void * data, unsigned int width, unsigned int height, std::size_t pitch) override {
-    auto Bpp = pixel_format_.bpp / CHAR_BIT;
-    buf_.clear();
-    auto size = width * height * Bpp;
-    buf_.resize(size);
-    auto dest = buf_.data();
-    for (std::size_t i = 0; i < height; ++i) {
-      auto start = static_cast<char const *>(data) + i * pitch;
-      auto end = start + width * Bpp;
-      dest = std::copy(start, end, dest);
+  void request_buffers() {
+    v4l2_requestbuffers req = { };
+    req.count = num_buffers_;
+    req.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+    req.memory = V4L2_MEMORY_MMAP;
+
+    if (ioctl(fd_, VIDIOC_REQBUFS, &req) < 0) {
+      throw std::runtime_error(std::string("ioctl failed (VIDIOC_REQBUFS): ") + std::strerror(errno));
     }
+
+    if (req.count == 0) {
+      throw std::runtime_error("v4l2 device did not allocate any buffers");
+    }
+
+    buffers_.resize(req.count);
+
+    for (unsigned int i = 0; i < req.count; ++i) {
+      v4l2_buffer buf = { };
+      buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+      buf.memory = V4L2_MEMORY_MMAP;
+      buf.index = i;
+
+      if (ioctl(fd_, VIDIOC_QUERYBUF, &buf) < 0) {
+        throw std::runtime_error(std::string("ioctl failed (VIDIOC_QUERYBUF): ") + std::strerror(errno));
+      }
+
+      buffers_[i].length = buf.length;
+      buffers_[i].p = ::mmap(nullptr, buf.length, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, buf.m.offset);
+
+      if (buffers_[i].p == MAP_FAILED) {
+        throw std::runtime_error(std::string("mmap failed for v4l2 buffer: ") + std::strerror(errno));
+      }
+
+      if (buf.length < format_.fmt.pix.sizeimage) {
+        throw std::runtime_error("v4l2 buffer is smaller than the image");
+      }
+
+      free_.push_back(i);
+    }
+
+    std::cout << "Using " << req.count << " v4l2 buffers" << std::endl;
   }
 
-  virtual void pre_frame_delay(State const & state) override {
-    if (fd_ < 0) {
-      return;
+  void release_buffers() {
+    if (streaming_) {
+      int type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+      ioctl(fd_, VIDIOC_STREAMOFF, &type);
+      streaming_ = false;
+    }
+
+    for (auto & buffer : buffers_) {
+      if (buffer.p != MAP_FAILED) {
+        ::munmap(buffer.p, buffer.length);
+      }
     }
 
-    [&] { return write(fd_, buf_.data(), buf_.size()); }();
+    if (!buffers_.empty()) {
+      v4l2_requestbuffers req = { };
+      req.count = 0;
+      req.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+      req.memory = V4L2_MEMORY_MMAP;
+      ioctl(fd_, VIDIOC_REQBUFS, &req);
+    }
+
+    buffers_.clear();
+    free_.clear();
+    queued_ = 0;
+    width_ = 0;
+    height_ = 0;
+  }
+
+  // Take back buffers the consumer has finished with
+  void reclaim_buffers() {
+    while (queued_ > 0) {
+      v4l2_buffer buf = { };
+      buf.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+      buf.memory = V4L2_MEMORY_MMAP;
+
+      if (ioctl(fd_, VIDIOC_DQBUF, &buf) < 0) {
+        if (errno == EAGAIN) {
+          break;
+        }
+        throw std::runtime_error(std::string("ioctl failed (VIDIOC_DQBUF): ") + std::strerror(errno));
+      }
+
+      free_.push_back(buf.index);
+      --queued_;
+    }
   }
 
-private:
   void prime_format(v4l2_format & format) {
     format.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
 
@@ -113,7 +297,7 @@ private:
     }
   }
 
-  void set_format(v4l2_format const & format) {
+  void set_format(v4l2_format & format) {
     std::cout << "Before: " << to_string(format.fmt.pix) << std::endl;
     if (ioctl(fd_, VIDIOC_S_FMT, &format) < 0) {
       throw std::runtime_error("ioctl failed (VIDIOC_S_FMT)");
@@ -134,12 +318,26 @@ private:
 
 private:
   std::string const & device_;
+  unsigned int const & num_buffers_;
 
-  Pixel_Format pixel_format_;
   int fd_ = -1;
 
-  using Buffer = std::vector<char>;
-  Buffer buf_;
+  unsigned int width_ = 0;
+  unsigned int height_ = 0;
+  retro_pixel_format retro_format_ = RETRO_PIXEL_FORMAT_UNKNOWN;
+  Pixel_Format pixel_format_ = { };
+  PixelConvert convert_ { RETRO_PIXEL_FORMAT_0RGB1555 };
+
+  std::vector<Buffer> buffers_;
+  std::vector<unsigned int> free_;
+  bool streaming_ = false;
+
+  // fd_ belongs to the capture thread; this is what the game thread sees
+  std::atomic<bool> active_ = false;
+  std::atomic<unsigned int> queued_ = 0;
+  std::atomic<std::uint64_t> dropped_ = 0;
+  std::optional<Probe::Key> queued_key_;
+  std::optional<Probe::Key> dropped_key_;
 
   v4l2_capability cap_;
   v4l2_format format_;
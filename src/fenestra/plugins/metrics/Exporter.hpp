@@ -0,0 +1,387 @@
+#pragma once
+
+#include "fenestra/plugins/metrics/Histogram.hpp"
+#include "fenestra/Probe.hpp"
+#include "fenestra/SpscQueue.hpp"
+#include "fenestra/Clock.hpp"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <tuple>
+#include <type_traits>
+#include <vector>
+
+namespace fenestra::metrics {
+
+// One frame's probe, passed from the game thread to the exporter
+struct Record {
+  Probe probe;
+
+  // Every key in the dictionary, when it has changed since the last
+  // record
+  std::vector<std::tuple<Probe::Key, std::string, Probe::Scale>> names;
+};
+
+// Serves the probe metrics of every frame so far, aggregated, in the
+// OpenMetrics text format at http://<address>:<port>/metrics.
+//
+// The game thread only copies each frame's probe into a preallocated
+// record and hands it over through a queue.  Everything else (the
+// aggregation, rendering and HTTP) happens on the exporter's thread,
+// so a scrape never touches the game thread.
+//
+// Each probe key is exported as a summary (quantiles, sum and count):
+// timings as fenestra_probe_duration_seconds, and metered values as
+// fenestra_probe_value (in the units the perflog viewer shows, i.e.
+// divided by the key's scale), along with the last value as
+// fenestra_probe_value_last.  Quantiles come from a log-linear
+// histogram, so they are within 1/64 of the exact value.
+class Exporter {
+public:
+  Exporter(std::string const & address, int port)
+    : records_(max_records)
+    , free_records_(max_records)
+  {
+    for (std::size_t i = 0; i < max_records; ++i) {
+      auto record = std::make_unique<Record>();
+      record->probe.reserve(record_stamps);
+      free_records_.push(std::move(record));
+    }
+
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+
+    if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1) {
+      throw std::runtime_error("invalid metrics address: " + address);
+    }
+
+    if ((sock_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) < 0) {
+      throw std::runtime_error("socket failed");
+    }
+
+    int one = 1;
+    setsockopt(sock_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    if (bind(sock_, (sockaddr const *)&addr, sizeof(addr)) < 0 || listen(sock_, 16) < 0) {
+      close(sock_);
+      throw std::runtime_error("bind failed (metrics port " + std::to_string(port) + ")");
+    }
+
+    th_ = std::thread([this] { run(); });
+  }
+
+  ~Exporter() {
+    done_ = true;
+    th_.join();
+
+    for (auto const & client : clients_) {
+      close(client.fd);
+    }
+    close(sock_);
+  }
+
+  // Game thread
+  void record(Probe const & probe, Probe::Dictionary const & dictionary) {
+    auto record = free_records_.pop();
+
+    if (!record) {
+      ++dropped_;
+      return;
+    }
+
+    auto & r = **record;
+    r.probe.clear();
+    r.probe.append(probe);
+    r.names.clear();
+
+    if (dictionary.version() != dictionary_version_) {
+      for (auto const & [ key, name ] : dictionary) {
+        r.names.emplace_back(key, name, dictionary.scale(key));
+      }
+      dictionary_version_ = dictionary.version();
+    }
+
+    // Can't fail: there are never more records than the queue holds
+    records_.push(std::move(*record));
+  }
+
+private:
+  static constexpr std::size_t max_records = 256;
+  static constexpr std::size_t record_stamps = 256;
+  static constexpr std::size_t max_clients = 16;
+  static constexpr std::size_t max_request = 8192;
+  static constexpr double quantiles[] = { 0.5, 0.9, 0.99, 0.999, 1.0 };
+
+  struct Series {
+    std::string name;
+    Probe::Scale scale = 1;
+    bool duration = false;
+    Histogram histogram;
+    Probe::Value last = 0;
+  };
+
+  struct Client {
+    int fd;
+    Timestamp opened;
+    std::string in;
+    std::string out;
+    std::size_t out_pos = 0;
+  };
+
+  void run() {
+    std::vector<pollfd> fds;
+
+    while (!done_) {
+      fds.clear();
+      fds.push_back({ sock_, POLLIN, 0 });
+      for (auto const & client : clients_) {
+        fds.push_back({ client.fd, short(client.out.empty() ? POLLIN : POLLOUT), 0 });
+      }
+
+      // Records are picked up at least this often, which is plenty
+      // for a queue that holds several seconds' worth
+      poll(fds.data(), fds.size(), 50);
+
+      while (auto record = records_.pop()) {
+        aggregate(**record);
+        free_records_.push(std::move(*record));
+      }
+
+      for (std::size_t i = 1; i < fds.size(); ++i) {
+        if (fds[i].revents) {
+          serve(clients_[i - 1]);
+        }
+      }
+
+      auto now = Clock::gettime(CLOCK_MONOTONIC);
+      clients_.erase(std::remove_if(clients_.begin(), clients_.end(), [&](auto const & client) {
+        bool expired = client.fd < 0 || now - client.opened > Seconds(5);
+        if (expired && client.fd >= 0) close(client.fd);
+        return expired;
+      }), clients_.end());
+
+      if (fds[0].revents & POLLIN) {
+        accept_clients();
+      }
+    }
+  }
+
+  void aggregate(Record const & record) {
+    for (auto const & [ key, name, scale ] : record.names) {
+      auto & series = get_series(key);
+      series.name = name;
+      series.scale = scale ? scale : 1;
+    }
+
+    record.probe.for_each_perf_metric([&](Probe::Key key, Probe::Depth depth, auto value) {
+      auto & series = get_series(key);
+      if constexpr (std::is_same_v<decltype(value), Nanoseconds>) {
+        series.duration = true;
+        series.histogram.record(value.count());
+      } else {
+        series.histogram.record(value);
+        series.last = value;
+      }
+    });
+
+    ++frames_;
+  }
+
+  Series & get_series(Probe::Key key) {
+    if (key >= series_.size()) {
+      series_.resize(key + 1);
+    }
+    return series_[key];
+  }
+
+  void accept_clients() {
+    for (;;) {
+      int fd = accept4(sock_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) {
+        break;
+      }
+
+      if (clients_.size() >= max_clients) {
+        close(fd);
+        continue;
+      }
+
+      clients_.push_back({ fd, Clock::gettime(CLOCK_MONOTONIC) });
+    }
+  }
+
+  // Reads the request, then writes the response and closes
+  void serve(Client & client) {
+    if (client.out.empty()) {
+      char buf[4096];
+      auto n = recv(client.fd, buf, sizeof(buf), MSG_DONTWAIT);
+      if (n <= 0) {
+        if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+          disconnect(client);
+        }
+        return;
+      }
+
+      client.in.append(buf, n);
+
+      if (client.in.find("\r\n\r\n") == std::string::npos) {
+        if (client.in.size() > max_request) {
+          disconnect(client);
+        }
+        return;
+      }
+
+      respond(client);
+    }
+
+    while (client.out_pos < client.out.size()) {
+      auto n = send(client.fd, client.out.data() + client.out_pos, client.out.size() - client.out_pos, MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (n < 0) {
+        if (errno != EAGAIN && errno != EINTR) {
+          disconnect(client);
+        }
+        return;
+      }
+      client.out_pos += n;
+    }
+
+    disconnect(client);
+  }
+
+  void disconnect(Client & client) {
+    close(client.fd);
+    client.fd = -1;
+  }
+
+  void respond(Client & client) {
+    std::string_view request(client.in);
+    auto path = request.substr(0, request.find_first_of(" ?", 4));
+
+    if (path == "GET /metrics" || path == "GET /") {
+      render(body_);
+      client.out = "HTTP/1.1 200 OK\r\n"
+                   "Content-Type: application/openmetrics-text; version=1.0.0; charset=utf-8\r\n";
+    } else {
+      body_ = "Not found\n";
+      client.out = "HTTP/1.1 404 Not Found\r\n"
+                   "Content-Type: text/plain\r\n";
+    }
+
+    client.out += "Content-Length: " + std::to_string(body_.size()) + "\r\n"
+                  "Connection: close\r\n\r\n";
+    client.out += body_;
+  }
+
+  void render(std::string & out) {
+    out.clear();
+
+    out += "# TYPE fenestra_frames counter\n";
+    append_sample(out, "fenestra_frames_total", { }, frames_);
+
+    out += "# TYPE fenestra_metrics_dropped_records counter\n";
+    append_sample(out, "fenestra_metrics_dropped_records_total", { }, dropped_);
+
+    out += "# TYPE fenestra_probe_duration_seconds summary\n";
+    out += "# UNIT fenestra_probe_duration_seconds seconds\n";
+    render_summaries(out, "fenestra_probe_duration_seconds", true);
+
+    out += "# TYPE fenestra_probe_value summary\n";
+    render_summaries(out, "fenestra_probe_value", false);
+
+    out += "# TYPE fenestra_probe_value_last gauge\n";
+    for (auto const & series : series_) {
+      if (series.histogram.count() && !series.duration) {
+        append_sample(out, "fenestra_probe_value_last", series.name, double(series.last) / series.scale);
+      }
+    }
+
+    out += "# EOF\n";
+  }
+
+  void render_summaries(std::string & out, std::string_view family, bool duration) {
+    for (auto const & series : series_) {
+      auto const & h = series.histogram;
+      if (h.count() == 0 || series.duration != duration) {
+        continue;
+      }
+
+      auto unit = duration ? 1e9 : double(series.scale);
+
+      for (auto q : quantiles) {
+        append_sample(out, family, series.name, h.quantile(q) / unit, q);
+      }
+      append_sample(out, std::string(family) + "_sum", series.name, h.sum() / unit);
+      append_sample(out, std::string(family) + "_count", series.name, h.count());
+    }
+  }
+
+  // Appends a line like: name{probe="...",quantile="0.5"} 1.5
+  static void append_sample(std::string & out, std::string_view name, std::string_view probe, double value, double quantile = -1) {
+    out += name;
+
+    if (!probe.empty()) {
+      out += "{probe=\"";
+      for (auto c : probe) {
+        switch (c) {
+          case '\\': out += "\\\\"; break;
+          case '"': out += "\\\""; break;
+          case '\n': out += "\\n"; break;
+          default: out += c; break;
+        }
+      }
+      out += '"';
+
+      if (quantile >= 0) {
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), ",quantile=\"%g\"", quantile);
+        out += buf;
+      }
+
+      out += '}';
+    }
+
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), " %.9g\n", value);
+    out += buf;
+  }
+
+private:
+  int sock_ = -1;
+
+  SpscQueue<std::unique_ptr<Record>> records_;
+  SpscQueue<std::unique_ptr<Record>> free_records_;
+
+  // Only touched by the game thread
+  std::uint64_t dictionary_version_ = ~std::uint64_t(0);
+
+  std::atomic<std::uint64_t> dropped_ = 0;
+  std::atomic<bool> done_ = false;
+
+  // Only touched by the exporter thread
+  std::vector<Series> series_;
+  std::uint64_t frames_ = 0;
+  std::vector<Client> clients_;
+  std::string body_;
+
+  std::thread th_;
+};
+
+}
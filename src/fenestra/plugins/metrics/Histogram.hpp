@@ -0,0 +1,89 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+namespace fenestra::metrics {
+
+// A log-linear histogram in the style of HdrHistogram: values below
+// 2^sub_bits each get a bucket, and every power of two above that is
+// split into 2^(sub_bits-1) equal buckets, so any quantile is within
+// 1/64 of the true value no matter how large it is.  Buckets are only
+// allocated up to the largest value seen.
+class Histogram {
+public:
+  void record(std::uint64_t value) {
+    auto idx = index(value);
+    if (idx >= counts_.size()) {
+      counts_.resize(idx + 1);
+    }
+
+    ++counts_[idx];
+    ++count_;
+    sum_ += value;
+    min_ = count_ == 1 ? value : std::min(min_, value);
+    max_ = std::max(max_, value);
+  }
+
+  std::uint64_t count() const { return count_; }
+  double sum() const { return sum_; }
+  std::uint64_t min() const { return min_; }
+  std::uint64_t max() const { return max_; }
+
+  // The value at quantile q (0 to 1)
+  std::uint64_t quantile(double q) const {
+    if (count_ == 0) {
+      return 0;
+    }
+
+    auto rank = std::max<std::uint64_t>(1, std::ceil(q * count_));
+    if (rank >= count_) {
+      return max_;
+    }
+
+    std::uint64_t seen = 0;
+
+    for (std::size_t idx = 0; idx < counts_.size(); ++idx) {
+      seen += counts_[idx];
+      if (seen >= rank) {
+        return std::clamp(midpoint(idx), min_, max_);
+      }
+    }
+
+    return max_;
+  }
+
+private:
+  static constexpr int sub_bits = 7;
+  static constexpr std::uint64_t sub_count = std::uint64_t(1) << sub_bits;
+  static constexpr std::uint64_t half_count = sub_count / 2;
+
+  static std::size_t index(std::uint64_t value) {
+    if (value < sub_count) {
+      return value;
+    }
+
+    int shift = 63 - __builtin_clzll(value) - (sub_bits - 1);
+    return shift * half_count + (value >> shift);
+  }
+
+  static std::uint64_t midpoint(std::size_t idx) {
+    if (idx < sub_count) {
+      return idx;
+    }
+
+    auto shift = idx / half_count - 1;
+    auto low = (half_count + idx % half_count) << shift;
+    return low + ((std::uint64_t(1) << shift) >> 1);
+  }
+
+  std::vector<std::uint64_t> counts_;
+  std::uint64_t count_ = 0;
+  double sum_ = 0;
+  std::uint64_t min_ = 0;
+  std::uint64_t max_ = 0;
+};
+
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+namespace fenestra::netcmds {
+
+// A client on a stream socket (TCP or unix).  Messages in both
+// directions are a little-endian uint32 length followed by that many
+// bytes; a message holds one or more newline-separated commands, just
+// like a datagram.
+class Connection {
+public:
+  static constexpr std::size_t max_message = 16 * 1024 * 1024;
+  static constexpr std::size_t max_read = 1024 * 1024;
+
+  explicit Connection(int fd)
+    : fd_(fd)
+  {
+  }
+
+  ~Connection() {
+    close(fd_);
+  }
+
+  Connection(Connection const &) = delete;
+  Connection & operator=(Connection const &) = delete;
+
+  int fd() const { return fd_; }
+
+  // Reads what is available (up to a limit, so one busy client can't
+  // starve the others) and calls fn(message) for each complete message.
+  // Returns false if the client disconnected or sent a message that is
+  // too large.
+  template<typename F>
+  bool receive(F && fn) {
+    bool open = true;
+
+    for (std::size_t total = 0; total < max_read; total += 65536) {
+      auto size = in_.size();
+      in_.resize(size + 65536);
+
+      auto n = ::recv(fd_, in_.data() + size, 65536, MSG_DONTWAIT);
+      in_.resize(size + (n > 0 ? n : 0));
+
+      if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+        open = false;
+        break;
+      } else if (n < 0) {
+        break;
+      }
+    }
+
+    std::size_t pos = 0;
+    while (in_.size() - pos >= sizeof(std::uint32_t)) {
+      std::uint32_t len;
+      std::memcpy(&len, in_.data() + pos, sizeof(len));
+
+      if (len > max_message) {
+        return false;
+      }
+
+      if (in_.size() - pos - sizeof(len) < len) {
+        break;
+      }
+
+      fn(std::string_view(in_.data() + pos + sizeof(len), len));
+      pos += sizeof(len) + len;
+    }
+
+    in_.erase(in_.begin(), in_.begin() + pos);
+    return open;
+  }
+
+  void queue(std::string_view message) {
+    std::uint32_t len = message.size();
+    auto const * p = reinterpret_cast<char const *>(&len);
+    out_.insert(out_.end(), p, p + sizeof(len));
+    out_.insert(out_.end(), message.begin(), message.end());
+  }
+
+  // Writes as much queued output as the socket will take.  Returns
+  // false if the connection is broken.
+  bool send() {
+    while (out_pos_ < out_.size()) {
+      auto n = ::send(fd_, out_.data() + out_pos_, out_.size() - out_pos_, MSG_DONTWAIT | MSG_NOSIGNAL);
+      if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+          break;
+        }
+        return false;
+      }
+      out_pos_ += n;
+    }
+
+    if (out_pos_ == out_.size()) {
+      out_.clear();
+      out_pos_ = 0;
+    } else if (out_pos_ > out_.size() / 2) {
+      out_.erase(out_.begin(), out_.begin() + out_pos_);
+      out_pos_ = 0;
+    }
+
+    return true;
+  }
+
+  std::size_t queued() const { return out_.size() - out_pos_; }
+
+  // The epoll events this connection is registered for
+  std::uint32_t events = 0;
+
+private:
+  int fd_;
+  std::vector<char> in_;
+  std::vector<char> out_;
+  std::size_t out_pos_ = 0;
+};
+
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE2__)
+#define FENESTRA_NETCMDS_DIFF_SSE2
+#include <emmintrin.h>
+#endif
+
+namespace fenestra::netcmds {
+
+// Calls fn(offset, n) for each run of bytes that differ between a and
+// b.  Runs separated by no more than gap equal bytes are reported as
+// one, since sending a few unchanged bytes is cheaper than starting a
+// new run.
+//
+// Most of memory is unchanged from one frame to the next, so this
+// compares 16 bytes at a time and only looks at single bytes in blocks
+// that differ.
+template<typename F>
+void for_each_difference(std::uint8_t const * a, std::uint8_t const * b, std::size_t size, std::size_t gap, F && fn) {
+  std::size_t begin = 0;
+  std::size_t end = 0;
+  bool in_run = false;
+
+  auto mark = [&](std::size_t pos) {
+    if (in_run && pos > end + gap) {
+      fn(begin, end - begin);
+      in_run = false;
+    }
+    if (!in_run) {
+      begin = pos;
+      in_run = true;
+    }
+    end = pos + 1;
+  };
+
+  std::size_t i = 0;
+
+#ifdef FENESTRA_NETCMDS_DIFF_SSE2
+  for (; i + 16 <= size; i += 16) {
+    auto va = _mm_loadu_si128(reinterpret_cast<__m128i const *>(a + i));
+    auto vb = _mm_loadu_si128(reinterpret_cast<__m128i const *>(b + i));
+    unsigned int mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) & 0xffff;
+
+    while (mask) {
+      mark(i + __builtin_ctz(mask));
+      mask &= mask - 1;
+    }
+  }
+#else
+  for (; i + 8 <= size; i += 8) {
+    std::uint64_t wa, wb;
+    std::memcpy(&wa, a + i, sizeof(wa));
+    std::memcpy(&wb, b + i, sizeof(wb));
+
+    if (wa != wb) {
+      for (std::size_t j = i; j < i + 8; ++j) {
+        if (a[j] != b[j]) mark(j);
+      }
+    }
+  }
+#endif
+
+  for (; i < size; ++i) {
+    if (a[i] != b[i]) mark(i);
+  }
+
+  if (in_run) {
+    fn(begin, end - begin);
+  }
+}
+
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <sys/socket.h>
+
+#include <cstdint>
+#include <cstring>
+
+namespace fenestra::netcmds {
+
+// Where a reply should be sent: either a datagram address, or a stream
+// connection (stream is the connection's id, or 0 for a datagram)
+struct Peer {
+  sockaddr_storage addr;
+  socklen_t addr_len = 0;
+  std::uint64_t stream = 0;
+
+  bool operator==(Peer const & other) const {
+    if (stream || other.stream) {
+      return stream == other.stream;
+    }
+    return addr_len == other.addr_len && std::memcmp(&addr, &other.addr, addr_len) == 0;
+  }
+};
+
+}
@@ -0,0 +1,1333 @@
+#pragma once
+
+#include "fenestra/plugins/netcmds/Connection.hpp"
+#include "fenestra/plugins/netcmds/Peer.hpp"
+#include "fenestra/plugins/netcmds/Snapshot.hpp"
+#include "fenestra/plugins/netcmds/Diff.hpp"
+#include "fenestra/SpscQueue.hpp"
+#include "fenestra/Clock.hpp"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cctype>
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace fenestra::netcmds {
+
+// Sent by the network thread to the game thread
+struct Command {
+  enum class Type { NONE, WRITE_CORE_RAM, WRITE_CORE_MEMORY, KEYS, WATCH, RECYCLE };
+
+  Type type = Type::NONE;
+  Peer peer;
+  std::size_t addr = 0;
+  std::vector<std::uint8_t> bytes;
+  std::u32string keys;
+  std::vector<Range> watches;
+  std::unique_ptr<Snapshot> snapshot;
+};
+
+// Sent by the game thread to the network thread
+struct Event {
+  enum class Type { NONE, SNAPSHOT, REPLY };
+
+  Type type = Type::NONE;
+  Peer peer;
+  std::string reply;
+  std::unique_ptr<Snapshot> snapshot;
+};
+
+// Receives network commands and answers them on its own thread, so a
+// flood of packets never delays a frame.
+//
+// Commands arrive as UDP datagrams (like retroarch), or on TCP and unix
+// stream sockets, where each message is framed with a little-endian
+// uint32 length (see Connection).  Both kinds of client are served by
+// the same parser; stream clients get replies of any size, where a
+// datagram reply is capped to what fits in a packet.  A stream client
+// that stops reading its replies is not read from until it catches up
+// (and is sent no subscription updates meanwhile), and is disconnected
+// if it falls much further behind.
+//
+// Commands that control the game (PAUSE_TOGGLE, FRAMEADVANCE, RESET,
+// SAVE_STATE, LOAD_STATE, FAST_FORWARD, QUIT) are sent to the game
+// thread as the key presses that do the same thing, so they go through
+// the same queue as the keyboard and are handled between frames.
+//
+// Reads are answered from the most recent snapshot of the watched
+// memory ranges.  A read of memory that is not watched yet adds a
+// watch and waits for the next snapshot; watches that have not been
+// read for a while are dropped.  Commands that change the game (writes)
+// are queued for the game thread, which applies them between frames.
+//
+// Clients can also subscribe to memory ranges, and are then sent the
+// bytes that changed after each frame:
+//
+//   SUBSCRIBE_CORE_MEMORY <addr> <bytes> [<addr> <bytes> ...]
+//   UNSUBSCRIBE_CORE_MEMORY
+//
+// Each change notification is one or more messages of
+//
+//   CORE_MEMORY_CHANGED <snapshot> <addr> <hex> [<addr> <hex> ...]
+//
+// where snapshot counts frames, and the first notification after
+// subscribing has the full contents of the ranges.  With
+// SUBSCRIBE_CORE_MEMORY_BIN, notifications are instead
+// "CORE_MEMORY_CHANGED_BIN\n", a uint64 snapshot number, then for each
+// run a uint64 address, uint32 length and the bytes (little-endian).
+// Addresses are in the same space as READ_CORE_MEMORY_BATCH.  A
+// subscription is dropped if the client sends nothing for
+// subscription_timeout seconds (or disconnects), so clients should
+// repeat any command (e.g. VERSION) periodically.
+class Server {
+public:
+  struct Settings {
+    int udp_port = 0;
+    int tcp_port = 0;
+    std::string unix_socket;
+    Seconds watch_timeout;
+    std::size_t max_watched_bytes = 0;
+    Seconds subscription_timeout;
+    std::size_t max_output = 0;
+
+    // For GET_STATUS and GET_CONFIG_PARAM
+    std::string system_id;
+    std::string content_name;
+    std::uint32_t content_crc32 = 0;
+    std::map<std::string, std::string, std::less<>> config_params;
+  };
+
+  explicit Server(Settings const & settings)
+    : settings_(settings)
+    , commands_(1024)
+    , events_(1024)
+    , recv_buf_(recv_batch * recv_size)
+  {
+    wake_ = eventfd(0, EFD_NONBLOCK);
+    epoll_ = epoll_create1(0);
+
+    if (wake_ < 0 || epoll_ < 0) {
+      close_all();
+      throw std::runtime_error("eventfd/epoll_create failed");
+    }
+
+    try {
+      if (settings_.udp_port > 0) {
+        sock_ = bind_inet(SOCK_DGRAM, settings_.udp_port);
+      }
+
+      if (settings_.tcp_port > 0) {
+        tcp_ = bind_inet(SOCK_STREAM, settings_.tcp_port);
+      }
+
+      if (!settings_.unix_socket.empty()) {
+        unix_ = bind_unix(settings_.unix_socket);
+      }
+
+      for (int fd : { tcp_, unix_ }) {
+        if (fd >= 0 && listen(fd, 16) < 0) {
+          throw std::runtime_error("listen failed");
+        }
+      }
+
+      add_to_epoll(wake_, WAKE, EPOLLIN);
+      if (sock_ >= 0) add_to_epoll(sock_, UDP, EPOLLIN);
+      if (tcp_ >= 0) add_to_epoll(tcp_, TCP_LISTEN, EPOLLIN);
+      if (unix_ >= 0) add_to_epoll(unix_, UNIX_LISTEN, EPOLLIN);
+    } catch (...) {
+      close_all();
+      throw;
+    }
+
+    th_ = std::thread([this] { run(); });
+  }
+
+  ~Server() {
+    done_ = true;
+    wake();
+    th_.join();
+    close_all();
+  }
+
+  // Game thread: commands to apply before the next frame
+  std::optional<Command> pop_command() {
+    return commands_.pop();
+  }
+
+  // Game thread: events are handled after the next call to wake()
+  bool push_event(Event && event) {
+    return events_.push(std::move(event));
+  }
+
+  void wake() {
+    std::uint64_t one = 1;
+    [[maybe_unused]] auto n = ::write(wake_, &one, sizeof(one));
+  }
+
+  void set_paused(bool paused) { paused_ = paused; }
+  void set_have_memory_map(bool have) { have_memory_map_ = have; }
+
+  std::uint64_t commands_handled() const { return commands_handled_; }
+  std::uint64_t commands_dropped() const { return commands_dropped_; }
+
+private:
+  static constexpr unsigned int recv_batch = 16;
+  static constexpr std::size_t recv_size = 65536;
+  static constexpr unsigned int send_batch = 64;
+  static constexpr unsigned int max_pending_snapshots = 2;
+  static constexpr std::size_t max_pending = 4096;
+  static constexpr std::size_t max_subscriptions = 64;
+  static constexpr std::size_t max_connections = 64;
+
+  // What each epoll event is for; connections are numbered from
+  // first_connection up
+  enum : std::uint64_t { UDP = 1, WAKE, TCP_LISTEN, UNIX_LISTEN, first_connection = 16 };
+
+  struct Watch {
+    std::size_t end;
+    Timestamp last_used;
+  };
+
+  using Watch_Key = std::pair<Space, std::size_t>;
+
+  struct Pending {
+    Peer peer;
+    std::string command;
+    unsigned int snapshots = 0;
+  };
+
+  struct Outgoing {
+    Peer peer;
+    std::vector<char> data;
+  };
+
+  struct Subscription {
+    Peer peer;
+    bool binary = false;
+    Space space = Space::RAM;
+    std::vector<Range> ranges;
+
+    // What the client has been sent so far, for each range in turn
+    std::vector<std::uint8_t> sent;
+    bool sent_all = false;
+
+    Timestamp last_heard;
+  };
+
+  void close_all() {
+    connections_.clear();
+    if (epoll_ >= 0) close(epoll_);
+    if (wake_ >= 0) close(wake_);
+    if (sock_ >= 0) close(sock_);
+    if (tcp_ >= 0) close(tcp_);
+    if (unix_ >= 0) {
+      close(unix_);
+      unlink(settings_.unix_socket.c_str());
+    }
+  }
+
+  int bind_inet(int type, int port) {
+    int fd = socket(AF_INET, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      throw std::runtime_error("socket failed");
+    }
+
+    int one = 1;
+    if (type == SOCK_STREAM) {
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    }
+
+    sockaddr_in addr;
+    std::memset(&addr, 0, sizeof(addr));
+
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+
+    if (bind(fd, (sockaddr const *)&addr, sizeof(addr)) < 0) {
+      close(fd);
+      throw std::runtime_error("bind failed (port " + std::to_string(port) + ")");
+    }
+
+    return fd;
+  }
+
+  int bind_unix(std::string const & path) {
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+
+    if (path.size() >= sizeof(addr.sun_path)) {
+      throw std::runtime_error("unix socket path too long: " + path);
+    }
+
+    addr.sun_family = AF_UNIX;
+    std::memcpy(addr.sun_path, path.data(), path.size());
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      throw std::runtime_error("socket failed");
+    }
+
+    // Remove the socket left behind by a previous run
+    unlink(path.c_str());
+
+    if (bind(fd, (sockaddr const *)&addr, sizeof(addr)) < 0) {
+      close(fd);
+      throw std::runtime_error("bind failed (" + path + ")");
+    }
+
+    return fd;
+  }
+
+  void add_to_epoll(int fd, std::uint64_t tag, std::uint32_t events) {
+    epoll_event ev { };
+    ev.events = events;
+    ev.data.u64 = tag;
+    if (epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &ev) < 0) {
+      throw std::runtime_error("epoll_ctl failed");
+    }
+  }
+
+  void run() {
+    epoll_event events[32];
+
+    while (!done_) {
+      int n = epoll_wait(epoll_, events, 32, 250);
+
+      for (int i = 0; i < n; ++i) {
+        auto tag = events[i].data.u64;
+
+        if (tag == UDP) {
+          receive();
+        } else if (tag == WAKE) {
+          std::uint64_t count;
+          [[maybe_unused]] auto r = ::read(wake_, &count, sizeof(count));
+        } else if (tag == TCP_LISTEN) {
+          accept_connections(tcp_, true);
+        } else if (tag == UNIX_LISTEN) {
+          accept_connections(unix_, false);
+        } else {
+          handle_connection(tag, events[i].events);
+        }
+      }
+
+      handle_events();
+      expire_watches();
+      expire_subscriptions();
+      send_watches();
+      flush();
+    }
+  }
+
+  void accept_connections(int listener, bool tcp) {
+    for (;;) {
+      int fd = accept4(listener, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0) {
+        break;
+      }
+
+      if (connections_.size() >= max_connections) {
+        close(fd);
+        continue;
+      }
+
+      if (tcp) {
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      }
+
+      auto id = next_connection_++;
+      auto conn = std::make_unique<Connection>(fd);
+      conn->events = EPOLLIN;
+
+      try {
+        add_to_epoll(fd, id, conn->events);
+      } catch (std::runtime_error const &) {
+        continue;
+      }
+
+      connections_.emplace(id, std::move(conn));
+    }
+  }
+
+  void handle_connection(std::uint64_t id, std::uint32_t events) {
+    auto it = connections_.find(id);
+    if (it == connections_.end()) {
+      return;
+    }
+
+    auto & conn = *it->second;
+
+    // A peer that has hung up can't be sent any replies, so it is not
+    // read from either (even if reading was paused to let it catch up)
+    bool open = !(events & (EPOLLERR | EPOLLHUP));
+
+    if (open && (events & EPOLLOUT)) {
+      open = conn.send();
+    }
+
+    if (open && (events & EPOLLIN)) {
+      Peer peer;
+      peer.stream = id;
+      open = conn.receive([&](std::string_view message) { handle_packet(message, peer); });
+    }
+
+    if (!open) {
+      disconnect(id);
+    }
+  }
+
+  // Stops reading from a client that is not reading its replies, and
+  // starts again once it has caught up
+  bool update_connection(std::uint64_t id, Connection & conn) {
+    auto queued = conn.queued();
+
+    if (queued > 4 * settings_.max_output) {
+      return false;
+    }
+
+    auto events = conn.events & EPOLLIN;
+    if (queued > settings_.max_output) {
+      events = 0;
+    } else if (queued <= settings_.max_output / 2) {
+      events = EPOLLIN;
+    }
+
+    if (queued > 0) {
+      events |= EPOLLOUT;
+    }
+
+    if (events != conn.events) {
+      epoll_event ev { };
+      ev.events = events;
+      ev.data.u64 = id;
+      if (epoll_ctl(epoll_, EPOLL_CTL_MOD, conn.fd(), &ev) < 0) {
+        return false;
+      }
+      conn.events = events;
+    }
+
+    return true;
+  }
+
+  void disconnect(std::uint64_t id) {
+    auto it = connections_.find(id);
+    if (it == connections_.end()) {
+      return;
+    }
+
+    epoll_ctl(epoll_, EPOLL_CTL_DEL, it->second->fd(), nullptr);
+    connections_.erase(it);
+
+    Peer peer;
+    peer.stream = id;
+
+    subscriptions_.erase(std::remove_if(subscriptions_.begin(), subscriptions_.end(), [&](auto const & sub) {
+      return sub.peer == peer;
+    }), subscriptions_.end());
+
+    pending_.erase(std::remove_if(pending_.begin(), pending_.end(), [&](auto const & p) {
+      return p.peer == peer;
+    }), pending_.end());
+  }
+
+  bool congested(Peer const & peer) const {
+    if (!peer.stream) {
+      return false;
+    }
+
+    auto it = connections_.find(peer.stream);
+    return it == connections_.end() || it->second->queued() > settings_.max_output;
+  }
+
+  // The largest reply that can be sent to a peer in one message
+  static std::size_t max_reply(Peer const & peer) {
+    return peer.stream ? Connection::max_message : max_datagram;
+  }
+
+  static std::size_t max_read(Peer const & peer) {
+    return peer.stream ? (Connection::max_message - 64) / 3 : max_bytes;
+  }
+
+  void receive() {
+    std::array<mmsghdr, recv_batch> msgs;
+    std::array<iovec, recv_batch> iovs;
+    std::array<sockaddr_storage, recv_batch> addrs;
+
+    for (;;) {
+      for (unsigned int i = 0; i < recv_batch; ++i) {
+        iovs[i] = { recv_buf_.data() + i * recv_size, recv_size };
+        std::memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+      }
+
+      int n = recvmmsg(sock_, msgs.data(), recv_batch, MSG_DONTWAIT, nullptr);
+      if (n <= 0) {
+        break;
+      }
+
+      for (int i = 0; i < n; ++i) {
+        Peer peer;
+        std::memcpy(&peer.addr, &addrs[i], msgs[i].msg_hdr.msg_namelen);
+        peer.addr_len = msgs[i].msg_hdr.msg_namelen;
+
+        handle_packet(std::string_view(recv_buf_.data() + i * recv_size, msgs[i].msg_len), peer);
+      }
+
+      flush();
+
+      if (n < int(recv_batch)) {
+        break;
+      }
+    }
+  }
+
+  void handle_events() {
+    bool have_snapshot = false;
+
+    while (auto event = events_.pop()) {
+      switch (event->type) {
+        case Event::Type::SNAPSHOT:
+          recycle(std::move(snapshot_));
+          snapshot_ = std::move(event->snapshot);
+          have_snapshot = true;
+          break;
+
+        case Event::Type::REPLY:
+          send_reply(event->reply, event->peer);
+          break;
+
+        case Event::Type::NONE:
+          break;
+      }
+    }
+
+    if (have_snapshot) {
+      push_subscriptions();
+      retry_pending();
+    }
+  }
+
+  void recycle(std::unique_ptr<Snapshot> snapshot) {
+    if (snapshot) {
+      Command command;
+      command.type = Command::Type::RECYCLE;
+      command.snapshot = std::move(snapshot);
+      commands_.push(std::move(command));
+    }
+  }
+
+  // Reads that were waiting for memory to be watched
+  void retry_pending() {
+    auto pending = std::move(pending_);
+    pending_.clear();
+
+    for (auto & p : pending) {
+      // Answer anyway if the watch never showed up (e.g. because it
+      // was evicted), treating the memory as unmapped
+      bool force = ++p.snapshots >= max_pending_snapshots;
+      auto const & args = parse(p.command);
+      if (!handle_command(args, p.peer, force)) {
+        pending_.push_back(std::move(p));
+      }
+    }
+  }
+
+  template<typename F>
+  static void split(std::string_view const & str, std::vector<std::string_view> & res, F issep) {
+    res.clear();
+
+    auto const * p = str.data();
+    auto const * e = p + str.size();
+    auto const * s = p;
+
+    // Ignore trailing separators
+    while (e > p && issep(*(e-1))) --e;
+
+    for(; p < e; ++p) {
+      // Each time we find a separator, add the current token to the list
+      if (issep(*p)) {
+        res.push_back(std::string_view(s, p - s));
+        s = p + 1;
+      }
+
+      // Find the next separator
+      while (p != e && issep(*p)) ++p;
+    }
+
+    // Add the final token to the list
+    res.push_back(std::string_view(s, p - s));
+  }
+
+  std::vector<std::string_view> const & parse(std::string_view str) {
+    split(str, args_, [](auto c) { return std::isspace(c); });
+    return args_;
+  }
+
+  void handle_packet(std::string_view str, Peer const & peer) {
+    split(str, cmds_, [](auto c) { return c == '\n'; });
+    for (auto const & cmd : cmds_ ) {
+      auto const & args = parse(cmd);
+      if (!handle_command(args, peer, false) && pending_.size() < max_pending) {
+        pending_.push_back({ peer, std::string(cmd) });
+      }
+    }
+  }
+
+  // Returns false if the command needs memory that is not in the
+  // snapshot yet
+  bool handle_command(std::vector<std::string_view> const & args, Peer const & peer, bool force) {
+    if (args.empty() || args[0].empty()) {
+      return true;
+    }
+
+    ++commands_handled_;
+
+    if (auto * sub = find_subscription(peer)) {
+      sub->last_heard = Clock::gettime(CLOCK_MONOTONIC);
+    }
+
+    auto cmd = args[0];
+    if (cmd == "READ_CORE_RAM" && args.size() >= 3) {
+      return handle_read_core_ram(args[1], args[2], peer, force);
+    } else if (cmd == "WRITE_CORE_RAM" && args.size() >= 2) {
+      handle_write(Command::Type::WRITE_CORE_RAM, args[1], std::next(std::begin(args), 2), std::end(args), 10, peer);
+    } else if (cmd == "READ_CORE_MEMORY" && args.size() >= 3) {
+      return handle_read_core_memory(args[1], args[2], peer, force);
+    } else if (cmd == "WRITE_CORE_MEMORY" && args.size() >= 3) {
+      handle_write_core_memory(args, peer);
+    } else if (cmd == "READ_CORE_MEMORY_BATCH" || cmd == "READ_CORE_MEMORY_BATCH_BIN") {
+      return handle_read_core_memory_batch(cmd, std::next(std::begin(args)), std::end(args), cmd == "READ_CORE_MEMORY_BATCH_BIN", peer, force);
+    } else if (cmd == "SUBSCRIBE_CORE_MEMORY" || cmd == "SUBSCRIBE_CORE_MEMORY_BIN") {
+      handle_subscribe(cmd, std::next(std::begin(args)), std::end(args), cmd == "SUBSCRIBE_CORE_MEMORY_BIN", peer);
+    } else if (cmd == "UNSUBSCRIBE_CORE_MEMORY") {
+      handle_unsubscribe(peer);
+    } else if (auto keys = keys_for(cmd); !keys.empty()) {
+      handle_keys(keys, peer);
+    } else if (cmd == "GET_CONFIG_PARAM" && args.size() >= 2) {
+      handle_get_config_param(args[1], peer);
+    } else if (cmd == "GET_STATUS") {
+      handle_get_status(peer);
+    } else if (cmd == "VERSION") {
+      handle_get_version(peer);
+    } else {
+      std::cerr << "Unknown network command: " << cmd << std::endl;
+    }
+
+    return true;
+  }
+
+  template<typename T>
+  static T parse_number(std::string_view s, int base) {
+    T value = 0;
+    std::from_chars(s.data(), s.data() + s.size(), value, base);
+    return value;
+  }
+
+  // Makes sure [addr, addr + bytes) will be in the next snapshot, and
+  // returns whether it is already in this one
+  bool ready(Space space, std::size_t addr, std::size_t bytes, bool force) {
+    if (bytes == 0) {
+      return true;
+    }
+
+    if (snapshot_ && snapshot_->covers(space, addr, bytes)) {
+      touch_watch(space, addr);
+      return true;
+    }
+
+    // Memory that can't be watched at all is answered now, as unmapped
+    return !add_watch(space, addr, addr + bytes) || force;
+  }
+
+  // Calls fn(ptr, n) for each readable piece of [addr, addr + bytes)
+  // in the snapshot, and returns the number of bytes read
+  template<typename F>
+  std::size_t read(Space space, std::size_t addr, std::size_t bytes, F && fn) const {
+    return snapshot_ ? snapshot_->read(space, addr, bytes, std::forward<F>(fn)) : 0;
+  }
+
+  bool readable(Space space, std::size_t addr) const {
+    return read(space, addr, 1, [](auto const *, auto) { }) == 1;
+  }
+
+  bool handle_read_core_ram(std::string_view s_addr, std::string_view s_bytes, Peer const & peer, bool force) {
+    auto addr = parse_number<std::size_t>(s_addr, 16);
+    auto bytes = std::min(parse_number<std::size_t>(s_bytes, 10), max_read(peer));
+
+    if (!ready(Space::RAM, addr, bytes, force)) {
+      return false;
+    }
+
+    reply_.resize(40 + bytes * 3);
+    char * r = reply_.data();
+    r += std::snprintf(reply_.data(), reply_.size(), "READ_CORE_RAM %zx", addr);
+
+    if (readable(Space::RAM, addr)) {
+      read(Space::RAM, addr, bytes, [&](auto const * p, auto size) { r = append_hex(r, p, size, true); });
+    } else {
+      // TODO: This might be a request for a ROM read, but we don't
+      // support it.
+      r += std::snprintf(r, reply_.size() - (r - reply_.data()), " -1");
+    }
+
+    *r++ = '\n';
+
+    send_reply(std::string_view(reply_.data(), r - reply_.data()), peer);
+    return true;
+  }
+
+  // Addresses are in the core's own address space (e.g. the SNES bus),
+  // as described by its memory map
+  bool handle_read_core_memory(std::string_view s_addr, std::string_view s_bytes, Peer const & peer, bool force) {
+    auto addr = parse_number<std::size_t>(s_addr, 16);
+    auto bytes = std::min(parse_number<std::size_t>(s_bytes, 10), max_read(peer));
+
+    if (have_memory_map_ && !ready(Space::MEMORY, addr, bytes, force)) {
+      return false;
+    }
+
+    reply_.resize(64 + bytes * 3);
+    char * r = reply_.data();
+    r += std::snprintf(reply_.data(), reply_.size(), "READ_CORE_MEMORY %zx", addr);
+
+    if (!have_memory_map_) {
+      r += std::snprintf(r, reply_.size() - (r - reply_.data()), " -1 no memory map defined");
+    } else if (!readable(Space::MEMORY, addr)) {
+      r += std::snprintf(r, reply_.size() - (r - reply_.data()), " -1 no descriptor for address");
+    } else {
+      read(Space::MEMORY, addr, bytes, [&](auto const * p, auto size) { r = append_hex(r, p, size, true); });
+    }
+
+    *r++ = '\n';
+
+    send_reply(std::string_view(reply_.data(), r - reply_.data()), peer);
+    return true;
+  }
+
+  // READ_CORE_MEMORY_BATCH <addr> <bytes> [<addr> <bytes> ...]
+  //
+  // Reads any number of ranges in one round trip.  The text reply
+  // repeats each address followed by its bytes as unseparated hex, or
+  // -1 if the address is unmapped:
+  //
+  //   READ_CORE_MEMORY_BATCH 7e0010 0A0B 7e1234 -1
+  //
+  // The _BIN variant replies with "READ_CORE_MEMORY_BATCH_BIN\n"
+  // followed by, for each range, a little-endian int32 byte count (-1
+  // if unmapped) and that many raw bytes.
+  //
+  // Addresses are in the memory map's address space if the core has
+  // one, otherwise in READ_CORE_RAM's.  A read stops early at unmapped
+  // memory or when the reply would no longer fit in a datagram (or in a
+  // stream message).
+  template<typename It>
+  bool handle_read_core_memory_batch(std::string_view cmd, It begin, It end, bool binary, Peer const & peer, bool force) {
+    auto space = have_memory_map_ ? Space::MEMORY : Space::RAM;
+
+    bool all_ready = true;
+    std::size_t size = cmd.size() + 2;
+    for (auto it = begin; it != end && std::next(it) != end; it += 2) {
+      auto addr = parse_number<std::size_t>(*it, 16);
+      auto bytes = std::min(parse_number<std::size_t>(*std::next(it), 10), max_reply(peer));
+      all_ready = ready(space, addr, bytes, force) && all_ready;
+      size += binary ? 4 + bytes : 24 + 2 * bytes;
+    }
+
+    if (!all_ready) {
+      return false;
+    }
+
+    reply_.resize(std::min(size, max_reply(peer)));
+    char * r = reply_.data();
+    char * reply_end = reply_.data() + reply_.size();
+
+    std::memcpy(r, cmd.data(), cmd.size());
+    r += cmd.size();
+    if (binary) {
+      *r++ = '\n';
+    }
+
+    for (auto it = begin; it != end && std::next(it) != end; it += 2) {
+      auto addr = parse_number<std::size_t>(*it, 16);
+      auto bytes = parse_number<std::size_t>(*std::next(it), 10);
+
+      if (binary) {
+        if (reply_end - r < 4) break;
+        auto * count = r;
+        r += 4;
+        bytes = std::min<std::size_t>(bytes, reply_end - r);
+        std::int32_t n = readable(space, addr) ? read(space, addr, bytes, [&](auto const * p, auto size) { std::memcpy(r, p, size); r += size; }) : -1;
+        std::memcpy(count, &n, sizeof(n));
+      } else {
+        if (reply_end - r < 24) break;
+        r += std::snprintf(r, reply_end - r, " %zx ", addr);
+        bytes = std::min<std::size_t>(bytes, (reply_end - r - 3) / 2);
+        if (!readable(space, addr)) {
+          *r++ = '-';
+          *r++ = '1';
+        } else {
+          read(space, addr, bytes, [&](auto const * p, auto size) { r = append_hex(r, p, size, false); });
+        }
+      }
+    }
+
+    if (!binary) {
+      *r++ = '\n';
+    }
+
+    send_reply(std::string_view(reply_.data(), r - reply_.data()), peer);
+    return true;
+  }
+
+  // Values are decimal for WRITE_CORE_RAM and hex for WRITE_CORE_MEMORY
+  template<typename It>
+  void handle_write(Command::Type type, std::string_view s_addr, It begin, It end, int base, Peer const & peer) {
+    Command command;
+    command.type = type;
+    command.peer = peer;
+    command.addr = parse_number<std::size_t>(s_addr, 16);
+
+    for (auto it = begin; it != end; ++it) {
+      command.bytes.push_back(parse_number<unsigned int>(*it, base));
+    }
+
+    if (!commands_.push(std::move(command))) {
+      ++commands_dropped_;
+    }
+  }
+
+  void handle_write_core_memory(std::vector<std::string_view> const & args, Peer const & peer) {
+    if (!have_memory_map_) {
+      reply_.resize(128);
+      auto n = std::snprintf(reply_.data(), reply_.size(), "WRITE_CORE_MEMORY %zx -1 no memory map defined\n", parse_number<std::size_t>(args[1], 16));
+      send_reply(std::string_view(reply_.data(), n), peer);
+      return;
+    }
+
+    // The game thread replies once the write has been applied
+    handle_write(Command::Type::WRITE_CORE_MEMORY, args[1], std::next(std::begin(args), 2), std::end(args), 16, peer);
+  }
+
+  template<typename It>
+  void handle_subscribe(std::string_view cmd, It begin, It end, bool binary, Peer const & peer) {
+    Subscription sub;
+    sub.peer = peer;
+    sub.binary = binary;
+    sub.space = have_memory_map_ ? Space::MEMORY : Space::RAM;
+    sub.last_heard = Clock::gettime(CLOCK_MONOTONIC);
+
+    // Each size is checked before it is added, so neither a range nor
+    // the total can wrap around
+    std::size_t total = 0;
+    bool too_big = false;
+    for (auto it = begin; it != end && std::next(it) != end; it += 2) {
+      auto addr = parse_number<std::size_t>(*it, 16);
+      auto bytes = parse_number<std::size_t>(*std::next(it), 10);
+      if (bytes > settings_.max_watched_bytes - total || addr + bytes < addr) {
+        too_big = true;
+        break;
+      }
+      sub.ranges.push_back({ sub.space, addr, addr + bytes });
+      total += bytes;
+    }
+
+    char const * error = nullptr;
+    auto * existing = find_subscription(peer);
+
+    if (too_big) {
+      error = "too much memory";
+    } else if (!existing && subscriptions_.size() >= max_subscriptions) {
+      error = "too many subscriptions";
+    }
+
+    reply_.resize(128);
+    int n;
+
+    if (error) {
+      n = std::snprintf(reply_.data(), reply_.size(), "%.*s -1 %s\n", int(cmd.size()), cmd.data(), error);
+    } else {
+      sub.sent.assign(total, 0);
+      for (auto const & range : sub.ranges) {
+        add_watch(range.space, range.begin, range.end);
+      }
+
+      if (existing) {
+        *existing = std::move(sub);
+      } else {
+        subscriptions_.push_back(std::move(sub));
+      }
+
+      n = std::snprintf(reply_.data(), reply_.size(), "%.*s %zu\n", int(cmd.size()), cmd.data(), total);
+    }
+
+    send_reply(std::string_view(reply_.data(), n), peer);
+  }
+
+  void handle_unsubscribe(Peer const & peer) {
+    subscriptions_.erase(std::remove_if(subscriptions_.begin(), subscriptions_.end(), [&](auto const & sub) {
+      return sub.peer == peer;
+    }), subscriptions_.end());
+
+    send_reply("UNSUBSCRIBE_CORE_MEMORY\n", peer);
+  }
+
+  Subscription * find_subscription(Peer const & peer) {
+    for (auto & sub : subscriptions_) {
+      if (sub.peer == peer) {
+        return &sub;
+      }
+    }
+    return nullptr;
+  }
+
+  void expire_subscriptions() {
+    auto now = Clock::gettime(CLOCK_MONOTONIC);
+
+    subscriptions_.erase(std::remove_if(subscriptions_.begin(), subscriptions_.end(), [&](auto const & sub) {
+      return now - sub.last_heard > settings_.subscription_timeout;
+    }), subscriptions_.end());
+  }
+
+  // Sends each subscriber what changed since the last snapshot
+  void push_subscriptions() {
+    for (auto & sub : subscriptions_) {
+      // Changes are sent once the client catches up (sent is only
+      // updated for what was actually sent)
+      if (congested(sub.peer)) {
+        continue;
+      }
+
+      begin_push(sub);
+
+      std::size_t offset = 0;
+      bool covered = true;
+
+      for (auto const & range : sub.ranges) {
+        auto size = range.end - range.begin;
+
+        // Keep the memory watched (it may have been evicted)
+        if (snapshot_->covers(range.space, range.begin, size)) {
+          touch_watch(range.space, range.begin);
+        } else {
+          add_watch(range.space, range.begin, range.end);
+          covered = false;
+        }
+
+        snapshot_->for_each(range.space, range.begin, size, [&](std::size_t addr, std::uint8_t const * p, std::size_t n) {
+          auto * sent = sub.sent.data() + offset + (addr - range.begin);
+
+          if (!sub.sent_all) {
+            push_run(sub, addr, p, n);
+          } else {
+            for_each_difference(sent, p, n, 8, [&](std::size_t o, std::size_t len) {
+              push_run(sub, addr + o, p + o, len);
+            });
+          }
+
+          std::memcpy(sent, p, n);
+        });
+
+        offset += size;
+      }
+
+      // The full contents have been sent once every range was in a
+      // snapshot
+      sub.sent_all = sub.sent_all || covered;
+      end_push(sub);
+    }
+  }
+
+  void begin_push(Subscription const & sub) {
+    push_runs_ = 0;
+
+    // A stream peer gets the whole push in one message, but it never
+    // needs more room than if every byte had changed
+    auto worst = 64 + sub.sent.size() * (sub.binary ? 1 + 12 : 2 + 20);
+    reply_.resize(std::min(max_reply(sub.peer), worst));
+    push_end_ = reply_.data();
+
+    if (sub.binary) {
+      append_push("CORE_MEMORY_CHANGED_BIN\n");
+      std::uint64_t frame = snapshot_->frame();
+      std::memcpy(push_end_, &frame, sizeof(frame));
+      push_end_ += sizeof(frame);
+    } else {
+      push_end_ += std::snprintf(push_end_, 64, "CORE_MEMORY_CHANGED %llu", (unsigned long long)snapshot_->frame());
+    }
+
+    push_header_ = push_end_ - reply_.data();
+  }
+
+  void append_push(std::string_view s) {
+    std::memcpy(push_end_, s.data(), s.size());
+    push_end_ += s.size();
+  }
+
+  // Adds a run of changed bytes, starting a new datagram whenever the
+  // current one is full
+  void push_run(Subscription const & sub, std::size_t addr, std::uint8_t const * p, std::size_t n) {
+    while (n > 0) {
+      auto room = std::size_t(reply_.data() + reply_.size() - push_end_);
+      auto overhead = sub.binary ? sizeof(std::uint64_t) + sizeof(std::uint32_t) : std::size_t(20);
+      auto fit = room > overhead ? (room - overhead) / (sub.binary ? 1 : 2) : 0;
+
+      if (fit == 0) {
+        end_push(sub);
+        push_end_ = reply_.data() + push_header_;
+        continue;
+      }
+
+      auto len = std::min(n, fit);
+
+      if (sub.binary) {
+        std::uint64_t a = addr;
+        std::uint32_t l = len;
+        std::memcpy(push_end_, &a, sizeof(a));
+        std::memcpy(push_end_ + sizeof(a), &l, sizeof(l));
+        push_end_ += sizeof(a) + sizeof(l);
+        std::memcpy(push_end_, p, len);
+        push_end_ += len;
+      } else {
+        push_end_ += std::snprintf(push_end_, room, " %zx ", addr);
+        push_end_ = append_hex(push_end_, p, len, false);
+      }
+
+      ++push_runs_;
+      addr += len;
+      p += len;
+      n -= len;
+    }
+  }
+
+  void end_push(Subscription const & sub) {
+    if (push_runs_ == 0) {
+      return;
+    }
+
+    if (!sub.binary) {
+      *push_end_++ = '\n';
+    }
+
+    send_reply(std::string_view(reply_.data(), push_end_ - reply_.data()), sub.peer);
+    push_runs_ = 0;
+  }
+
+  // The keys (see KeyHandler) that do what a command asks
+  static std::u32string_view keys_for(std::string_view cmd) {
+    static constexpr std::pair<std::string_view, std::u32string_view> commands[] = {
+      { "PAUSE_TOGGLE", U"P" },
+      { "FRAMEADVANCE", U"." },
+      { "FAST_FORWARD", U" " },
+      { "SAVE_STATE", U"S" },
+      { "LOAD_STATE", U"L" },
+      { "RESET", U"RR" },
+      { "QUIT", U"\033\033" },
+    };
+
+    for (auto const & [ name, keys ] : commands) {
+      if (cmd == name) {
+        return keys;
+      }
+    }
+
+    return { };
+  }
+
+  void handle_keys(std::u32string_view keys, Peer const & peer) {
+    Command command;
+    command.type = Command::Type::KEYS;
+    command.peer = peer;
+    command.keys = keys;
+
+    if (!commands_.push(std::move(command))) {
+      ++commands_dropped_;
+    }
+  }
+
+  void handle_get_config_param(std::string_view name, Peer const & peer) {
+    reply_.clear();
+    append(reply_, "GET_CONFIG_PARAM ");
+    append(reply_, name);
+    append(reply_, " ");
+
+    auto it = settings_.config_params.find(name);
+    append(reply_, it != settings_.config_params.end() ? std::string_view(it->second) : "-1");
+    append(reply_, "\n");
+
+    send_reply(std::string_view(reply_.data(), reply_.size()), peer);
+  }
+
+  void handle_get_status(Peer const & peer) {
+    char crc[16];
+    auto n = std::snprintf(crc, sizeof(crc), "%x", (unsigned int)settings_.content_crc32);
+
+    reply_.clear();
+    append(reply_, "GET_STATUS ");
+    append(reply_, paused_ ? "PAUSED " : "PLAYING ");
+    append(reply_, settings_.system_id);
+    append(reply_, ",");
+    append(reply_, settings_.content_name);
+    append(reply_, ",crc32=");
+    append(reply_, std::string_view(crc, n));
+    append(reply_, "\n");
+
+    send_reply(std::string_view(reply_.data(), reply_.size()), peer);
+  }
+
+  void handle_get_version(Peer const & peer) {
+    reply_.clear();
+
+    // 1.9.0 tells clients to use READ_CORE_MEMORY; 1.7.2 tells them
+    // to fall back to READ_CORE_RAM, for cores without a memory map.
+    append(reply_, have_memory_map_ ? "1.9.0" : "1.7.2");
+
+    send_reply(std::string_view(reply_.data(), reply_.size()), peer);
+  }
+
+  // Watches are kept sorted and disjoint (overlapping or adjacent ones
+  // are merged), so a snapshot can be searched the same way.  A watch
+  // that would be bigger than max_watched_bytes once merged is not
+  // added, since evicting the others would not make room for it.
+  bool add_watch(Space space, std::size_t begin, std::size_t end) {
+    if (end < begin) {
+      return false;
+    }
+
+    auto first = watches_.upper_bound({ space, begin });
+    if (first != watches_.begin() && std::prev(first)->first.first == space && std::prev(first)->second.end >= begin) {
+      --first;
+    }
+
+    auto last = first;
+    for (; last != watches_.end() && last->first.first == space && last->first.second <= end; ++last) {
+      begin = std::min(begin, last->first.second);
+      end = std::max(end, last->second.end);
+    }
+
+    if (end - begin > settings_.max_watched_bytes) {
+      return false;
+    }
+
+    for (auto it = first; it != last; ) {
+      watched_bytes_ -= it->second.end - it->first.second;
+      it = watches_.erase(it);
+    }
+
+    auto now = Clock::gettime(CLOCK_MONOTONIC);
+    watches_[{ space, begin }] = { end, now };
+    watched_bytes_ += end - begin;
+    watches_dirty_ = true;
+
+    // Evict the least recently read watches if too much is watched
+    while (watched_bytes_ > settings_.max_watched_bytes && watches_.size() > 1) {
+      auto lru = watches_.end();
+      for (auto w = watches_.begin(); w != watches_.end(); ++w) {
+        if (w->first != Watch_Key(space, begin) && (lru == watches_.end() || w->second.last_used < lru->second.last_used)) {
+          lru = w;
+        }
+      }
+      watched_bytes_ -= lru->second.end - lru->first.second;
+      watches_.erase(lru);
+    }
+
+    return true;
+  }
+
+  void touch_watch(Space space, std::size_t addr) {
+    auto it = watches_.upper_bound({ space, addr });
+    if (it != watches_.begin()) {
+      std::prev(it)->second.last_used = Clock::gettime(CLOCK_MONOTONIC);
+    }
+  }
+
+  void expire_watches() {
+    auto now = Clock::gettime(CLOCK_MONOTONIC);
+
+    for (auto it = watches_.begin(); it != watches_.end(); ) {
+      if (now - it->second.last_used > settings_.watch_timeout) {
+        watched_bytes_ -= it->second.end - it->first.second;
+        it = watches_.erase(it);
+        watches_dirty_ = true;
+      } else {
+        ++it;
+      }
+    }
+  }
+
+  void send_watches() {
+    if (!watches_dirty_) {
+      return;
+    }
+
+    Command command;
+    command.type = Command::Type::WATCH;
+    for (auto const & [ key, watch ] : watches_) {
+      command.watches.push_back({ key.first, key.second, watch.end });
+    }
+
+    // If the queue is full, try again next time around
+    watches_dirty_ = !commands_.push(std::move(command));
+  }
+
+  // Two characters per byte, e.g. "0A" for 10
+  static constexpr inline auto hex_table = [] {
+    std::array<char, 512> table { };
+    char const digits[] = "0123456789ABCDEF";
+    for (int i = 0; i < 256; ++i) {
+      table[2 * i] = digits[i >> 4];
+      table[2 * i + 1] = digits[i & 0xf];
+    }
+    return table;
+  }();
+
+  static char * append_hex(char * out, std::uint8_t const * data, std::size_t n, bool spaced) {
+    for (std::size_t i = 0; i < n; ++i) {
+      if (spaced) {
+        *out++ = ' ';
+      }
+      std::memcpy(out, &hex_table[2 * data[i]], 2);
+      out += 2;
+    }
+    return out;
+  }
+
+  static void append(std::vector<char> & dest, std::string_view s) {
+    dest.insert(dest.end(), s.begin(), s.end());
+  }
+
+  void send_reply(std::string_view reply, Peer const & peer) {
+    if (peer.stream) {
+      auto it = connections_.find(peer.stream);
+      if (it != connections_.end()) {
+        it->second->queue(reply);
+      }
+      return;
+    }
+
+    if (outbox_size_ == outbox_.size()) {
+      outbox_.emplace_back();
+    }
+
+    auto & out = outbox_[outbox_size_++];
+    out.peer = peer;
+    out.data.assign(reply.begin(), reply.end());
+
+    if (outbox_size_ == send_batch) {
+      flush_datagrams();
+    }
+  }
+
+  void flush() {
+    for (auto it = connections_.begin(); it != connections_.end(); ) {
+      auto id = it->first;
+      auto & conn = *it++->second;
+      if ((conn.queued() > 0 && !conn.send()) || !update_connection(id, conn)) {
+        disconnect(id);
+      }
+    }
+
+    flush_datagrams();
+  }
+
+  void flush_datagrams() {
+    if (outbox_size_ == 0) {
+      return;
+    }
+
+    std::array<mmsghdr, send_batch> msgs;
+    std::array<iovec, send_batch> iovs;
+
+    for (std::size_t i = 0; i < outbox_size_; ++i) {
+      auto & out = outbox_[i];
+      iovs[i] = { out.data.data(), out.data.size() };
+      std::memset(&msgs[i], 0, sizeof(msgs[i]));
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_name = &out.peer.addr;
+      msgs[i].msg_hdr.msg_namelen = out.peer.addr_len;
+    }
+
+    // Like any UDP send, replies that don't fit in the socket buffer
+    // are dropped
+    for (std::size_t sent = 0; sent < outbox_size_; ) {
+      int n = sendmmsg(sock_, msgs.data() + sent, outbox_size_ - sent, MSG_DONTWAIT);
+      if (n <= 0) {
+        break;
+      }
+      sent += n;
+    }
+
+    outbox_size_ = 0;
+  }
+
+private:
+  static constexpr std::size_t max_bytes = 2000;
+  static constexpr std::size_t max_datagram = 65000;
+
+  Settings settings_;
+
+  int sock_ = -1;
+  int tcp_ = -1;
+  int unix_ = -1;
+  int wake_ = -1;
+  int epoll_ = -1;
+
+  std::atomic<bool> done_ = false;
+  std::atomic<bool> paused_ = false;
+  std::atomic<bool> have_memory_map_ = false;
+  std::atomic<std::uint64_t> commands_handled_ = 0;
+  std::atomic<std::uint64_t> commands_dropped_ = 0;
+
+  SpscQueue<Command> commands_;
+  SpscQueue<Event> events_;
+
+  // Only touched by the network thread
+  std::vector<char> recv_buf_;
+  std::vector<std::string_view> cmds_;
+  std::vector<std::string_view> args_;
+  std::vector<char> reply_;
+  std::vector<Outgoing> outbox_;
+  std::size_t outbox_size_ = 0;
+  std::unique_ptr<Snapshot> snapshot_;
+  std::map<Watch_Key, Watch> watches_;
+  std::size_t watched_bytes_ = 0;
+  bool watches_dirty_ = false;
+  std::vector<Pending> pending_;
+  std::vector<Subscription> subscriptions_;
+  std::map<std::uint64_t, std::unique_ptr<Connection>> connections_;
+  std::uint64_t next_connection_ = first_connection;
+  char * push_end_ = nullptr;
+  std::size_t push_header_ = 0;
+  std::size_t push_runs_ = 0;
+
+  std::thread th_;
+};
+
+}
@@ -0,0 +1,133 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+namespace fenestra::netcmds {
+
+// READ_CORE_RAM addresses system ram followed by save ram, and
+// READ_CORE_MEMORY addresses the core's memory map
+enum class Space : std::uint8_t { RAM, MEMORY };
+
+struct Range {
+  Space space;
+  std::size_t begin;
+  std::size_t end;
+};
+
+// A copy of the watched memory ranges, taken by the game thread between
+// frames and read by the network thread.  Only the parts of a range
+// that were mapped are stored.
+class Snapshot {
+public:
+  void clear(std::uint64_t frame) {
+    frame_ = frame;
+    ranges_.clear();
+    runs_.clear();
+    data_.clear();
+  }
+
+  std::uint64_t frame() const { return frame_; }
+
+  std::size_t bytes() const { return data_.size(); }
+
+  auto const & ranges() const { return ranges_; }
+
+  // Ranges must be added in order, without overlapping.  read(addr,
+  // bytes, fn) must call fn(addr, ptr, n) for each mapped piece of the
+  // range, in order.
+  template<typename Read>
+  void add(Range const & range, Read && read) {
+    ranges_.push_back(range);
+
+    read(range.space, range.begin, range.end - range.begin, [&](std::size_t addr, std::uint8_t const * p, std::size_t n) {
+      if (!runs_.empty() && runs_.back().space == range.space && runs_.back().end == addr) {
+        runs_.back().end += n;
+      } else {
+        runs_.push_back({ range.space, addr, addr + n, data_.size() });
+      }
+      data_.insert(data_.end(), p, p + n);
+    });
+  }
+
+  bool covers(Space space, std::size_t addr, std::size_t bytes) const {
+    if (bytes == 0) {
+      return true;
+    }
+
+    auto it = find(ranges_, space, addr);
+    return it != ranges_.end() && addr + bytes <= it->end;
+  }
+
+  // Calls fn(ptr, n) for each piece of [addr, addr + bytes), stopping
+  // at the first byte that was not mapped, and returns the number of
+  // bytes read
+  template<typename F>
+  std::size_t read(Space space, std::size_t addr, std::size_t bytes, F && fn) const {
+    std::size_t done = 0;
+
+    for (auto it = find(runs_, space, addr); done < bytes && it != runs_.end(); ++it) {
+      if (it->space != space || it->begin > addr + done) {
+        break;
+      }
+
+      auto n = std::min(bytes - done, it->end - (addr + done));
+      fn(data_.data() + it->offset + (addr + done - it->begin), n);
+      done += n;
+    }
+
+    return done;
+  }
+
+  // Calls fn(addr, ptr, n) for each mapped piece of [addr, addr + bytes)
+  template<typename F>
+  void for_each(Space space, std::size_t addr, std::size_t bytes, F && fn) const {
+    auto end = addr + bytes;
+    auto it = find(runs_, space, addr);
+
+    if (it == runs_.end()) {
+      it = std::upper_bound(runs_.begin(), runs_.end(), std::make_pair(space, addr), [](auto const & k, auto const & r) {
+        return k < std::make_pair(r.space, r.begin);
+      });
+    }
+
+    for (; it != runs_.end() && it->space == space && it->begin < end; ++it) {
+      auto b = std::max(addr, it->begin);
+      auto e = std::min(end, it->end);
+      fn(b, data_.data() + it->offset + (b - it->begin), e - b);
+    }
+  }
+
+private:
+  struct Run {
+    Space space;
+    std::size_t begin;
+    std::size_t end;
+    std::size_t offset;
+  };
+
+  template<typename V>
+  static typename V::const_iterator find(V const & v, Space space, std::size_t addr) {
+    auto key = std::make_pair(space, addr);
+    auto it = std::upper_bound(v.begin(), v.end(), key, [](auto const & k, auto const & r) {
+      return k < std::make_pair(r.space, r.begin);
+    });
+
+    if (it == v.begin()) {
+      return v.end();
+    }
+
+    --it;
+    return it->space == space && addr < it->end ? it : v.end();
+  }
+
+  std::uint64_t frame_ = 0;
+  std::vector<Range> ranges_;
+  std::vector<Run> runs_;
+  std::vector<std::uint8_t> data_;
+};
+
+}
@@ -0,0 +1,357 @@
+#include "libretro.h"
+
+#include <cstdint>
+#include <cstring>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <time.h>
+
+// A libretro core that does a configurable, deterministic amount of
+// work each frame, for benchmarking fenestra itself rather than an
+// emulator.  The "game" is a text file of key=value settings, e.g.:
+//
+//   width=320
+//   height=240
+//   format=XRGB8888     # 0RGB1555, RGB565 or XRGB8888
+//   pitch_padding=0     # extra bytes at the end of each row
+//   fps=60
+//   spin_us=2000        # busy-wait this long in each retro_run
+//   sample_rate=48000
+//   audio=batch         # batch, single or none
+//   state_size=1048576  # bytes returned by retro_serialize
+//   sram_size=8192
+//   sram_writes=16      # SRAM bytes changed per frame
+//
+// Everything the core outputs depends only on the settings, the frame
+// count and the input, so two runs with the same input movie produce
+// identical frames, audio, states and SRAM.
+//
+// The machine state is exposed as system RAM at address 0, and SRAM
+// (if its size is a power of two) at 0x100000, through a memory map.
+
+namespace {
+
+struct Settings {
+  unsigned int width = 320;
+  unsigned int height = 240;
+  retro_pixel_format format = RETRO_PIXEL_FORMAT_XRGB8888;
+  unsigned int pitch_padding = 0;
+  double fps = 60;
+  unsigned int spin_us = 0;
+  double sample_rate = 48000;
+  std::string audio = "batch";
+  std::size_t state_size = 64 * 1024;
+  std::size_t sram_size = 8 * 1024;
+  unsigned int sram_writes = 0;
+
+  bool parse(char const * data, std::size_t size) {
+    std::stringstream strm(std::string(data, size));
+    std::string line;
+
+    while (std::getline(strm, line)) {
+      line = line.substr(0, line.find('#'));
+      auto eq = line.find('=');
+      if (eq == std::string::npos) {
+        continue;
+      }
+
+      auto trim = [](std::string s) {
+        s.erase(0, s.find_first_not_of(" \t\r"));
+        s.erase(s.find_last_not_of(" \t\r") + 1);
+        return s;
+      };
+
+      auto key = trim(line.substr(0, eq));
+      auto value = trim(line.substr(eq + 1));
+
+      if (key == "width") width = std::stoul(value);
+      else if (key == "height") height = std::stoul(value);
+      else if (key == "pitch_padding") pitch_padding = std::stoul(value);
+      else if (key == "fps") fps = std::stod(value);
+      else if (key == "spin_us") spin_us = std::stoul(value);
+      else if (key == "sample_rate") sample_rate = std::stod(value);
+      else if (key == "audio") audio = value;
+      else if (key == "state_size") state_size = std::stoull(value);
+      else if (key == "sram_size") sram_size = std::stoull(value);
+      else if (key == "sram_writes") sram_writes = std::stoul(value);
+      else if (key == "format") {
+        if (value == "0RGB1555") format = RETRO_PIXEL_FORMAT_0RGB1555;
+        else if (value == "RGB565") format = RETRO_PIXEL_FORMAT_RGB565;
+        else if (value == "XRGB8888") format = RETRO_PIXEL_FORMAT_XRGB8888;
+        else return false;
+      } else {
+        return false;
+      }
+    }
+
+    return width > 0 && height > 0 && fps > 0 && state_size >= sizeof(std::uint64_t) * 4;
+  }
+};
+
+// Everything that is saved in a state
+struct Machine {
+  std::uint64_t frame = 0;
+  std::uint64_t rng = 0x9E3779B97F4A7C15ULL;
+  std::uint64_t audio_phase = 0;
+  std::uint64_t input = 0;
+
+  std::uint64_t next() {
+    // xorshift64*
+    rng ^= rng >> 12;
+    rng ^= rng << 25;
+    rng ^= rng >> 27;
+    return rng * 0x2545F4914F6CDD1DULL;
+  }
+};
+
+retro_environment_t environment;
+retro_video_refresh_t video_refresh;
+retro_audio_sample_t audio_sample;
+retro_audio_sample_batch_t audio_sample_batch;
+retro_input_poll_t input_poll;
+retro_input_state_t input_state;
+
+Settings settings;
+Machine machine;
+std::vector<std::uint8_t> framebuffer;
+std::vector<std::uint8_t> sram;
+std::vector<std::int16_t> audio;
+
+std::size_t bytes_per_pixel() {
+  return settings.format == RETRO_PIXEL_FORMAT_XRGB8888 ? 4 : 2;
+}
+
+std::size_t pitch() {
+  return settings.width * bytes_per_pixel() + settings.pitch_padding;
+}
+
+void spin(unsigned int us) {
+  timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  auto end_ns = start.tv_sec * 1'000'000'000LL + start.tv_nsec + us * 1000LL;
+
+  do {
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  } while (now.tv_sec * 1'000'000'000LL + now.tv_nsec < end_ns);
+}
+
+void read_input() {
+  input_poll();
+
+  machine.input = 0;
+  for (unsigned int port = 0; port < 2; ++port) {
+    for (unsigned int id = 0; id <= RETRO_DEVICE_ID_JOYPAD_R3; ++id) {
+      if (input_state(port, RETRO_DEVICE_JOYPAD, 0, id)) {
+        machine.input |= std::uint64_t(1) << (port * 16 + id);
+      }
+    }
+  }
+}
+
+// Moving bars, offset by the input, plus a few pixels of noise so
+// every frame differs from the last
+void draw() {
+  auto Bpp = bytes_per_pixel();
+  auto shift = machine.frame + machine.input;
+
+  for (unsigned int y = 0; y < settings.height; ++y) {
+    auto * row = framebuffer.data() + y * pitch();
+    for (unsigned int x = 0; x < settings.width; ++x) {
+      std::uint32_t c = ((x + shift) / 8 * 0x1f3d5b79u) ^ (y / 8 * 0x9e3779b9u);
+      std::memcpy(row + x * Bpp, &c, Bpp);
+    }
+  }
+
+  for (int i = 0; i < 16; ++i) {
+    auto r = machine.next();
+    auto x = r % settings.width;
+    auto y = (r >> 32) % settings.height;
+    std::memset(framebuffer.data() + y * pitch() + x * Bpp, r >> 16, Bpp);
+  }
+}
+
+void play_audio() {
+  // Derived from the frame count, so e.g. 48000 Hz at 60.0988 fps
+  // averages out to the right rate, and states don't need to carry a
+  // remainder
+  auto samples_before = [](std::uint64_t frame) {
+    return std::uint64_t(frame * settings.sample_rate / settings.fps);
+  };
+  auto frames = std::size_t(samples_before(machine.frame + 1) - samples_before(machine.frame));
+
+  audio.resize(frames * 2);
+  for (std::size_t i = 0; i < frames; ++i) {
+    // A square wave whose pitch depends on the input
+    auto period = 100 + (machine.input & 0xff);
+    std::int16_t sample = (machine.audio_phase++ / (period / 2)) % 2 ? 4000 : -4000;
+    audio[2 * i] = sample;
+    audio[2 * i + 1] = -sample;
+  }
+
+  if (settings.audio == "batch") {
+    audio_sample_batch(audio.data(), frames);
+  } else if (settings.audio == "single") {
+    for (std::size_t i = 0; i < frames; ++i) {
+      audio_sample(audio[2 * i], audio[2 * i + 1]);
+    }
+  }
+}
+
+void write_sram() {
+  for (unsigned int i = 0; i < settings.sram_writes && !sram.empty(); ++i) {
+    auto r = machine.next();
+    sram[r % sram.size()] = r >> 56;
+  }
+}
+
+}
+
+void retro_set_environment(retro_environment_t cb) {
+  environment = cb;
+}
+
+void retro_set_video_refresh(retro_video_refresh_t cb) { video_refresh = cb; }
+void retro_set_audio_sample(retro_audio_sample_t cb) { audio_sample = cb; }
+void retro_set_audio_sample_batch(retro_audio_sample_batch_t cb) { audio_sample_batch = cb; }
+void retro_set_input_poll(retro_input_poll_t cb) { input_poll = cb; }
+void retro_set_input_state(retro_input_state_t cb) { input_state = cb; }
+
+void retro_init() { }
+void retro_deinit() { }
+
+unsigned int retro_api_version() {
+  return RETRO_API_VERSION;
+}
+
+void retro_get_system_info(retro_system_info * info) {
+  std::memset(info, 0, sizeof(*info));
+  info->library_name = "fenestra-testcore";
+  info->library_version = "1";
+  info->valid_extensions = "cfg|txt";
+  info->need_fullpath = false;
+  info->block_extract = false;
+}
+
+void retro_get_system_av_info(retro_system_av_info * info) {
+  std::memset(info, 0, sizeof(*info));
+  info->geometry.base_width = settings.width;
+  info->geometry.base_height = settings.height;
+  info->geometry.max_width = settings.width;
+  info->geometry.max_height = settings.height;
+  info->geometry.aspect_ratio = float(settings.width) / settings.height;
+  info->timing.fps = settings.fps;
+  info->timing.sample_rate = settings.sample_rate;
+}
+
+void retro_set_controller_port_device(unsigned int port, unsigned int device) { }
+
+void retro_reset() {
+  machine = Machine();
+}
+
+void retro_run() {
+  read_input();
+  spin(settings.spin_us);
+  draw();
+  video_refresh(framebuffer.data(), settings.width, settings.height, pitch());
+  play_audio();
+  write_sram();
+  ++machine.frame;
+}
+
+std::size_t retro_serialize_size() {
+  return settings.state_size;
+}
+
+// The machine, followed by filler derived from the frame count, so the
+// state changes every frame but still compresses like a real one
+bool retro_serialize(void * data, std::size_t size) {
+  if (size < settings.state_size) {
+    return false;
+  }
+
+  auto * p = static_cast<std::uint8_t *>(data);
+  std::memcpy(p, &machine, sizeof(machine));
+  for (std::size_t i = sizeof(machine); i < settings.state_size; ++i) {
+    p[i] = (i / 64 + machine.frame * (i % 7 == 0)) & 0xff;
+  }
+  return true;
+}
+
+bool retro_unserialize(void const * data, std::size_t size) {
+  if (size < sizeof(machine)) {
+    return false;
+  }
+
+  std::memcpy(&machine, data, sizeof(machine));
+  return true;
+}
+
+void retro_cheat_reset() { }
+void retro_cheat_set(unsigned int index, bool enabled, char const * code) { }
+
+bool retro_load_game(retro_game_info const * game) {
+  if (!game || !game->data) {
+    return false;
+  }
+
+  try {
+    if (!settings.parse(static_cast<char const *>(game->data), game->size)) {
+      return false;
+    }
+  } catch(std::exception const &) {
+    return false;
+  }
+
+  auto format = settings.format;
+  if (!environment(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &format)) {
+    return false;
+  }
+
+  framebuffer.assign(pitch() * settings.height, 0);
+  sram.assign(settings.sram_size, 0);
+  machine = Machine();
+
+  static retro_memory_descriptor descriptors[2];
+  std::memset(descriptors, 0, sizeof(descriptors));
+  descriptors[0].ptr = &machine;
+  descriptors[0].len = sizeof(machine);
+  descriptors[1].ptr = sram.data();
+  descriptors[1].start = 0x100000;
+  descriptors[1].len = sram.size();
+
+  bool sram_mappable = !sram.empty() && (sram.size() & (sram.size() - 1)) == 0 && sram.size() <= 0x100000;
+  retro_memory_map map { descriptors, sram_mappable ? 2u : 1u };
+  environment(RETRO_ENVIRONMENT_SET_MEMORY_MAPS, &map);
+
+  return true;
+}
+
+bool retro_load_game_special(unsigned int type, retro_game_info const * info, std::size_t num) {
+  return false;
+}
+
+void retro_unload_game() { }
+
+unsigned int retro_get_region() {
+  return RETRO_REGION_NTSC;
+}
+
+void * retro_get_memory_data(unsigned int id) {
+  switch (id) {
+    case RETRO_MEMORY_SAVE_RAM: return sram.empty() ? nullptr : sram.data();
+    case RETRO_MEMORY_SYSTEM_RAM: return &machine;
+    default: return nullptr;
+  }
+}
+
+std::size_t retro_get_memory_size(unsigned int id) {
+  switch (id) {
+    case RETRO_MEMORY_SAVE_RAM: return sram.size();
+    case RETRO_MEMORY_SYSTEM_RAM: return sizeof(machine);
+    default: return 0;
+  }
+}
@@ -0,0 +1,63 @@
+#include "fenestra/MemoryMap.hpp"
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+
+// Checks that invalid memory descriptors are skipped without losing the
+// valid ones around them
+
+using namespace fenestra;
+
+namespace {
+
+int failures = 0;
+
+void expect(bool ok, std::string const & what) {
+  if (!ok) {
+    std::cout << "FAIL: " << what << std::endl;
+    ++failures;
+  }
+}
+
+}
+
+int main() {
+  static std::uint8_t ram[0x2000];
+  static std::uint8_t bad[0x3000];
+  static std::uint8_t sram[0x8000];
+
+  retro_memory_descriptor descriptors[] = {
+    { 0, ram, 0, 0x0, 0, 0, sizeof(ram), nullptr },
+
+    // No select, and a len that isn't a power of two
+    { 0, bad, 0, 0x4000, 0, 0, sizeof(bad), nullptr },
+
+    // A start with bits outside of select
+    { 0, bad, 0, 0x2001, 0xfff000, 0, 0x1000, nullptr },
+
+    { 0, sram, 0, 0x100000, 0, 0, sizeof(sram), nullptr },
+  };
+
+  retro_memory_map map { descriptors, 4 };
+  MemoryMap memory_map(map);
+
+  expect(memory_map.descriptors().size() == 2, "two descriptors are kept");
+
+  auto t = memory_map.translate(0x10);
+  expect(t.ptr == ram + 0x10 && t.bytes == sizeof(ram) - 0x10, "RAM is mapped");
+
+  t = memory_map.translate(0x100010);
+  expect(t.ptr == sram + 0x10 && t.bytes == sizeof(sram) - 0x10, "SRAM is mapped");
+
+  t = memory_map.translate(0x4000);
+  expect(t.ptr == nullptr, "the invalid descriptor's range is unmapped");
+
+  if (failures) {
+    std::cout << failures << " failed" << std::endl;
+    return 1;
+  }
+
+  std::cout << "memorymap: all passed" << std::endl;
+  return 0;
+}
@@ -0,0 +1,81 @@
+#include "fenestra/plugins/netcmds/Server.hpp"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <iostream>
+#include <string>
+
+// Sends commands to a netcmds server over UDP and checks the replies
+
+using namespace fenestra;
+
+namespace {
+
+constexpr int port = 55399;
+
+int failures = 0;
+
+std::string command(int fd, std::string const & cmd) {
+  sockaddr_in addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+
+  if (sendto(fd, cmd.data(), cmd.size(), 0, (sockaddr const *)&addr, sizeof(addr)) < 0) {
+    return "(send failed)";
+  }
+
+  char buf[65536];
+  auto n = recv(fd, buf, sizeof(buf), 0);
+  return n < 0 ? "(no reply)" : std::string(buf, n);
+}
+
+void expect(int fd, std::string const & cmd, std::string const & reply) {
+  auto actual = command(fd, cmd);
+  if (actual != reply) {
+    std::cout << "FAIL: " << cmd << "\n  expected: " << reply << "  got:      " << actual << std::endl;
+    ++failures;
+  }
+}
+
+}
+
+int main() {
+  netcmds::Server::Settings settings;
+  settings.udp_port = port;
+  settings.watch_timeout = Seconds(10);
+  settings.max_watched_bytes = 1024 * 1024;
+  settings.subscription_timeout = Seconds(10);
+  settings.max_output = 1024 * 1024;
+
+  netcmds::Server server(settings);
+
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  timeval timeout { 1, 0 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  expect(fd, "SUBSCRIBE_CORE_MEMORY 0 16", "SUBSCRIBE_CORE_MEMORY 16\n");
+
+  // Sizes that would wrap the total or the end of a range around
+  expect(fd, "SUBSCRIBE_CORE_MEMORY 0 18446744073709551615 0 1", "SUBSCRIBE_CORE_MEMORY -1 too much memory\n");
+  expect(fd, "SUBSCRIBE_CORE_MEMORY 0 1048576 0 18446744073709551615", "SUBSCRIBE_CORE_MEMORY -1 too much memory\n");
+  expect(fd, "SUBSCRIBE_CORE_MEMORY ffffffffffffffff 2", "SUBSCRIBE_CORE_MEMORY -1 too much memory\n");
+  expect(fd, "SUBSCRIBE_CORE_MEMORY 0 1048577", "SUBSCRIBE_CORE_MEMORY -1 too much memory\n");
+
+  expect(fd, "UNSUBSCRIBE_CORE_MEMORY", "UNSUBSCRIBE_CORE_MEMORY\n");
+
+  close(fd);
+
+  if (failures) {
+    std::cout << failures << " failed" << std::endl;
+    return 1;
+  }
+
+  std::cout << "netcmds: all passed" << std::endl;
+  return 0;
+}
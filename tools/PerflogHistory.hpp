@@ -0,0 +1,116 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+// Every value of a counter since the log was opened, for looking further
+// back than PerflogReader::PerfQueue's window.  Besides the values, it
+// keeps the min, max and total of each aligned block of 2^k values (for
+// every k from block_shift up), so summarizing a range -- like the
+// frames in one pixel column of a plot of a few hours -- looks at
+// O(log n) blocks, plus at most a block's worth of values at each end.
+class PerflogHistory {
+public:
+  struct Summary {
+    std::uint32_t min = std::numeric_limits<std::uint32_t>::max();
+    std::uint32_t max = 0;
+    std::uint64_t total = 0;
+    std::uint64_t count = 0;
+
+    void add(std::uint32_t value) {
+      min = std::min(min, value);
+      max = std::max(max, value);
+      total += value;
+      ++count;
+    }
+
+    void add(Summary const & other) {
+      min = std::min(min, other.min);
+      max = std::max(max, other.max);
+      total += other.total;
+      count += other.count;
+    }
+
+    std::uint64_t avg() const { return count == 0 ? 0 : total / count; }
+  };
+
+  static constexpr inline unsigned int block_shift = 6;
+
+  std::uint64_t size() const { return values_.size(); }
+
+  void record(std::uint32_t value) {
+    values_.push_back(value);
+
+    // Each block this value completes is made of the two blocks below
+    // it, which are the last two of their level
+    auto n = values_.size();
+    for (unsigned int k = block_shift; n % (std::uint64_t(1) << k) == 0; ++k) {
+      auto level = k - block_shift;
+      if (level == levels_.size()) {
+        levels_.emplace_back();
+      }
+
+      Summary s;
+      if (level == 0) {
+        for (auto i = n - (std::uint64_t(1) << k); i < n; ++i) {
+          s.add(values_[i]);
+        }
+      } else {
+        auto const & below = levels_[level - 1];
+        s = below[below.size() - 2];
+        s.add(below.back());
+      }
+
+      levels_[level].push_back(s);
+    }
+  }
+
+  Summary summary(std::uint64_t begin, std::uint64_t end) const {
+    Summary s;
+    end = std::min(end, size());
+
+    while (begin < end) {
+      std::uint64_t block = std::uint64_t(1) << block_shift;
+
+      if (begin % block != 0 || begin + block > end) {
+        auto stop = std::min(end, (begin / block + 1) * block);
+        for (; begin < stop; ++begin) {
+          s.add(values_[begin]);
+        }
+        continue;
+      }
+
+      // The biggest block that starts at begin and fits in the range
+      auto shift = std::min<unsigned int>(__builtin_ctzll(begin | (std::uint64_t(1) << 63)), block_shift + levels_.size() - 1);
+      while (begin + (std::uint64_t(1) << shift) > end) {
+        --shift;
+      }
+
+      s.add(levels_[shift - block_shift][begin >> shift]);
+      begin += std::uint64_t(1) << shift;
+    }
+
+    return s;
+  }
+
+  // Calls fn(column, summary) for each of the given number of columns
+  // [begin, end) is split into (columns with no values are skipped)
+  template<typename Fn>
+  void decimate(std::uint64_t begin, std::uint64_t end, std::size_t columns, Fn && fn) const {
+    auto span = end - begin;
+    for (std::size_t c = 0; c < columns; ++c) {
+      auto b = begin + span * c / columns;
+      auto e = begin + span * (c + 1) / columns;
+      auto s = summary(b, e);
+      if (s.count > 0) {
+        fn(c, s);
+      }
+    }
+  }
+
+private:
+  std::vector<std::uint32_t> values_;
+  std::vector<std::vector<Summary>> levels_;
+};
@@ -1,31 +1,44 @@
 #pragma once
 
 #include "fenestra/Clock.hpp"
+#include "fenestra/PerflogShm.hpp"
+
+#include "PerflogHistory.hpp"
 
 #include <stdexcept>
 #include <string>
 #include <vector>
-#include <deque>
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <iostream>
 #include <iomanip>
+#include <memory>
+#include <thread>
 
 #include <sys/stat.h>
 #include <unistd.h>
 
+// Reads a perflog file as it is written, or a perflog shm file (see
+// fenestra::PerflogShm), which shows each frame as soon as it is
+// recorded.  With keep_history, every value read is also kept in a
+// PerflogHistory per queue, for looking back further than a queue's
+// window.
 class PerflogReader {
 public:
   class PerfQueue;
 
-  PerflogReader(std::string const & filename)
+  PerflogReader(std::string const & filename, bool keep_history = false)
     : filename_(filename)
+    , keep_history_(keep_history)
   {
     this->stat();
     last_stat_time_ = fenestra::Clock::gettime(CLOCK_REALTIME);
   }
 
   auto const & queues() const { return queues_; }
+  auto const & histories() const { return histories_; }
   auto time() const { return time_; }
 
   void poll() {
@@ -35,14 +48,7 @@ public:
       last_stat_time_ = now;
     }
 
-    file_.clear();
-    file_.seekg(last_pos_);
-
-    std::int64_t time;
-    std::vector<std::uint32_t> deltas;
-    while (read_record(&time, &deltas)) {
-      handle(time, deltas);
-    }
+    read_records();
   }
 
 private:
@@ -66,14 +72,36 @@ private:
 
   void open(std::string const & filename) {
     queues_.clear();
+    histories_.clear();
 
+    shm_.reset();
     file_.close();
-    file_.open(filename);
     filename_ = filename;
 
     std::string line;
-    std::getline(file_, line);
-    last_pos_ = file_.tellg();
+
+    // A writer that has only just created its shm file will store the
+    // magic in a moment
+    for (int i = 0; i < 100 && fenestra::PerflogShm::is_pending(filename); ++i) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+
+    if (fenestra::PerflogShm::is_pending(filename)) {
+      // Not ready yet: leave it empty, and stat() opens it again while
+      // there are no queues
+      std::cout << "Waiting for " << filename << std::endl;
+    } else if (fenestra::PerflogShm::is_shm(filename)) {
+      shm_ = std::make_unique<fenestra::PerflogShm>(filename);
+      line = shm_->names();
+
+      // Start with the oldest record still in the ring
+      auto written = shm_->written();
+      shm_next_ = written > shm_->capacity() ? written - shm_->capacity() : 0;
+    } else {
+      file_.open(filename);
+      std::getline(file_, line);
+      last_pos_ = file_.tellg();
+    }
 
     std::string name;
     bool first = true;
@@ -95,48 +123,78 @@ private:
     frames_ = 0;
     record_size_ = 8 + n_deltas * 4; // 64-bit time, 32-bit deltas
 
+    if (shm_ && shm_->record_size() != record_size_) {
+      throw std::runtime_error("perflog shm record size does not match its header");
+    }
+
     if (n_deltas > 0) {
       queues_.emplace(queues_.begin(), "FPS");
       queues_.emplace(queues_.begin(), "Frame Time");
     }
 
-    std::int64_t time;
-    std::vector<std::uint32_t> deltas;
-    while (read_record(&time, &deltas)) {
-      handle(time, deltas);
+    if (keep_history_) {
+      histories_.resize(queues_.size());
     }
+
+    read_records();
   }
 
-  bool read_record(std::int64_t * time, std::vector<std::uint32_t> * deltas) {
-    buf_.clear();
-    buf_.resize(record_size_);
-    file_.read(buf_.data(), record_size_);
+  void read_records() {
+    if (shm_) {
+      auto written = shm_->written();
 
-    if (file_) {
-      auto const * p = buf_.data();
-      auto const * end = p + buf_.size();
-      *time = reinterpret_cast<std::uint64_t const &>(*p);
-      p += sizeof(std::uint64_t);
+      // Records this far behind have already been overwritten
+      if (written - shm_next_ > shm_->capacity()) {
+        shm_next_ = written - shm_->capacity();
+      }
 
-      deltas->clear();
-      for (; p < end; p += sizeof(std::uint32_t)) {
-        deltas->push_back(reinterpret_cast<std::uint32_t const &>(*p));
+      buf_.resize(record_size_);
+      for (; shm_next_ < written; ++shm_next_) {
+        if (shm_->read(shm_next_, buf_.data())) {
+          handle(buf_.data());
+        }
       }
+    } else {
+      file_.clear();
+      file_.seekg(last_pos_);
+
+      // Read whole records, many at a time; a partly written record is
+      // read again on the next poll
+      buf_.resize(record_size_ * batch_records);
+      for (;;) {
+        file_.read(buf_.data(), buf_.size());
+        auto n = std::size_t(file_.gcount()) / record_size_;
+
+        for (std::size_t i = 0; i < n; ++i) {
+          handle(buf_.data() + i * record_size_);
+        }
 
-      last_pos_ = file_.tellg();
-      return true;
-    }
+        last_pos_ += n * record_size_;
 
-    return false;
+        if (!file_) {
+          break;
+        }
+      }
+    }
   }
 
-  void handle(std::uint64_t time, std::vector<std::uint32_t> const & deltas);
+  // A record is a 64-bit time followed by a 32-bit value for each
+  // counter
+  void handle(char const * record);
+
+  void record_value(std::size_t idx, std::uint32_t value);
 
 private:
   std::string filename_;
+  bool keep_history_;
   std::ifstream file_;
+  static constexpr inline std::size_t batch_records = 256;
+
   std::ifstream::pos_type last_pos_;
+  std::unique_ptr<fenestra::PerflogShm> shm_;
+  std::uint64_t shm_next_ = 0;
   std::vector<PerfQueue> queues_;
+  std::vector<PerflogHistory> histories_;
   std::size_t record_size_ = 0;
   std::vector<char> buf_;
   std::uint64_t time_ = 0;
@@ -145,44 +203,111 @@ private:
   struct stat statbuf_ { 0, 0 }; // dev, inode
 };
 
+// The last max_frames values of a counter.  Each value is stored twice,
+// max_frames apart, so the window is always one contiguous array no
+// matter where the ring wraps.  The total, min and max of the window are
+// kept up to date as values are added (min and max with monotonic
+// queues), so none of them has to look at every value.
 class PerflogReader::PerfQueue {
 public:
+  static constexpr inline std::size_t max_secs = 60;
+  static constexpr inline std::size_t max_frames = 60 * max_secs;
+
   PerfQueue(std::string const & name)
     : name_(name)
+    , values_(2 * max_frames)
   {
   }
 
   auto const & name() const { return name_; }
 
-  static constexpr inline std::size_t max_secs = 60;
-  static constexpr inline std::size_t max_frames = 60 * max_secs;
+  void record(std::uint32_t value) {
+    auto seq = count_++;
+    auto pos = seq % max_frames;
+    auto oldest = seq < max_frames ? 0 : seq + 1 - max_frames;
 
-  void record(std::uint32_t delta) {
-    total_ += delta;
-    deltas_.push_back(delta);
-    if (deltas_.size() > max_frames) {
-      total_ -= deltas_.front();
-      deltas_.pop_front();
+    if (seq >= max_frames) {
+      total_ -= values_[pos];
     }
+
+    values_[pos] = value;
+    values_[pos + max_frames] = value;
+    total_ += value;
+
+    mins_.push(seq, oldest, [&](auto s) { return value <= at(s); });
+    maxes_.push(seq, oldest, [&](auto s) { return value >= at(s); });
   }
 
   auto total() const { return total_; }
-  auto avg() const { return deltas_.size() == 0 ? 0 : total_ / deltas_.size(); }
-  auto size() const { return deltas_.size(); }
-  auto begin() const { return deltas_.begin(); }
-  auto end() const { return deltas_.end(); }
+  auto avg() const { return size() == 0 ? 0 : total_ / size(); }
+  std::uint32_t min() const { return size() == 0 ? 0 : at(mins_.front()); }
+  std::uint32_t max() const { return size() == 0 ? 0 : at(maxes_.front()); }
+
+  // The number of values recorded, including those no longer in the
+  // window
+  std::uint64_t count() const { return count_; }
+  std::size_t size() const { return std::min<std::uint64_t>(count_, max_frames); }
+  std::uint32_t const * begin() const { return values_.data() + (count_ - size()) % max_frames; }
+  std::uint32_t const * end() const { return begin() + size(); }
 
-  auto operator[](std::size_t i) const { return deltas_[i]; }
+  auto operator[](std::size_t i) const { return begin()[i]; }
 
 private:
+  std::uint32_t at(std::uint64_t seq) const { return values_[seq % max_frames]; }
+
+  // The sequence numbers of the values that could still become the
+  // window's min (or max), in order; the front is the current one
+  class MonotonicQueue {
+  public:
+    MonotonicQueue()
+      : seqs_(max_frames)
+    {
+    }
+
+    // Drops the values that have left the window and the ones the new
+    // value supersedes (dominated(seq) is true), then adds it
+    template <typename Fn>
+    void push(std::uint64_t seq, std::uint64_t oldest, Fn && dominated) {
+      while (head_ < tail_ && seqs_[head_ % max_frames] < oldest) {
+        ++head_;
+      }
+
+      while (tail_ > head_ && dominated(seqs_[(tail_ - 1) % max_frames])) {
+        --tail_;
+      }
+
+      seqs_[tail_++ % max_frames] = seq;
+    }
+
+    std::uint64_t front() const { return seqs_[head_ % max_frames]; }
+
+  private:
+    std::vector<std::uint64_t> seqs_;
+    std::uint64_t head_ = 0;
+    std::uint64_t tail_ = 0;
+  };
+
   std::string name_;
-  std::deque<std::uint32_t> deltas_;
+  std::vector<std::uint32_t> values_;
+  std::uint64_t count_ = 0;
   std::uint64_t total_ = 0;
+  MonotonicQueue mins_;
+  MonotonicQueue maxes_;
 };
 
 void
 PerflogReader::
-handle(std::uint64_t time, std::vector<std::uint32_t> const & deltas) {
+record_value(std::size_t idx, std::uint32_t value) {
+  queues_[idx].record(value);
+
+  if (keep_history_) {
+    histories_[idx].record(value);
+  }
+}
+
+void
+PerflogReader::
+handle(char const * record) {
   ++frames_;
 
   // Ignore the first few frames
@@ -190,30 +315,35 @@ handle(std::uint64_t time, std::vector<std::uint32_t> const & deltas) {
     return;
   }
 
+  std::uint64_t time;
+  std::memcpy(&time, record, sizeof(time));
+
   std::uint32_t frame_time_us = 16'667;
   if (time_ > 0 && time != time_) {
     auto last_time = time_;
     auto time_delta_ns = time - last_time;
     frame_time_us = time_delta_ns / 1'000;
   }
-  queues_[0].record(frame_time_us);
+  record_value(0, frame_time_us);
 
   float fps = 60.0;
   if (queues_[0].size() >= 8) {
     // Average fps over 8 frames
-    auto it = std::prev(queues_[0].end());
     std::uint64_t eight_frame_time = 0;
-    for (std::size_t i = 0; i < 8; ++i, --it) {
+    for (auto it = queues_[0].end() - 8; it != queues_[0].end(); ++it) {
       eight_frame_time += *it;
     }
     auto avg_us = eight_frame_time / 8.0;
     auto avg_s = avg_us / 1'000'000;
     fps = 1.0 / avg_s;
   }
-  queues_[1].record(fps * 1000);
+  record_value(1, fps * 1000);
 
-  for (std::size_t i = 0; i < std::min(deltas.size(), queues_.size()); ++i) {
-    queues_[i+2].record(deltas[i]); // +2 for frame time, fps
+  auto n = std::min((record_size_ - sizeof(time)) / sizeof(std::uint32_t), queues_.size() - 2);
+  for (std::size_t i = 0; i < n; ++i) {
+    std::uint32_t value;
+    std::memcpy(&value, record + sizeof(time) + i * sizeof(value), sizeof(value));
+    record_value(i+2, value); // +2 for frame time, fps
   }
 
   time_ = time;
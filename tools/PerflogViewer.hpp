@@ -1,6 +1,7 @@
 #pragma once
 
 #include "PerflogReader.hpp"
+#include "PlotBuffer.hpp"
 
 #include <epoxy/glx.h>
 
@@ -11,6 +12,8 @@
 
 #include <ftgl.h>
 
+#include <algorithm>
+#include <cstddef>
 #include <stdexcept>
 #include <vector>
 #include <string>
@@ -45,6 +48,7 @@ public:
     SOIL_free_image_data(icon.pixels);
 
     glfwSetKeyCallback(win_, key_callback_);
+    glfwSetScrollCallback(win_, scroll_callback_);
     glfwSetWindowRefreshCallback(win_, refresh_callback_);
 
     glfwMakeContextCurrent(win_);
@@ -103,37 +107,22 @@ public:
     double column_margin = 20;
     double row_height = (height_ - top_margin - bottom_margin) / num_queues;
 
+    auto range = visible_range();
+    auto stats = this->stats(range);
+
     auto next_x = draw_metric_names(
         left_margin,
         height_ - row_height - top_margin,
         row_height);
 
     next_x = draw_averages(
+        stats,
         next_x + column_margin,
         height_ - row_height - top_margin,
         row_height);
 
-    std::vector<std::uint32_t> mins;
-    std::vector<std::uint32_t> maxes;
-
-    mins.resize(reader_.queues().size());
-    maxes.resize(reader_.queues().size());
-
-    // Calculate min/max values
-    for (std::size_t i = 0; i < reader_.queues().size(); ++i) {
-      std::uint32_t max = 0;
-      std::uint32_t min = std::numeric_limits<std::uint32_t>::max();
-      for (auto val : reader_.queues()[i]) {
-        min = std::min(val, min);
-        max = std::max(val, max);
-      }
-      mins[i] = min;
-      maxes[i] = max;
-    }
-
     next_x = draw_min_max(
-        mins,
-        maxes,
+        stats,
         next_x + column_margin,
         height_ - row_height - top_margin,
         row_height);
@@ -141,14 +130,15 @@ public:
     auto graph_width = width_ - (next_x + column_margin) - right_margin;
 
     draw_plots(
-        mins,
-        maxes,
+        range,
+        stats,
         next_x + column_margin,
         height_ - row_height - top_margin,
         row_height,
         graph_width);
 
     draw_markers(
+        range,
         next_x + column_margin,
         height_ - row_height - top_margin,
         graph_width);
@@ -156,6 +146,46 @@ public:
     return true;
   }
 
+  // The frames being looked at, by sequence number; live if they are
+  // all still in the reader's queues (and so in the plot rings)
+  struct Range {
+    std::uint64_t begin;
+    std::uint64_t end;
+    bool live;
+  };
+
+  Range visible_range() const {
+    auto const & queue = reader_.queues()[0];
+    auto count = queue.count();
+    auto end = follow_ ? count : std::min(end_, count);
+    auto span = reader_.histories().empty() ? queue.size() : span_;
+    auto begin = end - std::min(span, end);
+    return { begin, end, begin >= count - queue.size() };
+  }
+
+  std::vector<PerflogHistory::Summary> stats(Range const & range) const {
+    std::vector<PerflogHistory::Summary> stats;
+
+    for (std::size_t i = 0; i < reader_.queues().size(); ++i) {
+      auto const & queue = reader_.queues()[i];
+      PerflogHistory::Summary s;
+
+      if (range.live && range.end - range.begin == queue.size()) {
+        s = { queue.min(), queue.max(), queue.total(), queue.size() };
+      } else {
+        s = reader_.histories()[i].summary(range.begin, range.end);
+      }
+
+      if (s.count == 0) {
+        s.min = 0;
+      }
+
+      stats.push_back(s);
+    }
+
+    return stats;
+  }
+
   double draw_metric_names(double x, double y, double row_height) {
     font_.FaceSize(row_height * 0.5875);
     FTGL_DOUBLE next_x = 0;
@@ -169,13 +199,13 @@ public:
     return next_x;
   }
 
-  double draw_averages(double x, double y, double row_height) {
+  double draw_averages(std::vector<PerflogHistory::Summary> const & stats, double x, double y, double row_height) {
     font_.FaceSize(row_height * 0.5875);
     FTGL_DOUBLE next_x = 0;
-    for (auto const & queue : reader_.queues()) {
+    for (auto const & stat : stats) {
       std::stringstream strm;
       strm << std::fixed << std::setprecision(2);
-      strm << queue.avg() / 1000.0;
+      strm << stat.avg() / 1000.0;
       auto pos = font_.Render(strm.str().c_str(), -1, FTPoint(x, y, 0));
       next_x = std::max(next_x, pos.X());
       y -= row_height;
@@ -184,18 +214,16 @@ public:
     return next_x;
   }
 
-  double draw_min_max(std::vector<std::uint32_t> const & mins, std::vector<std::uint32_t> const & maxes, double x, double y, double row_height) {
+  double draw_min_max(std::vector<PerflogHistory::Summary> const & stats, double x, double y, double row_height) {
     font_.FaceSize(row_height * 0.75 / 2);
     y += row_height / 4 + row_height / 8;
     FTGL_DOUBLE next_x = 0;
-    for (std::size_t i = 0; i < reader_.queues().size(); ++i) {
+    for (auto const & stat : stats) {
       y -= row_height / 8;
-      auto min = mins[i];
-      auto max = maxes[i];
       {
         std::stringstream strm;
         strm << std::fixed << std::setprecision(2);
-        strm << max / 1000.0;
+        strm << stat.max / 1000.0;
         auto pos = font_.Render(strm.str().c_str(), -1, FTPoint(x, y, 0));
         next_x = std::max(next_x, pos.X());
         y -= 0.75 * (row_height / 2);
@@ -203,7 +231,7 @@ public:
       {
         std::stringstream strm;
         strm << std::fixed << std::setprecision(2);
-        strm << min / 1000.0;
+        strm << stat.min / 1000.0;
         auto pos = font_.Render(strm.str().c_str(), -1, FTPoint(x, y, 0));
         next_x = std::max(next_x, pos.X());
         y -= 0.75 * (row_height / 2);
@@ -214,106 +242,126 @@ public:
     return next_x;
   }
 
-  void draw_plots(std::vector<std::uint32_t> const & mins, std::vector<std::uint32_t> const & maxes, double x, double y, double row_height, double graph_width) {
+  void draw_plots(Range const & range, std::vector<PerflogHistory::Summary> const & stats, double x, double y, double row_height, double graph_width) {
     glEnableClientState(GL_VERTEX_ARRAY);
     glDisableClientState(GL_COLOR_ARRAY);
     glDisableClientState(GL_TEXTURE_COORD_ARRAY);
 
-    std::vector<GLfloat> coords;
-    std::size_t qidx = 0;
-    for (auto const & queue : reader_.queues()) {
-      auto min = mins[qidx];
-      auto max = maxes[qidx];
+    auto const & queues = reader_.queues();
 
-      if (max > 0) {
-        draw_plot(x, y, queue, min, max, row_height, graph_width, coords);
+    if (rings_.size() != queues.size()) {
+      rings_.clear();
+      for (std::size_t i = 0; i < queues.size(); ++i) {
+        rings_.emplace_back(PerflogReader::PerfQueue::max_frames);
+      }
+      decimated_ = std::vector<DecimatedPlot>(queues.size());
+      decimated_range_ = { };
+    }
+
+    // The rings are kept up to date even while they aren't drawn, so
+    // they never have to catch up all at once
+    for (std::size_t i = 0; i < queues.size(); ++i) {
+      rings_[i].update(queues[i]);
+    }
+
+    auto columns = std::size_t(graph_width);
+    if (!range.live) {
+      decimate(range, columns);
+    }
+
+    for (std::size_t i = 0; i < queues.size(); ++i) {
+      auto const & stat = stats[i];
+
+      if (stat.max > 0) {
+        auto dy = row_height * 0.8 / stat.max;
+        auto value_y = y + 0.1 * row_height - stat.min * dy;
+
+        if (range.live) {
+          auto first = range.begin - (queues[i].count() - queues[i].size());
+          auto n = range.end - range.begin;
+          rings_[i].draw_line(first, n, x, graph_width / n, value_y, dy);
+        } else {
+          decimated_[i].draw(x, graph_width / columns, value_y, dy);
+        }
       }
 
       y -= row_height;
-      ++qidx;
     }
   }
 
-  template <typename Queue>
-  void draw_plot(double x, double y, Queue const & queue, std::uint32_t min, std::uint32_t max, double row_height, double graph_width, std::vector<GLfloat> & coords) {
-    std::size_t i = 0;
-    auto num_points = queue.size();
-    coords.resize(num_points * 2);
-    for (auto val : queue) {
-      assert(i * 2 + 1 < coords.size());
-      auto pct = float(val - min) / max;
-      assert(pct >= 0.0);
-      // assert(pct <= 1.0);
-      coords[i*2] = x + float(i) / num_points * graph_width;
-      coords[i*2 + 1] = pct * row_height * 0.8 + y + 0.1 * row_height;
-      ++i;
+  // Plots each pixel column of the range as a line from its max down to
+  // its min, so a plot of a few hours is no more vertices than one of a
+  // few seconds
+  void decimate(Range const & range, std::size_t columns) {
+    if (range.begin == decimated_range_.begin && range.end == decimated_range_.end && columns == decimated_columns_) {
+      return;
     }
 
-    glVertexPointer(2, GL_FLOAT, 0, coords.data());
-    glDrawArrays(GL_LINE_STRIP, 0, coords.size() / 2);
+    std::vector<GLfloat> vertices;
+    for (std::size_t i = 0; i < decimated_.size(); ++i) {
+      vertices.clear();
+      reader_.histories()[i].decimate(range.begin, range.end, columns, [&](auto c, auto const & s) {
+        vertices.insert(vertices.end(), { GLfloat(c), GLfloat(s.max), GLfloat(c), GLfloat(s.min) });
+      });
+
+      decimated_[i].stream.upload(vertices);
+      decimated_[i].vertices = vertices.size() / 2;
+    }
+
+    decimated_range_ = range;
+    decimated_columns_ = columns;
   }
 
-  void draw_markers(double x, double y, double graph_width) {
+  void draw_markers(Range const & range, double x, double y, double graph_width) {
     glEnable(GL_BLEND);
     glEnableClientState(GL_COLOR_ARRAY);
     glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
 
-    std::vector<GLfloat> coords;
-    std::vector<GLfloat> colors;
-
-    // first queue is frame time
-    auto & queue = reader_.queues()[0];
-    auto num_points = queue.size();
-    std::uint32_t prev_val = 16667;
-    for (std::size_t i = 0; i < queue.size(); ++i) {
-      auto val = queue[i];
-      auto next_val = i < queue.size() - 1 ? queue[i+1] : 16667;
-      if (val > 18000 && next_val < 16667) {
-        coords.push_back(x + float(i) / num_points * graph_width);
-        coords.push_back(0);
-        colors.push_back(0.2);
-        colors.push_back(0.2);
-        colors.push_back(1.0);
-        colors.push_back(0.4);
-        coords.push_back(x + float(i) / num_points * graph_width);
-        coords.push_back(height_);
-        colors.push_back(0.2);
-        colors.push_back(0.2);
-        colors.push_back(1.0);
-        colors.push_back(0.4);
-      } else if (val > 19000 && prev_val > 16667) {
-        coords.push_back(x + float(i) / num_points * graph_width);
-        coords.push_back(0);
-        colors.push_back(1.0);
-        colors.push_back(0.0);
-        colors.push_back(0.0);
-        colors.push_back(0.4);
-        coords.push_back(x + float(i) / num_points * graph_width);
-        coords.push_back(height_);
-        colors.push_back(1.0);
-        colors.push_back(0.0);
-        colors.push_back(0.0);
-        colors.push_back(0.4);
-      } if (val > 18000 && prev_val > 16667 && val <= 19000) {
-        coords.push_back(x + float(i) / num_points * graph_width);
-        coords.push_back(0);
-        colors.push_back(1.0);
-        colors.push_back(1.0);
-        colors.push_back(0.0);
-        colors.push_back(0.2);
-        coords.push_back(x + float(i) / num_points * graph_width);
-        coords.push_back(height_);
-        colors.push_back(1.0);
-        colors.push_back(1.0);
-        colors.push_back(0.0);
-        colors.push_back(0.2);
+    marker_vertices_.clear();
+
+    if (range.live) {
+      // first queue is frame time
+      auto & queue = reader_.queues()[0];
+      auto first = range.begin - (queue.count() - queue.size());
+      auto num_points = range.end - range.begin;
+      std::uint32_t prev_val = 16667;
+      for (std::size_t i = 0; i < num_points; ++i) {
+        auto val = queue[first + i];
+        auto next_val = i < num_points - 1 ? queue[first + i + 1] : 16667;
+        auto marker_x = x + float(i) / num_points * graph_width;
+        if (val > 18000 && next_val < 16667) {
+          add_marker(marker_x, 0.2, 0.2, 1.0, 0.4);
+        } else if (val > 19000 && prev_val > 16667) {
+          add_marker(marker_x, 1.0, 0.0, 0.0, 0.4);
+        } if (val > 18000 && prev_val > 16667 && val <= 19000) {
+          add_marker(marker_x, 1.0, 1.0, 0.0, 0.2);
+        }
+        prev_val = val;
       }
-      prev_val = val;
+    } else {
+      // One marker per pixel column, for the slowest frame in it
+      auto columns = std::size_t(graph_width);
+      reader_.histories()[0].decimate(range.begin, range.end, columns, [&](auto c, auto const & s) {
+        auto marker_x = x + float(c) / columns * graph_width;
+        if (s.max > 19000) {
+          add_marker(marker_x, 1.0, 0.0, 0.0, 0.4);
+        } else if (s.max > 18000) {
+          add_marker(marker_x, 1.0, 1.0, 0.0, 0.2);
+        }
+      });
     }
-    glVertexPointer(2, GL_FLOAT, 0, coords.data());
-    glColorPointer(4, GL_FLOAT, 0, colors.data());
-    glDrawArrays(GL_LINES, 0, coords.size() / 2);
 
+    markers_.upload(marker_vertices_);
+    markers_.bind();
+    glVertexPointer(2, GL_FLOAT, sizeof(ColoredVertex), reinterpret_cast<void const *>(offsetof(ColoredVertex, x)));
+    glColorPointer(4, GL_FLOAT, sizeof(ColoredVertex), reinterpret_cast<void const *>(offsetof(ColoredVertex, r)));
+    glDrawArrays(GL_LINES, 0, marker_vertices_.size());
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+  }
+
+  void add_marker(double x, GLfloat r, GLfloat g, GLfloat b, GLfloat a) {
+    marker_vertices_.push_back({ GLfloat(x), 0, r, g, b, a });
+    marker_vertices_.push_back({ GLfloat(x), GLfloat(height_), r, g, b, a });
   }
 
   void refresh() {
@@ -338,8 +386,14 @@ private:
     current_->refresh_callback();
   }
 
+  static void scroll_callback_(GLFWwindow * window, double xoffset, double yoffset) {
+    if (yoffset != 0) {
+      current_->zoom(yoffset > 0 ? 0.5 : 2.0);
+    }
+  }
+
   void key_callback(int key, int scancode, int action, int mods) {
-    if (action == GLFW_PRESS) {
+    if (action == GLFW_PRESS || action == GLFW_REPEAT) {
       key_pressed(key, scancode, mods);
     }
   }
@@ -349,9 +403,61 @@ private:
       case GLFW_KEY_ESCAPE:
         glfwSetWindowShouldClose(win_, true);
         break;
+
+      case GLFW_KEY_UP:
+        zoom(0.5);
+        break;
+
+      case GLFW_KEY_DOWN:
+        zoom(2.0);
+        break;
+
+      case GLFW_KEY_LEFT:
+        scroll(-0.25);
+        break;
+
+      case GLFW_KEY_RIGHT:
+        scroll(0.25);
+        break;
+
+      case GLFW_KEY_HOME:
+        scroll(-std::numeric_limits<double>::infinity());
+        break;
+
+      case GLFW_KEY_END:
+        scroll(std::numeric_limits<double>::infinity());
+        break;
     }
   }
 
+  // Zooming and scrolling need the reader's history; without it, the
+  // last PerfQueue::max_frames frames are all there is to see
+  void zoom(double factor) {
+    if (reader_.histories().empty()) {
+      return;
+    }
+
+    auto max_span = std::max<std::uint64_t>(reader_.histories()[0].size(), PerflogReader::PerfQueue::max_frames);
+    span_ = std::clamp<std::uint64_t>(span_ * factor, min_span, max_span);
+    need_redraw_ = true;
+  }
+
+  // Moves the end of the range by a fraction of the span; scrolling
+  // past the newest frame follows new frames again
+  void scroll(double fraction) {
+    if (reader_.histories().empty()) {
+      return;
+    }
+
+    double count = reader_.queues()[0].count();
+    double end = follow_ ? count : end_;
+    end = std::clamp(end + fraction * span_, std::min<double>(span_, count), count);
+
+    follow_ = end >= count;
+    end_ = end;
+    need_redraw_ = true;
+  }
+
   void refresh_callback() {
     need_redraw_ = true;
   }
@@ -371,4 +477,39 @@ protected:
   std::uint64_t last_time_ = 0;
   bool need_redraw_ = false;
   bool need_refresh_ = false;
+
+private:
+  struct DecimatedPlot {
+    void draw(double x, double dx, double y, double dy) const {
+      stream.bind();
+      glPushMatrix();
+      glTranslated(x, y, 0);
+      glScaled(dx, dy, 1);
+      glVertexPointer(2, GL_FLOAT, 0, nullptr);
+      glDrawArrays(GL_LINE_STRIP, 0, vertices);
+      glPopMatrix();
+      glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    PlotStream stream;
+    std::size_t vertices = 0;
+  };
+
+  struct ColoredVertex {
+    GLfloat x, y;
+    GLfloat r, g, b, a;
+  };
+
+  static constexpr inline std::uint64_t min_span = 60;
+
+  bool follow_ = true;
+  std::uint64_t end_ = 0;
+  std::uint64_t span_ = PerflogReader::PerfQueue::max_frames;
+
+  std::vector<PlotRing> rings_;
+  std::vector<DecimatedPlot> decimated_;
+  Range decimated_range_ = { };
+  std::size_t decimated_columns_ = 0;
+  std::vector<ColoredVertex> marker_vertices_;
+  PlotStream markers_;
 };
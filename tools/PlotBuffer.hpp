@@ -0,0 +1,185 @@
+#pragma once
+
+#include <epoxy/gl.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// A vertex buffer object, for vertices that are all replaced every time
+// they change (like a plot decimated to one min/max pair per pixel
+// column).  The buffer is created on the first upload, so a PlotStream
+// can be constructed before there is a GL context.
+class PlotStream {
+public:
+  PlotStream() { }
+
+  PlotStream(PlotStream && other)
+    : vbo_(std::exchange(other.vbo_, 0))
+  {
+  }
+
+  PlotStream(PlotStream const &) = delete;
+  PlotStream & operator=(PlotStream const &) = delete;
+
+  ~PlotStream() {
+    if (vbo_) {
+      glDeleteBuffers(1, &vbo_);
+    }
+  }
+
+  template<typename Vertex>
+  void upload(std::vector<Vertex> const & vertices) {
+    if (!vbo_) {
+      glGenBuffers(1, &vbo_);
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, vbo_);
+    glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(Vertex), vertices.data(), GL_STREAM_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+  }
+
+  void bind() const { glBindBuffer(GL_ARRAY_BUFFER, vbo_); }
+
+private:
+  GLuint vbo_ = 0;
+};
+
+// The last `capacity` values of a plot, in a vertex buffer that is kept
+// from frame to frame, so only new values are uploaded.  As in
+// PerflogReader::PerfQueue, each value is stored twice, capacity apart,
+// so any part of the window is contiguous and drawn with one call.
+//
+// A value v in slot x is the pair of vertices (x, 0), (x, v): a line
+// plot uses the second of each pair, a filled plot uses both.  Slots are
+// mapped to the screen with the modelview matrix.
+class PlotRing {
+public:
+  explicit PlotRing(std::size_t capacity)
+    : capacity_(capacity)
+    , vertices_(2 * capacity * floats_per_value)
+  {
+    for (std::size_t slot = 0; slot < 2 * capacity_; ++slot) {
+      vertices_[slot * floats_per_value + 0] = slot;
+      vertices_[slot * floats_per_value + 2] = slot;
+    }
+
+    glGenBuffers(1, &vbo_);
+    glBindBuffer(GL_ARRAY_BUFFER, vbo_);
+    glBufferData(GL_ARRAY_BUFFER, vertices_.size() * sizeof(GLfloat), vertices_.data(), GL_DYNAMIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+  }
+
+  PlotRing(PlotRing && other)
+    : capacity_(other.capacity_)
+    , vertices_(std::move(other.vertices_))
+    , vbo_(std::exchange(other.vbo_, 0))
+    , count_(other.count_)
+    , dirty_begin_(other.dirty_begin_)
+    , dirty_end_(other.dirty_end_)
+  {
+  }
+
+  PlotRing(PlotRing const &) = delete;
+  PlotRing & operator=(PlotRing const &) = delete;
+
+  ~PlotRing() {
+    if (vbo_) {
+      glDeleteBuffers(1, &vbo_);
+    }
+  }
+
+  // The number of values pushed, including those no longer in the ring
+  std::uint64_t count() const { return count_; }
+  std::size_t size() const { return std::min<std::uint64_t>(count_, capacity_); }
+
+  // Carries on from the given count (e.g. 0 when the log is re-opened);
+  // the values before it are no longer drawn until they are pushed again
+  void restart(std::uint64_t count) {
+    count_ = count;
+  }
+
+  void push(std::uint32_t value) {
+    auto slot = count_++ % capacity_;
+    vertices_[slot * floats_per_value + 3] = value;
+    vertices_[(slot + capacity_) * floats_per_value + 3] = value;
+    dirty_begin_ = std::min(dirty_begin_, slot);
+    dirty_end_ = std::max(dirty_end_, slot + 1);
+  }
+
+  // Pushes the values of a PerfQueue (whose window must be no bigger
+  // than the ring) that haven't been pushed yet
+  template<typename Queue>
+  void update(Queue const & queue) {
+    auto count = queue.count() < count_ ? 0 : count_;
+    auto n = std::min<std::uint64_t>(queue.count() - count, queue.size());
+    restart(queue.count() - n);
+    for (auto it = queue.end() - n; it != queue.end(); ++it) {
+      push(*it);
+    }
+
+    upload();
+  }
+
+  void upload() {
+    if (dirty_begin_ >= dirty_end_) {
+      return;
+    }
+
+    auto offset = dirty_begin_ * floats_per_value;
+    auto size = (dirty_end_ - dirty_begin_) * floats_per_value;
+
+    glBindBuffer(GL_ARRAY_BUFFER, vbo_);
+    for (auto base : { std::size_t(0), capacity_ * floats_per_value }) {
+      glBufferSubData(GL_ARRAY_BUFFER, (base + offset) * sizeof(GLfloat), size * sizeof(GLfloat), &vertices_[base + offset]);
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    dirty_begin_ = capacity_;
+    dirty_end_ = 0;
+  }
+
+  // Draws n values starting at the first-oldest, as a line, with value i
+  // at x + i * dx and a value v at y + v * dy
+  void draw_line(std::size_t first, std::size_t n, double x, double dx, double y, double dy) const {
+    draw(first, x, dx, y, dy, [&](std::size_t slot) {
+      glVertexPointer(2, GL_FLOAT, floats_per_value * sizeof(GLfloat), reinterpret_cast<void const *>(2 * sizeof(GLfloat)));
+      glDrawArrays(GL_LINE_STRIP, slot, n);
+    });
+  }
+
+  // Same as draw_line, but filled down to 0
+  void draw_filled(std::size_t first, std::size_t n, double x, double dx, double y, double dy) const {
+    draw(first, x, dx, y, dy, [&](std::size_t slot) {
+      glVertexPointer(2, GL_FLOAT, 0, nullptr);
+      glDrawArrays(GL_QUAD_STRIP, 2 * slot, 2 * n);
+    });
+  }
+
+private:
+  template<typename Fn>
+  void draw(std::size_t first, double x, double dx, double y, double dy, Fn && fn) const {
+    auto slot = (count_ - size() + first) % capacity_;
+
+    glBindBuffer(GL_ARRAY_BUFFER, vbo_);
+    glPushMatrix();
+    glTranslated(x, y, 0);
+    glScaled(dx, dy, 1);
+    glTranslated(-double(slot), 0, 0);
+
+    fn(slot);
+
+    glPopMatrix();
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+  }
+
+  static constexpr inline std::size_t floats_per_value = 4;
+
+  std::size_t capacity_;
+  std::vector<GLfloat> vertices_;
+  GLuint vbo_ = 0;
+  std::uint64_t count_ = 0;
+  std::size_t dirty_begin_ = capacity_;
+  std::size_t dirty_end_ = 0;
+};
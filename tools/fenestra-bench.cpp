@@ -0,0 +1,277 @@
+#include "fenestra/Config.hpp"
+#include "fenestra/Core.hpp"
+#include "fenestra/Frontend.hpp"
+#include "fenestra/Context.hpp"
+#include "fenestra/Loop.hpp"
+#include "fenestra/Clock.hpp"
+
+#include "fenestra/plugins/Perflog.hpp"
+#include "fenestra/plugins/Savefile.hpp"
+#include "fenestra/plugins/V4l2Stream.hpp"
+#include "fenestra/plugins/SSR.hpp"
+#include "fenestra/plugins/Recorder.hpp"
+#include "fenestra/plugins/Framehash.hpp"
+#include "fenestra/plugins/InputMovie.hpp"
+#include "fenestra/plugins/Netcmds.hpp"
+#include "fenestra/plugins/Rusage.hpp"
+#include "fenestra/plugins/Rewind.hpp"
+#include "fenestra/plugins/Metrics.hpp"
+
+#include "popl.hpp"
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// Runs a core without a window, GL or audio device, as fast as
+// possible (or paced by a virtual clock), and reports how long each
+// step of the main loop took.  Input can come from an input movie, and
+// any plugin that does not need a window can be enabled for the run
+// (e.g. to measure the cost of capture or rewind).
+
+using namespace fenestra;
+
+namespace {
+
+// Stands in for the window, sync and audio plugins: it consumes audio,
+// paces frames if asked to, ends the run, and prints a summary of the
+// timings when it is destroyed
+class Bench
+  : public Plugin
+{
+public:
+  Bench(Config::Subtree const & config, std::string const & instance)
+    : warmup_(config.fetch<unsigned int>("warmup", 60))
+    , frames_(config.fetch<unsigned int>("frames", 3600))
+    , fps_(config.fetch<double>("fps", 0))
+    , audio_filename_(config.fetch<std::string>("audio", ""))
+  {
+    if (audio_filename_ != "") {
+      audio_.open(audio_filename_, std::ios::binary);
+      if (!audio_) {
+        throw std::runtime_error("Could not open " + audio_filename_);
+      }
+    }
+  }
+
+  ~Bench() {
+    if (end_ > start_) {
+      print_summary();
+    }
+  }
+
+  virtual void set_sample_rate(double sample_rate, double adjusted_rate) override {
+    core_fps_ = 60.0 * sample_rate / adjusted_rate;
+  }
+
+  virtual void write_audio_sample(void const * data, std::size_t frames) override {
+    if (measuring()) {
+      audio_frames_ += frames;
+    }
+
+    if (audio_.is_open()) {
+      audio_.write(static_cast<char const *>(data), frames * 2 * sizeof(std::int16_t));
+    }
+  }
+
+  // The start of each frame; with no warmup, the first frame is measured
+  // too, so the clock can't be started in window_sync
+  virtual void pre_frame_delay(State const & state) override {
+    if (iterations_ == warmup_) {
+      start_ = Clock::gettime(CLOCK_MONOTONIC);
+    }
+  }
+
+  // Where a real frontend waits for vsync
+  virtual void window_sync(State & state) override {
+    ++iterations_;
+
+    if (fps_ > 0) {
+      if (iterations_ == 1) {
+        pace_start_ = Clock::gettime(CLOCK_MONOTONIC);
+      }
+      Clock::nanosleep_until(pace_start_ + Seconds(iterations_ / fps_), CLOCK_MONOTONIC);
+    }
+
+    if (iterations_ >= warmup_ + frames_) {
+      end_ = Clock::gettime(CLOCK_MONOTONIC);
+      state.done = true;
+    }
+  }
+
+  // Called after window_sync, so iterations_ already counts this frame
+  virtual void record_probe(Probe const & probe, Probe::Dictionary const & dictionary) override {
+    if (iterations_ <= warmup_) {
+      return;
+    }
+
+    probe.for_each_perf_metric([&](Probe::Key key, Probe::Depth depth, auto value) {
+      if constexpr (std::is_same_v<decltype(value), Nanoseconds>) {
+        auto it = index_.find(key);
+        if (it == index_.end()) {
+          it = index_.emplace(key, steps_.size()).first;
+          steps_.push_back({ dictionary[key], depth, { } });
+          steps_.back().samples.reserve(frames_);
+        }
+        steps_[it->second].samples.push_back(value);
+      }
+    });
+  }
+
+private:
+  void print_summary() {
+    auto seconds = Seconds(end_ - start_).count();
+    auto fps = frames_ / seconds;
+
+    std::cout << std::fixed << std::setprecision(2)
+              << "Frames:  " << frames_ << " in " << seconds << " s: " << fps << " fps ("
+              << fps / core_fps_ << "x realtime)" << std::endl
+              << "Audio:   " << audio_frames_ / seconds << " samples/s" << std::endl
+              << std::endl
+              << std::left << std::setw(32) << "Step" << std::right
+              << std::setw(10) << "mean" << std::setw(10) << "p50" << std::setw(10) << "p90"
+              << std::setw(10) << "p99" << std::setw(10) << "max" << "  (ms)" << std::endl;
+
+    for (auto & step : steps_) {
+      auto & samples = step.samples;
+      std::sort(samples.begin(), samples.end());
+
+      auto ms = [](Nanoseconds ns) { return Milliseconds(ns).count(); };
+      auto percentile = [&](double p) { return ms(samples[std::size_t(p * (samples.size() - 1))]); };
+
+      Nanoseconds total = Nanoseconds::zero();
+      for (auto sample : samples) total += sample;
+
+      std::cout << std::left << std::setw(32) << std::string(2 * step.depth, ' ') + step.name << std::right
+                << std::setprecision(3)
+                << std::setw(10) << ms(total) / samples.size()
+                << std::setw(10) << percentile(0.5)
+                << std::setw(10) << percentile(0.9)
+                << std::setw(10) << percentile(0.99)
+                << std::setw(10) << percentile(1.0) << std::endl;
+    }
+  }
+
+  bool measuring() const { return iterations_ >= warmup_; }
+
+  struct Step {
+    std::string name;
+    Probe::Depth depth;
+    std::vector<Nanoseconds> samples;
+  };
+
+  unsigned int const & warmup_;
+  unsigned int const & frames_;
+  double const & fps_;
+  std::string const & audio_filename_;
+
+  std::ofstream audio_;
+  std::uint64_t audio_frames_ = 0;
+
+  double core_fps_ = 60;
+  std::uint64_t iterations_ = 0;
+  Timestamp start_;
+  Timestamp end_;
+  Timestamp pace_start_;
+
+  std::map<Probe::Key, std::size_t> index_;
+  std::vector<Step> steps_;
+};
+
+}
+
+int main(int argc, char *argv[]) {
+  popl::OptionParser op("Allowed options");
+  auto core_option = op.add<popl::Value<std::string>>("", "core", "Path to libretro core");
+  auto game_option = op.add<popl::Value<std::string>>("", "game", "Path to game to load");
+  auto config_option = op.add<popl::Value<std::string>>("", "config", "Path to config file (for plugin settings)");
+  auto frames_option = op.add<popl::Value<unsigned int>>("", "frames", "Frames to measure", 3600);
+  auto warmup_option = op.add<popl::Value<unsigned int>>("", "warmup", "Frames to run before measuring", 60);
+  auto fps_option = op.add<popl::Value<double>>("", "fps", "Pace frames at this rate instead of running uncapped", 0);
+  auto movie_option = op.add<popl::Value<std::string>>("", "movie", "Input movie to play");
+  auto perflog_option = op.add<popl::Value<std::string>>("", "perflog", "Write a perflog to this file");
+  auto framehash_option = op.add<popl::Value<std::string>>("", "framehash", "Write frame hashes to this file");
+  auto audio_option = op.add<popl::Value<std::string>>("", "audio", "Write audio to this file");
+  auto plugins_option = op.add<popl::Value<std::string>>("", "plugins", "Comma-separated plugins to enable (recorder, v4l2stream, ssr, savefile, netcmds, rusage, rewind, metrics)");
+  auto help_option = op.add<popl::Switch>("h", "help", "Show this help message");
+  op.parse(argc, argv);
+
+  if (help_option->is_set() || !core_option->is_set() || !game_option->is_set()) {
+    std::cout << op << std::endl;
+    return help_option->is_set() ? 0 : 1;
+  }
+
+  Config config;
+
+  if (config_option->is_set()) {
+    config.load(config_option->value());
+  }
+
+  std::map<std::string, bool> plugins { { "bench", true } };
+
+  Json::Value overrides;
+  overrides["headless"] = true;
+  overrides["bench"]["frames"] = frames_option->value();
+  overrides["bench"]["warmup"] = warmup_option->value();
+  overrides["bench"]["fps"] = fps_option->value();
+
+  if (audio_option->is_set()) {
+    overrides["bench"]["audio"] = audio_option->value();
+  }
+
+  if (movie_option->is_set()) {
+    plugins["inputmovie"] = true;
+    overrides["inputmovie"]["play"] = movie_option->value();
+    overrides["inputmovie"]["record"] = "";
+  }
+
+  if (perflog_option->is_set()) {
+    plugins["perflog"] = true;
+    overrides["perflog"]["filename"] = perflog_option->value();
+  }
+
+  if (framehash_option->is_set()) {
+    plugins["framehash"] = true;
+    overrides["framehash"]["filename"] = framehash_option->value();
+  }
+
+  if (plugins_option->is_set()) {
+    std::stringstream strm(plugins_option->value());
+    std::string name;
+    while (std::getline(strm, name, ',')) {
+      plugins[name] = true;
+    }
+  }
+
+  config.merge(overrides);
+
+  Core core(core_option->value());
+
+  Frontend frontend("Fenestra benchmark", core, config, plugins);
+
+  frontend.add_plugin<Bench>("bench");
+  frontend.add_plugin<Perflog>("perflog");
+  frontend.add_plugin<Savefile>("savefile");
+  frontend.add_plugin<V4l2Stream>("v4l2stream");
+  frontend.add_plugin<SSR>("ssr");
+  frontend.add_plugin<Recorder>("recorder");
+  frontend.add_plugin<Framehash>("framehash");
+  frontend.add_plugin<Netcmds>("netcmds");
+  frontend.add_plugin<Rusage>("rusage");
+  frontend.add_plugin<Rewind>("rewind");
+  frontend.add_plugin<InputMovie>("inputmovie");
+  frontend.add_plugin<Metrics>("metrics");
+
+  Context ctx(frontend, core, config);
+  ctx.load_game(game_option->value());
+  ctx.init();
+
+  Loop loop(frontend, ctx);
+  loop.run();
+}
@@ -0,0 +1,39 @@
+#include "fenestra/plugins/Framehash.hpp"
+
+#include <iostream>
+
+// Compares two framehash logs and reports the first frame where they
+// differ.  Exits with status 1 if they differ, so it can be used as a
+// regression gate.
+
+using namespace fenestra;
+
+int main(int argc, char * argv[]) {
+  if (argc != 3) {
+    std::cerr << "Usage: " << argv[0] << " <golden.fhash> <actual.fhash>" << std::endl;
+    return 2;
+  }
+
+  try {
+    auto golden = Framehash_Log::load(argv[1]);
+    auto actual = Framehash_Log::load(argv[2]);
+
+    auto n = std::min(golden.size(), actual.size());
+    for (std::size_t i = 0; i < n; ++i) {
+      if (std::memcmp(&golden[i], &actual[i], sizeof(golden[i])) != 0) {
+        std::cout << "First divergence at " << Framehash_Log::describe(actual[i], golden[i]) << std::endl;
+        return 1;
+      }
+    }
+
+    if (golden.size() != actual.size()) {
+      std::cout << "Matched " << n << " frames, but golden has " << golden.size() << " and actual has " << actual.size() << std::endl;
+      return 1;
+    }
+
+    std::cout << "Matched all " << n << " frames" << std::endl;
+  } catch(std::exception const & ex) {
+    std::cerr << ex.what() << std::endl;
+    return 2;
+  }
+}
@@ -1,5 +1,6 @@
 #include "PerflogViewer.hpp"
 #include "PerflogReader.hpp"
+#include "PlotBuffer.hpp"
 
 #include <iostream>
 #include <string>
@@ -146,8 +147,9 @@ public:
     });
     
     auto main_loop_names = this->main_loop_names();
-    auto main_loop_vals = this->main_loop_vals();
-    auto main_loop_stacked_vals = this->main_loop_stacked_vals(main_loop_vals);
+    auto main_loop_layers = this->main_loop_layers();
+
+    update_rings(main_loop_layers);
 
     double graph_height = 250; // 166.67 * 1.5
 
@@ -159,8 +161,7 @@ public:
         left_margin,
         height_ - top_margin,
         row_height,
-        main_loop_names,
-        main_loop_vals);
+        main_loop_names);
 
     next_x = std::max(next_x, draw_latency_labels(
         left_margin,
@@ -173,7 +174,7 @@ public:
         avgs_x,
         height_ - top_margin,
         row_height,
-        main_loop_vals);
+        main_loop_layers);
 
     draw_latency_stats(
         avgs_x,
@@ -188,8 +189,7 @@ public:
         graph_width,
         graph_height,
         0,
-        16667,
-        main_loop_stacked_vals);
+        16667);
 
     draw_latency_plot(
         next_x + column_margin,
@@ -202,7 +202,7 @@ public:
     return true;
   }
 
-  double draw_main_loop_labels(double x, double y, double row_height, std::vector<std::string> const & main_loop_names, std::vector<std::vector<std::uint32_t>> const & main_loop_vals) {
+  double draw_main_loop_labels(double x, double y, double row_height, std::vector<std::string> const & main_loop_names) {
     auto next_x = x;
     auto cidx = main_loop_names.size() - 1;
     auto text_height = 25 * 0.8;
@@ -210,27 +210,11 @@ public:
 
     font_.FaceSize(text_height);
 
-    std::size_t idx = main_loop_vals.size() - 1;
     for (auto it = main_loop_names.rbegin(); it != main_loop_names.rend(); ++it) {
       auto const & name = *it;
 
-      std::uint32_t max = 0;
-      std::uint32_t min = std::numeric_limits<std::uint32_t>::max();
-      std::uint32_t total = 0;
-      for (auto val : main_loop_vals[idx]) {
-        min = std::min(val, min);
-        max = std::max(val, max);
-        total += val;
-      }
-      auto avg = total / main_loop_vals[idx].size();
-
       std::stringstream strm;
-      strm << main_loop_label(name)
-        // << " (" << avg / 1000.0
-        // << ", " << min / 1000.0
-        // << "-" << max / 1000.0
-        // << ")"
-        ;
+      strm << main_loop_label(name);
       auto const & label = strm.str();
 
       set_stacked_color(cidx);
@@ -243,25 +227,26 @@ public:
       y -= row_height;
       next_x = std::max(pos.X(), next_x);
       --cidx;
-      --idx;
     }
 
     return next_x;
   }
 
-  double draw_main_loop_averages(double x, double y, double row_height, std::vector<std::vector<std::uint32_t>> const & main_loop_vals) {
+  double draw_main_loop_averages(double x, double y, double row_height, std::vector<std::vector<std::size_t>> const & main_loop_layers) {
     auto text_height = 25 * 0.8;
     y -= text_height * 2;
 
     font_.FaceSize(text_height);
 
     double next_x = 0;
-    for (auto it = main_loop_vals.rbegin(); it != main_loop_vals.rend(); ++it) {
-      auto const & vals = *it;
-
+    for (auto it = main_loop_layers.rbegin(); it != main_loop_layers.rend(); ++it) {
       std::uint64_t total = 0;
-      for (auto val : vals) total += val;
-      auto avg = total / vals.size();
+      std::size_t size = 0;
+      for (auto idx : *it) {
+        total += reader_.queues()[idx].total();
+        size = std::max(size, reader_.queues()[idx].size());
+      }
+      auto avg = size == 0 ? 0 : total / size;
 
       std::stringstream strm;
       strm << std::fixed << std::setprecision(2);
@@ -287,74 +272,92 @@ public:
     return main_loop_names;
   }
 
-  std::vector<std::vector<std::uint32_t>>
-  main_loop_vals() {
-    std::vector<std::vector<std::uint32_t>> main_loop_vals;
-
-    std::vector<std::uint32_t> vals;
-    for_each_main_loop_queue(reader_.queues(), [&](auto const & queue) {
-      if (vals.size() < queue.size()) {
-        vals.resize(queue.size());
+  // The queues summed into each drawn part of the main loop (a part
+  // that isn't drawn is added to the next one)
+  std::vector<std::vector<std::size_t>>
+  main_loop_layers() {
+    std::vector<std::vector<std::size_t>> main_loop_layers;
+
+    std::vector<std::size_t> layer;
+    for (std::size_t idx = 0; idx < reader_.queues().size(); ++idx) {
+      auto const & name = reader_.queues()[idx].name();
+      if (is_main_loop(name)) {
+        layer.push_back(idx);
+        if (is_drawn_main_loop(name)) {
+          main_loop_layers.push_back(layer);
+          layer.clear();
+        }
       }
+    }
 
-      std::size_t i = 0;
-      for (auto val : queue) {
-        vals[i] += val;
-        ++i;
-      }
+    return main_loop_layers;
+  }
 
-      if (is_drawn_main_loop(queue.name())) {
-        main_loop_vals.push_back(vals);
-        for (auto & val : vals) val = 0;
+  // Adds the frames read since the last update to the plot rings.  The
+  // main loop rings hold running totals of the layers, so each one is
+  // drawn stacked on the ones before it.
+  void update_rings(std::vector<std::vector<std::size_t>> const & main_loop_layers) {
+    auto const & queues = reader_.queues();
+
+    if (stacked_rings_.size() != main_loop_layers.size()) {
+      stacked_rings_.clear();
+      for (std::size_t i = 0; i < main_loop_layers.size(); ++i) {
+        stacked_rings_.emplace_back(PerflogReader::PerfQueue::max_frames);
       }
-    });
+    }
 
-    return main_loop_vals;
-  }
+    if (!stacked_rings_.empty()) {
+      auto const & queue = queues[main_loop_layers[0][0]];
+      auto count = queue.count() < stacked_rings_[0].count() ? 0 : stacked_rings_[0].count();
+      auto n = std::min<std::uint64_t>(queue.count() - count, queue.size());
 
-  std::vector<std::vector<std::uint32_t>>
-  main_loop_stacked_vals(std::vector<std::vector<std::uint32_t>> const & main_loop_vals) {
-    std::vector<std::vector<std::uint32_t>> main_loop_stacked_vals;
+      for (auto & ring : stacked_rings_) {
+        ring.restart(queue.count() - n);
+      }
 
-    std::size_t idx = 0;
-    std::vector<std::uint32_t> vals;
-    for (auto const & queue_vals : main_loop_vals) {
-      if (vals.size() < queue_vals.size()) {
-        vals.resize(queue_vals.size());
+      for (auto i = queue.size() - n; i < queue.size(); ++i) {
+        std::uint32_t total = 0;
+        for (std::size_t l = 0; l < main_loop_layers.size(); ++l) {
+          for (auto idx : main_loop_layers[l]) {
+            total += queues[idx][i];
+          }
+          stacked_rings_[l].push(total);
+        }
       }
 
-      std::size_t i = 0;
-      for (auto val : queue_vals) {
-        vals[i] += val;
-        ++i;
+      for (auto & ring : stacked_rings_) {
+        ring.upload();
       }
+    }
 
-      main_loop_stacked_vals.push_back(vals);
-      ++idx;
+    auto num_latencies = std::count_if(queues.begin(), queues.end(), [](auto const & queue) { return is_latency(queue.name()); });
+    if (latency_rings_.size() != std::size_t(num_latencies)) {
+      latency_rings_.clear();
+      for (long i = 0; i < num_latencies; ++i) {
+        latency_rings_.emplace_back(PerflogReader::PerfQueue::max_frames);
+      }
     }
 
-    return main_loop_stacked_vals;
+    std::size_t l = 0;
+    for (auto const & queue : queues) {
+      if (is_latency(queue.name())) {
+        latency_rings_[l++].update(queue);
+      }
+    }
   }
 
-  void draw_main_loop_plot(double x, double y, double graph_width, double graph_height, std::uint32_t min, std::uint32_t max, std::vector<std::vector<std::uint32_t>> const & main_loop_stacked_vals) {
+  void draw_main_loop_plot(double x, double y, double graph_width, double graph_height, std::uint32_t min, std::uint32_t max) {
     glEnableClientState(GL_VERTEX_ARRAY);
     glDisableClientState(GL_COLOR_ARRAY);
     glDisableClientState(GL_TEXTURE_COORD_ARRAY);
 
     y -= graph_height;
 
-    std::vector<std::uint32_t> vals;
-
-    std::vector<GLfloat> coords;
-
-    vals.resize(reader_.queues()[0].size());
     glColor4f(0.5, 0.5, 0.5, 0.5);
-    draw_plot(x, y, vals, min, max, graph_height, graph_width, coords);
+    draw_hline(x, y, 0, min, max, graph_height, graph_width);
 
-    auto top_line = vals;
-    for (auto & v : top_line) v = max;
     glColor4f(0.5, 0.5, 0.5, 0.5);
-    draw_plot(x, y, top_line, min, max, graph_height, graph_width, coords);
+    draw_hline(x, y, max, min, max, graph_height, graph_width);
 
     glEnable(GL_BLEND);
     glBlendFunc(GL_CONSTANT_ALPHA, GL_CONSTANT_ALPHA);
@@ -363,60 +366,57 @@ public:
     glEnable(GL_ALPHA_TEST);
     glAlphaFunc(GL_GREATER, 0);
 
-    auto cidx = main_loop_stacked_vals.size() - 1;
-    for (auto it = main_loop_stacked_vals.rbegin(); it != main_loop_stacked_vals.rend(); ++it) {
-      auto const & vals = *it;
+    auto cidx = stacked_rings_.size() - 1;
+    for (auto it = stacked_rings_.rbegin(); it != stacked_rings_.rend(); ++it) {
       set_stacked_color(cidx);
-      draw_plot_filled(x, y, vals, min, max, graph_height, graph_width, coords);
+      draw_ring(x, y, *it, true, min, max, graph_height, graph_width);
       --cidx;
     }
 
     glDisable(GL_ALPHA_TEST);
     glDisable(GL_BLEND);
 
-    cidx = main_loop_stacked_vals.size() - 1;
-    for (auto it = main_loop_stacked_vals.rbegin(); it != main_loop_stacked_vals.rend(); ++it) {
-      auto const & vals = *it;
+    cidx = stacked_rings_.size() - 1;
+    for (auto it = stacked_rings_.rbegin(); it != stacked_rings_.rend(); ++it) {
       set_stacked_color(cidx);
-      draw_plot(x, y, vals, min, max, graph_height, graph_width, coords);
+      draw_ring(x, y, *it, false, min, max, graph_height, graph_width);
       --cidx;
     }
 
-    auto lmt_line = vals;
-    for (auto & v : lmt_line) v = 16667;
     glColor4f(0.8, 0.2, 0.2, 0.5);
-    draw_plot(x, y, lmt_line, min, max, graph_height, graph_width, coords);
+    draw_hline(x, y, 16667, min, max, graph_height, graph_width);
   }
 
-  template <typename Queue>
-  void draw_plot_filled(double x, double y, Queue const & queue, std::uint32_t min, std::uint32_t max, double graph_height, double graph_width, std::vector<GLfloat> & coords) {
-    std::size_t i = 0;
-    auto num_points = queue.size();
-    coords.resize(num_points * 4);
-    for (auto val : queue) {
-      assert(i * 2 + 1 < coords.size());
-      auto pct = float(val - min) / max;
-      assert(pct >= 0.0);
-      // assert(pct <= 1.0);
-      coords[i*4 + 0] = x + float(i) / num_points * graph_width;
-      coords[i*4 + 1] = 0 * graph_height * 0.8 + y + 0.1 * graph_height;
-      coords[i*4 + 2] = x + float(i) / num_points * graph_width;
-      coords[i*4 + 3] = pct * graph_height * 0.8 + y + 0.1 * graph_height;
-      ++i;
+  void draw_ring(double x, double y, PlotRing const & ring, bool filled, double min, double max, double graph_height, double graph_width) {
+    auto n = ring.size();
+    if (n == 0) {
+      return;
     }
 
-    glVertexPointer(2, GL_FLOAT, 0, coords.data());
-    glDrawArrays(GL_QUAD_STRIP, 0, coords.size() / 2);
+    auto dy = graph_height * 0.8 / max;
+    auto value_y = y + 0.1 * graph_height - min * dy;
+
+    if (filled) {
+      ring.draw_filled(0, n, x, graph_width / n, value_y, dy);
+    } else {
+      ring.draw_line(0, n, x, graph_width / n, value_y, dy);
+    }
+  }
+
+  void draw_hline(double x, double y, double value, double min, double max, double graph_height, double graph_width) {
+    GLfloat line_y = (value - min) / max * graph_height * 0.8 + y + 0.1 * graph_height;
+    GLfloat coords[] = { GLfloat(x), line_y, GLfloat(x + graph_width), line_y };
+
+    glVertexPointer(2, GL_FLOAT, 0, coords);
+    glDrawArrays(GL_LINES, 0, 2);
   }
 
   double draw_latency_labels(double x, double y, double row_height) {
     std::vector<std::string> latency_names;
-    std::vector<std::vector<std::uint32_t>> latency_vals;
 
     for (auto const & queue : reader_.queues()) {
       if (is_latency(queue.name())) {
         latency_names.push_back(queue.name());
-        latency_vals.emplace_back(queue.begin(), queue.end());
       }
     }
 
@@ -466,19 +466,12 @@ public:
         std::stringstream strm;
 
         if (queue.name() == "Input latency") {
-          std::uint32_t total = 0;
-          for (auto val : queue) total += val;
-          auto avg = total / queue.size();
-
           strm << std::fixed << std::setprecision(2);
-          strm << avg / 1000.0;
+          strm << queue.avg() / 1000.0;
 
         } else {
-          std::uint32_t max = 0;
-          for (auto val : queue) max = std::max(max, val);
-
           strm << std::fixed << std::setprecision(2);
-          strm << max / 1000.0;
+          strm << queue.max() / 1000.0;
         }
 
         auto pos = font_.Render(strm.str().c_str(), -1, FTPoint(x, y, 0));
@@ -523,18 +516,19 @@ public:
     glBlendColor(1.0f, 1.0f, 1.0f, 0.5f);
 
     auto cidx = 0;
-    for (auto const & queue : reader_.queues()) {
-      if (is_latency(queue.name())) {
-        set_stacked_color(cidx);
-        draw_plot(x, y, queue, min, max, graph_height, graph_width, coords);
-        ++cidx;
-      }
+    for (auto const & ring : latency_rings_) {
+      set_stacked_color(cidx);
+      draw_ring(x, y, ring, false, min, max, graph_height, graph_width);
+      ++cidx;
     }
 
     glDisable(GL_ALPHA_TEST);
     glDisable(GL_BLEND);
   }
 
+private:
+  std::vector<PlotRing> stacked_rings_;
+  std::vector<PlotRing> latency_rings_;
 };
 
 int main(int argc, char * argv[]) {
@@ -9,7 +9,7 @@ int main(int argc, char * argv[]) {
     return 1;
   }
 
-  PerflogReader reader(argv[1]);
+  PerflogReader reader(argv[1], true);
   PerflogViewer app(reader, 752, 900);
 
   while (!app.done()) {
@@ -0,0 +1,101 @@
+#include "fenestra/PixelConvert.hpp"
+#include "fenestra/Clock.hpp"
+
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <vector>
+
+// Reports throughput of each pixel conversion kernel at common core
+// resolutions (and 4x those), and checks that every kernel produces
+// the same output as the scalar one.
+
+using namespace fenestra;
+
+namespace {
+
+struct Format {
+  char const * name;
+  retro_pixel_format format;
+};
+
+struct Resolution {
+  unsigned int width;
+  unsigned int height;
+};
+
+}
+
+int main(int argc, char * argv[]) {
+  Format const formats[] = {
+    { "0RGB1555", RETRO_PIXEL_FORMAT_0RGB1555 },
+    { "RGB565",   RETRO_PIXEL_FORMAT_RGB565 },
+    { "XRGB8888", RETRO_PIXEL_FORMAT_XRGB8888 },
+  };
+
+  Resolution const resolutions[] = {
+    { 256, 224 }, { 320, 240 }, { 640, 480 }, { 1024, 896 }, { 1280, 960 },
+  };
+
+  PixelConvert::ISA const isas[] = {
+    PixelConvert::ISA::SCALAR, PixelConvert::ISA::SSE2, PixelConvert::ISA::AVX2,
+  };
+
+  std::mt19937 rng(0);
+  bool ok = true;
+
+  for (auto const & format : formats) {
+    for (auto const & res : resolutions) {
+      auto Bpp = PixelConvert::bytes_per_pixel(format.format);
+
+      // Add some padding to the pitch, like many cores do
+      auto pitch = res.width * Bpp + 64;
+      std::vector<std::uint8_t> src(pitch * res.height);
+      for (auto & c : src) c = rng();
+
+      auto dest_pitch = res.width * 4;
+      std::vector<std::uint8_t> expected(dest_pitch * res.height);
+      std::vector<std::uint8_t> dest(dest_pitch * res.height);
+
+      PixelConvert(format.format, PixelConvert::ISA::SCALAR)(src.data(), pitch, expected.data(), dest_pitch, res.width, res.height);
+
+      for (auto isa : isas) {
+        if (!PixelConvert::supported(isa)) {
+          continue;
+        }
+
+        PixelConvert convert(format.format, isa);
+
+        std::memset(dest.data(), 0, dest.size());
+        convert(src.data(), pitch, dest.data(), dest_pitch, res.width, res.height);
+        if (dest != expected) {
+          std::cout << "MISMATCH: " << format.name << " " << PixelConvert::name(isa) << std::endl;
+          ok = false;
+        }
+
+        // Run for roughly a quarter of a second
+        unsigned int frames = 0;
+        auto start = Clock::gettime(CLOCK_MONOTONIC);
+        auto elapsed = Nanoseconds::zero();
+        while (elapsed < Milliseconds(250)) {
+          convert(src.data(), pitch, dest.data(), dest_pitch, res.width, res.height);
+          ++frames;
+          elapsed = Clock::gettime(CLOCK_MONOTONIC) - start;
+        }
+
+        auto per_frame = Seconds(elapsed).count() / frames;
+        auto gbps = dest.size() / per_frame / 1e9;
+
+        std::cout << std::left << std::setw(9) << format.name
+                  << std::setw(7) << PixelConvert::name(isa)
+                  << std::right << std::setw(5) << res.width << "x" << std::left << std::setw(5) << res.height
+                  << std::right << std::fixed
+                  << std::setw(9) << std::setprecision(1) << per_frame * 1e6 << " us/frame"
+                  << std::setw(8) << std::setprecision(2) << gbps << " GB/s" << std::endl;
+      }
+    }
+  }
+
+  return ok ? 0 : 1;
+}
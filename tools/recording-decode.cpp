@@ -0,0 +1,127 @@
+#include "fenestra/Recording.hpp"
+
+#include "popl.hpp"
+
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <optional>
+#include <string>
+
+// Decodes a recording made by the recorder plugin.  Prints a summary,
+// and optionally writes the frames (raw, in the core's pixel format,
+// rows packed) and the audio (interleaved stereo S16LE) to files, e.g.
+// for comparing two recordings byte for byte or feeding them to ffmpeg.
+
+using namespace fenestra;
+
+namespace {
+
+char const * format_name(std::uint32_t format) {
+  switch (format) {
+    case RETRO_PIXEL_FORMAT_0RGB1555: return "0RGB1555 (ffmpeg: rgb555le)";
+    case RETRO_PIXEL_FORMAT_XRGB8888: return "XRGB8888 (ffmpeg: bgr0)";
+    case RETRO_PIXEL_FORMAT_RGB565:   return "RGB565 (ffmpeg: rgb565le)";
+    default:                          return "unknown";
+  }
+}
+
+std::string type_name(std::uint32_t type) {
+  return std::string(reinterpret_cast<char const *>(&type), 4);
+}
+
+}
+
+int main(int argc, char * argv[]) {
+  popl::OptionParser op("Allowed options");
+  auto input_option = op.add<popl::Value<std::string>>("i", "input", "Recording to decode");
+  auto video_option = op.add<popl::Value<std::string>>("", "video", "Write raw frames to this file");
+  auto audio_option = op.add<popl::Value<std::string>>("", "audio", "Write raw audio to this file");
+  auto list_option = op.add<popl::Switch>("l", "list", "List every chunk");
+  auto help_option = op.add<popl::Switch>("h", "help", "Show this help message");
+  op.parse(argc, argv);
+
+  if (help_option->is_set() || !input_option->is_set()) {
+    std::cout << op << std::endl;
+    return help_option->is_set() ? 0 : 1;
+  }
+
+  try {
+    Recording::Reader reader(input_option->value());
+
+    std::ofstream video;
+    std::ofstream audio;
+
+    if (video_option->is_set()) {
+      video.open(video_option->value(), std::ios::binary);
+      if (!video) throw std::runtime_error("Could not open " + video_option->value());
+    }
+
+    if (audio_option->is_set()) {
+      audio.open(audio_option->value(), std::ios::binary);
+      if (!audio) throw std::runtime_error("Could not open " + audio_option->value());
+    }
+
+    std::uint64_t frames = 0;
+    std::uint64_t keyframes = 0;
+    std::uint64_t missing = 0;
+    std::uint64_t audio_frames = 0;
+    std::uint64_t compressed = 0;
+    std::uint64_t raw = 0;
+    std::optional<std::uint64_t> last_number;
+    std::int64_t first_ns = 0;
+    std::int64_t last_ns = 0;
+
+    while (reader.next()) {
+      auto const & chunk = reader.chunk();
+
+      if (list_option->is_set()) {
+        std::cout << type_name(chunk.type) << " number=" << chunk.number << " time_ns=" << chunk.time_ns << " size=" << chunk.size << std::endl;
+      }
+
+      if (chunk.type == Recording::VFMT) {
+        auto const & format = reader.video_format();
+        std::cout << "Video format: " << format.width << "x" << format.height << " " << format_name(format.format) << " from frame " << chunk.number << std::endl;
+      } else if (chunk.type == Recording::VKEY || chunk.type == Recording::VDLT) {
+        if (frames == 0) first_ns = chunk.time_ns;
+        last_ns = chunk.time_ns;
+
+        // Frames the capture pipeline dropped
+        if (last_number && chunk.number > *last_number + 1) {
+          missing += chunk.number - *last_number - 1;
+        }
+        last_number = chunk.number;
+
+        ++frames;
+        keyframes += chunk.type == Recording::VKEY;
+        compressed += chunk.size;
+        raw += reader.frame().size();
+
+        if (video.is_open()) {
+          video.write(reinterpret_cast<char const *>(reader.frame().data()), reader.frame().size());
+        }
+      } else if (chunk.type == Recording::AUDI) {
+        audio_frames += reader.audio_frames();
+
+        if (audio.is_open()) {
+          audio.write(reinterpret_cast<char const *>(reader.payload()), chunk.size);
+        }
+      }
+    }
+
+    auto const & header = reader.header();
+    std::cout << std::fixed << std::setprecision(3)
+              << "Frames: " << frames << " (" << keyframes << " keyframes, " << missing << " missing)" << std::endl
+              << "Duration: " << (last_ns - first_ns) / 1e9 << " s at " << header.fps << " fps" << std::endl
+              << "Audio: " << audio_frames << " samples at " << header.sample_rate << " Hz" << std::endl
+              << "Video size: " << raw / 1e6 << " MB raw, " << compressed / 1e6 << " MB compressed"
+              << " (ratio " << (compressed ? double(raw) / compressed : 0.0) << ")" << std::endl;
+
+    if (!video.good() || !audio.good()) {
+      throw std::runtime_error("Write failed");
+    }
+  } catch(std::exception const & ex) {
+    std::cerr << ex.what() << std::endl;
+    return 1;
+  }
+}
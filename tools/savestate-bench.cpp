@@ -0,0 +1,255 @@
+#include "fenestra/Config.hpp"
+#include "fenestra/Core.hpp"
+#include "fenestra/Frontend.hpp"
+#include "fenestra/Context.hpp"
+#include "fenestra/Clock.hpp"
+
+#include "popl.hpp"
+
+#include <zstd.h>
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Measures the cost of saving and loading state for a core, to decide
+// whether rewind, run-ahead or netplay are feasible with it.
+
+using namespace fenestra;
+
+namespace {
+
+class Timings {
+public:
+  template <typename Fn>
+  void time(Fn && fn) {
+    auto start = Clock::gettime(CLOCK_MONOTONIC);
+    std::forward<Fn>(fn)();
+    auto end = Clock::gettime(CLOCK_MONOTONIC);
+    samples_.push_back(end - start);
+  }
+
+  void print(std::string const & name, std::size_t bytes = 0) {
+    std::sort(samples_.begin(), samples_.end());
+
+    auto percentile = [&](double p) {
+      return Milliseconds(samples_[std::size_t(p * (samples_.size() - 1))]).count();
+    };
+
+    std::cout << std::left << std::setw(16) << name << std::right << std::fixed << std::setprecision(3)
+              << " min " << std::setw(8) << percentile(0.0) << " ms"
+              << " median " << std::setw(8) << percentile(0.5) << " ms"
+              << " p99 " << std::setw(8) << percentile(0.99) << " ms"
+              << " max " << std::setw(8) << percentile(1.0) << " ms";
+
+    if (bytes > 0) {
+      auto seconds = Seconds(samples_[samples_.size() / 2]).count();
+      std::cout << " " << std::setw(9) << std::setprecision(1) << bytes / seconds / 1e6 << " MB/s";
+    }
+
+    std::cout << std::endl;
+  }
+
+private:
+  std::vector<Nanoseconds> samples_;
+};
+
+std::vector<char> serialize(Core & core, std::size_t size) {
+  std::vector<char> data(size);
+  if (!core.serialize(data.data(), data.size())) {
+    throw std::runtime_error("retro_serialize failed");
+  }
+  return data;
+}
+
+void unserialize(Core & core, std::vector<char> const & data) {
+  if (!core.unserialize(data.data(), data.size())) {
+    throw std::runtime_error("retro_unserialize failed");
+  }
+}
+
+void run_frames(Context & ctx, unsigned int frames) {
+  for (unsigned int i = 0; i < frames; ++i) {
+    ctx.run_core();
+  }
+}
+
+std::size_t first_difference(std::vector<char> const & a, std::vector<char> const & b) {
+  auto n = std::min(a.size(), b.size());
+  auto [ it, _ ] = std::mismatch(a.begin(), a.begin() + n, b.begin());
+  return it - a.begin();
+}
+
+bool check_same(std::string const & what, std::vector<char> const & expected, std::vector<char> const & actual) {
+  if (expected == actual) {
+    std::cout << what << ": ok" << std::endl;
+    return true;
+  }
+
+  std::cout << what << ": MISMATCH";
+  if (expected.size() != actual.size()) {
+    std::cout << " (size " << expected.size() << " vs " << actual.size() << ")";
+  }
+  std::cout << " first difference at offset " << first_difference(expected, actual) << std::endl;
+  return false;
+}
+
+std::vector<int> parse_levels(std::string const & str) {
+  std::vector<int> levels;
+  std::stringstream strm(str);
+  std::string level;
+  while (std::getline(strm, level, ',')) {
+    levels.push_back(std::stoi(level));
+  }
+  return levels;
+}
+
+}
+
+int main(int argc, char *argv[]) {
+  popl::OptionParser op("Allowed options");
+  auto core_option = op.add<popl::Value<std::string>>("", "core", "Path to libretro core");
+  auto game_option = op.add<popl::Value<std::string>>("", "game", "Path to game to load");
+  auto config_option = op.add<popl::Value<std::string>>("", "config", "Path to config file");
+  auto warmup_option = op.add<popl::Value<unsigned int>>("", "warmup", "Frames to run before measuring", 600);
+  auto iterations_option = op.add<popl::Value<unsigned int>>("", "iterations", "Number of times to repeat each measurement", 100);
+  auto levels_option = op.add<popl::Value<std::string>>("", "levels", "Comma-separated zstd compression levels", "1,3,9,19");
+  auto frames_option = op.add<popl::Value<unsigned int>>("", "frames", "Frames to run for the determinism check", 60);
+  auto help_option = op.add<popl::Switch>("h", "help", "Show this help message");
+  op.parse(argc, argv);
+
+  if (help_option->is_set() || !core_option->is_set() || !game_option->is_set()) {
+    std::cout << op << std::endl;
+    return help_option->is_set() ? 0 : 1;
+  }
+
+  Config config;
+
+  if (config_option->is_set()) {
+    config.load(config_option->value());
+  }
+
+  Json::Value overrides;
+  overrides["headless"] = true;
+  config.merge(overrides);
+
+  Core core(core_option->value());
+
+  std::map<std::string, bool> no_plugins;
+  Frontend frontend("Fenestra savestate benchmark", core, config, no_plugins);
+
+  Context ctx(frontend, core, config);
+  ctx.load_game(game_option->value());
+  ctx.init();
+
+  auto iterations = std::max(iterations_option->value(), 1u);
+
+  run_frames(ctx, warmup_option->value());
+
+  // Serialize and unserialize
+
+  std::size_t size = 0;
+  Timings serialize_size_timings;
+  for (unsigned int i = 0; i < iterations; ++i) {
+    serialize_size_timings.time([&] { size = core.serialize_size(); });
+  }
+
+  if (size == 0) {
+    std::cout << "Core does not support save states" << std::endl;
+    return 1;
+  }
+
+  std::cout << "State size: " << size << " bytes" << std::endl;
+
+  std::vector<char> state;
+  Timings serialize_timings;
+  for (unsigned int i = 0; i < iterations; ++i) {
+    serialize_timings.time([&] { state = serialize(core, size); });
+  }
+
+  Timings unserialize_timings;
+  for (unsigned int i = 0; i < iterations; ++i) {
+    unserialize_timings.time([&] { unserialize(core, state); });
+  }
+
+  serialize_size_timings.print("serialize_size");
+  serialize_timings.print("serialize", size);
+  unserialize_timings.print("unserialize", size);
+
+  bool ok = true;
+
+  // Compression
+
+  auto * cctx = ZSTD_createCCtx();
+  auto * dctx = ZSTD_createDCtx();
+  std::vector<char> compressed(ZSTD_compressBound(size));
+  std::vector<char> decompressed(size);
+
+  for (auto level : parse_levels(levels_option->value())) {
+    std::size_t csize = 0;
+
+    Timings compress_timings;
+    for (unsigned int i = 0; i < iterations; ++i) {
+      compress_timings.time([&] {
+        csize = ZSTD_compressCCtx(cctx, compressed.data(), compressed.size(), state.data(), state.size(), level);
+      });
+    }
+
+    if (ZSTD_isError(csize)) {
+      std::cout << "zstd level " << level << ": " << ZSTD_getErrorName(csize) << std::endl;
+      continue;
+    }
+
+    std::size_t dsize = 0;
+
+    Timings decompress_timings;
+    for (unsigned int i = 0; i < iterations; ++i) {
+      decompress_timings.time([&] {
+        dsize = ZSTD_decompressDCtx(dctx, decompressed.data(), decompressed.size(), compressed.data(), csize);
+      });
+    }
+
+    if (ZSTD_isError(dsize)) {
+      std::cout << "zstd level " << level << ": decompress failed: " << ZSTD_getErrorName(dsize) << std::endl;
+      ok = false;
+      continue;
+    }
+
+    if (dsize != state.size()) {
+      std::cout << "zstd level " << level << ": decompressed " << dsize << " bytes, expected " << state.size() << std::endl;
+      ok = false;
+      continue;
+    }
+
+    std::cout << "zstd level " << level << ": " << csize << " bytes, ratio "
+              << std::setprecision(2) << double(size) / csize << std::endl;
+    compress_timings.print("  compress", size);
+    decompress_timings.print("  decompress", size);
+  }
+
+  ZSTD_freeCCtx(cctx);
+  ZSTD_freeDCtx(dctx);
+
+  // Determinism: a state must round-trip exactly, and running the same
+  // frames from the same state must always end in the same state
+
+  auto frames = frames_option->value();
+
+  auto start = serialize(core, size);
+  unserialize(core, start);
+  ok &= check_same("Round trip", start, serialize(core, size));
+
+  run_frames(ctx, frames);
+  auto first = serialize(core, size);
+
+  unserialize(core, start);
+  run_frames(ctx, frames);
+  auto second = serialize(core, size);
+
+  ok &= check_same("Replay of " + std::to_string(frames) + " frames", first, second);
+
+  return ok ? 0 : 2;
+}